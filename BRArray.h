@@ -177,6 +177,233 @@ extern "C" {
     free((size_t *)(array) - 2);\
 } while (0)
 
+// chunked arrays with stable item addresses
+//
+// items are stored in fixed size chunks that never move once allocated, so pointers to items remain valid as the array
+// grows, and adding an item never copies existing items (only the table of chunk pointers is reallocated)
+//
+// example:
+//
+// int **myChunks;                          // chunked array of ints
+//
+// chunk_array_new(myChunks, 100);          // initialize myChunks to allocate items in chunks of 100
+// chunk_array_add(myChunks, 1);            // add 1 to myChunks
+// int *p = &chunk_array_item(myChunks, 0); // p stays valid after adding more items
+//
+// for (int i = 0; i < chunk_array_count(myChunks); i++) {
+//     printf("%i, ", chunk_array_item(myChunks, i));
+// }
+//
+// chunk_array_rm_last(myChunks);           // remove the last item, pointers to it are no longer valid
+// chunk_array_clear(myChunks);             // myChunks is now empty, and p is no longer valid
+// chunk_array_free(myChunks);              // free memory allocated for myChunks and all its items
+//
+// NOTE: when adding a chunk past the capacity of the chunk table, the table's memory location may change, but the items
+// themselves never do
+
+#define chunk_array_new(array, chunkLen) do {\
+    size_t _chunk_len = (chunkLen);\
+    assert(_chunk_len > 0);\
+    (array) = (void *)((size_t *)calloc(1, 4*sizeof(*(array)) + sizeof(size_t)*3) + 3);\
+    assert((array) != NULL);\
+    chunk_array_chunk_len(array) = _chunk_len;\
+    _chunk_array_table_capacity(array) = 4;\
+    chunk_array_count(array) = 0;\
+} while (0)
+
+#define chunk_array_chunk_len(array) (((size_t *)(array))[-3])
+
+#define _chunk_array_table_capacity(array) (((size_t *)(array))[-2])
+
+#define chunk_array_count(array) (((size_t *)(array))[-1])
+
+#define chunk_array_item(array, index)\
+    ((array)[(index)/chunk_array_chunk_len(array)][(index) % chunk_array_chunk_len(array)])
+
+#define chunk_array_add(array, item) do {\
+    assert((array) != NULL);\
+    size_t _chunk_len = chunk_array_chunk_len(array), _chunk_idx = chunk_array_count(array)/_chunk_len;\
+    if (chunk_array_count(array) % _chunk_len == 0) {\
+        if (_chunk_idx + 1 > _chunk_array_table_capacity(array)) {\
+            size_t _chunk_cap = (_chunk_array_table_capacity(array) + 1)*3/2;\
+            (array) = (void *)((size_t *)realloc((size_t *)(array) - 3, _chunk_cap*sizeof(*(array)) +\
+                                                 sizeof(size_t)*3) + 3);\
+            assert((array) != NULL);\
+            _chunk_array_table_capacity(array) = _chunk_cap;\
+        }\
+        (array)[_chunk_idx] = calloc(_chunk_len, sizeof(**(array)));\
+        assert((array)[_chunk_idx] != NULL);\
+    }\
+    (array)[_chunk_idx][chunk_array_count(array)++ % _chunk_len] = (item);\
+} while (0)
+
+#define chunk_array_rm_last(array) do {\
+    assert((array) != NULL);\
+    assert(chunk_array_count(array) > 0);\
+    if (--chunk_array_count(array) % chunk_array_chunk_len(array) == 0)\
+        free((array)[chunk_array_count(array)/chunk_array_chunk_len(array)]);\
+} while (0)
+
+#define chunk_array_clear(array) do {\
+    assert((array) != NULL);\
+    size_t _chunk_i = (chunk_array_count(array) + chunk_array_chunk_len(array) - 1)/chunk_array_chunk_len(array);\
+    while (_chunk_i > 0) free((array)[--_chunk_i]);\
+    chunk_array_count(array) = 0;\
+} while (0)
+
+#define chunk_array_free(array) do {\
+    assert((array) != NULL);\
+    chunk_array_clear(array);\
+    free((size_t *)(array) - 3);\
+} while (0)
+
+// double-ended queues with type checking, stored in a growable ring buffer
+//
+// items can be added or removed at either end in constant time, and removing an item from the middle only moves the
+// items on the shorter side of it
+//
+// example:
+//
+// char *myDeque;                           // deque of chars
+//
+// deque_new(myDeque, 3);                   // initialize myDeque with a capacity of at least 3 items
+// deque_push_back(myDeque, 'b');           // add 'b' to the end of myDeque
+// deque_push_back(myDeque, 'c');           // add 'c' to the end of myDeque
+// deque_push_front(myDeque, 'a');          // add 'a' to the start of myDeque
+//
+// for (int i = 0; i < deque_count(myDeque); i++) {
+//     printf("%c, ", deque_item(myDeque, i)); // a, b, c,
+// }
+//
+// deque_pop_front(myDeque);                // remove 'a' from start of myDeque
+// deque_rm(myDeque, 1);                    // remove 'c' from myDeque
+// deque_linearize(myDeque);                // myDeque[0] is now 'b', items can be accessed as a plain C array
+// deque_clear(myDeque);                    // myDeque is now empty
+// deque_free(myDeque);                     // free memory allocated for myDeque
+//
+// NOTE: items are only stored contiguously from myDeque[0] after calling deque_linearize(), and removing an item with
+// deque_rm() may change the index of any item before it, so don't continue iterating past a removal
+// NOTE: when new items are added to a deque past its current capacity, its memory location may change, so other
+// references to it or its members must be updated
+
+#define deque_new(deque, capacity) do {\
+    size_t _deque_cap = 1, _deque_req = (capacity);\
+    while (_deque_cap < _deque_req) _deque_cap *= 2;\
+    (deque) = (void *)((size_t *)calloc(1, _deque_cap*sizeof(*(deque)) + sizeof(size_t)*3) + 3);\
+    assert((deque) != NULL);\
+    deque_capacity(deque) = _deque_cap;\
+    _deque_head(deque) = 0;\
+    deque_count(deque) = 0;\
+} while (0)
+
+#define deque_capacity(deque) (((size_t *)(deque))[-3])
+
+#define _deque_head(deque) (((size_t *)(deque))[-2])
+
+#define deque_count(deque) (((size_t *)(deque))[-1])
+
+// capacity is always a power of 2, so wrapping an index around the ring buffer is a bitwise and
+#define deque_item(deque, index) ((deque)[(_deque_head(deque) + (index)) & (deque_capacity(deque) - 1)])
+
+#define deque_front(deque) deque_item(deque, 0)
+
+#define deque_back(deque) deque_item(deque, deque_count(deque) - 1)
+
+#define _deque_grow(deque) do {\
+    size_t _deque_cap = deque_capacity(deque), _deque_wrap = 0;\
+    (deque) = (void *)((size_t *)realloc((size_t *)(deque) - 3, _deque_cap*2*sizeof(*(deque)) + sizeof(size_t)*3) + 3);\
+    assert((deque) != NULL);\
+    memset((deque) + _deque_cap, 0, _deque_cap*sizeof(*(deque)));\
+    deque_capacity(deque) = _deque_cap*2;\
+    if (_deque_head(deque) + deque_count(deque) > _deque_cap)\
+        _deque_wrap = _deque_head(deque) + deque_count(deque) - _deque_cap;\
+    memcpy((deque) + _deque_cap, (deque), _deque_wrap*sizeof(*(deque)));\
+    memset((deque), 0, _deque_wrap*sizeof(*(deque)));\
+} while (0)
+
+#define deque_push_back(deque, item) do {\
+    assert((deque) != NULL);\
+    if (deque_count(deque) + 1 > deque_capacity(deque)) _deque_grow(deque);\
+    deque_item(deque, deque_count(deque)) = (item);\
+    deque_count(deque)++;\
+} while (0)
+
+#define deque_push_front(deque, item) do {\
+    assert((deque) != NULL);\
+    if (deque_count(deque) + 1 > deque_capacity(deque)) _deque_grow(deque);\
+    _deque_head(deque) = (_deque_head(deque) + deque_capacity(deque) - 1) & (deque_capacity(deque) - 1);\
+    deque_count(deque)++;\
+    deque_front(deque) = (item);\
+} while (0)
+
+#define deque_pop_front(deque) do {\
+    assert((deque) != NULL);\
+    if (deque_count(deque) > 0) {\
+        memset(&deque_front(deque), 0, sizeof(*(deque)));\
+        _deque_head(deque) = (_deque_head(deque) + 1) & (deque_capacity(deque) - 1);\
+        deque_count(deque)--;\
+    }\
+} while (0)
+
+#define deque_pop_back(deque) do {\
+    assert((deque) != NULL);\
+    if (deque_count(deque) > 0) {\
+        memset(&deque_back(deque), 0, sizeof(*(deque)));\
+        deque_count(deque)--;\
+    }\
+} while (0)
+
+#define deque_rm_front(deque, len) do {\
+    size_t _deque_len = (len);\
+    assert((deque) != NULL);\
+    assert(_deque_len >= 0 && _deque_len <= deque_count(deque));\
+    while (_deque_len-- > 0) deque_pop_front(deque);\
+} while (0)
+
+#define deque_rm(deque, index) do {\
+    size_t _deque_i = (index);\
+    assert((deque) != NULL);\
+    assert(_deque_i >= 0 && _deque_i < deque_count(deque));\
+    if (_deque_i < deque_count(deque)/2) {\
+        for (; _deque_i > 0; _deque_i--)\
+            deque_item(deque, _deque_i) = deque_item(deque, _deque_i - 1);\
+        deque_pop_front(deque);\
+    }\
+    else {\
+        for (; _deque_i + 1 < deque_count(deque); _deque_i++)\
+            deque_item(deque, _deque_i) = deque_item(deque, _deque_i + 1);\
+        deque_pop_back(deque);\
+    }\
+} while (0)
+
+#define deque_linearize(deque) do {\
+    assert((deque) != NULL);\
+    size_t _deque_cnt = deque_count(deque), _deque_hd = _deque_head(deque), _deque_cap = deque_capacity(deque);\
+    if (_deque_hd != 0) {\
+        size_t _deque_n = (_deque_hd + _deque_cnt > _deque_cap) ? _deque_cap - _deque_hd : _deque_cnt;\
+        void *_deque_buf = malloc(_deque_cnt*sizeof(*(deque)) + 1);\
+        assert(_deque_buf != NULL);\
+        memcpy(_deque_buf, (deque) + _deque_hd, _deque_n*sizeof(*(deque)));\
+        memcpy((char *)_deque_buf + _deque_n*sizeof(*(deque)), (deque), (_deque_cnt - _deque_n)*sizeof(*(deque)));\
+        memset((deque), 0, _deque_cap*sizeof(*(deque)));\
+        memcpy((deque), _deque_buf, _deque_cnt*sizeof(*(deque)));\
+        free(_deque_buf);\
+        _deque_head(deque) = 0;\
+    }\
+} while (0)
+
+#define deque_clear(deque) do {\
+    assert((deque) != NULL);\
+    memset((deque), 0, deque_capacity(deque)*sizeof(*(deque)));\
+    _deque_head(deque) = 0;\
+    deque_count(deque) = 0;\
+} while (0)
+
+#define deque_free(deque) do {\
+    assert((deque) != NULL);\
+    free((size_t *)(deque) - 3);\
+} while (0)
+
 #ifdef __cplusplus
 }
 #endif
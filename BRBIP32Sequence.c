@@ -154,6 +154,29 @@ size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint
     return (! pubKey || sizeof(BRECPoint) <= pubKeyLen) ? sizeof(BRECPoint) : 0;
 }
 
+// sets the public key for path N(m/0H/chain/index + i) to keys[i], for each of keysCount consecutive indexes
+// returns the number of keys set, which is less than keysCount only if a derived key is invalid
+size_t BRBIP32PubKeyList(BRKey keys[], size_t keysCount, BRMasterPubKey mpk, uint32_t chain, uint32_t index)
+{
+    UInt256 chainCode = mpk.chainCode, c;
+    BRECPoint chainKey = *(BRECPoint *)mpk.pubKey, K;
+    size_t i;
+
+    assert(keys != NULL || keysCount == 0);
+    assert(memcmp(&mpk, &BR_MASTER_PUBKEY_NONE, sizeof(mpk)) != 0);
+    _CKDpub(&chainKey, &chainCode, chain); // path N(m/0H/chain)
+
+    for (i = 0; keys && i < keysCount; i++) {
+        K = chainKey;
+        c = chainCode;
+        _CKDpub(&K, &c, index + (uint32_t)i); // index'th key in chain
+        if (! BRKeySetPubKey(&keys[i], (uint8_t *)&K, sizeof(K))) break;
+    }
+
+    var_clean(&chainCode, &c);
+    return i;
+}
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index)
 {
@@ -61,6 +61,11 @@ BRMasterPubKey BRBIP32MasterPubKey(const void *seed, size_t seedLen);
 // returns number of bytes written, or pubKeyLen needed if pubKey is NULL
 size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint32_t chain, uint32_t index);
 
+// sets the public key for path N(m/0H/chain/index + i) to keys[i], for each of keysCount consecutive indexes
+// the chain key is only derived once, so this is about twice as fast as calling BRBIP32PubKey() for each index
+// returns the number of keys set, which is less than keysCount only if a derived key is invalid
+size_t BRBIP32PubKeyList(BRKey keys[], size_t keysCount, BRMasterPubKey mpk, uint32_t chain, uint32_t index);
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index);
 
@@ -53,6 +53,7 @@ BRBloomFilter *BRBloomFilterNew(double falsePositiveRate, size_t elemCount, uint
     assert(filter->filter != NULL);
     filter->hashFuncs = ((filter->length*8.0)/elemCount)*M_LN2;
     if (filter->hashFuncs > BLOOM_MAX_HASH_FUNCS) filter->hashFuncs = BLOOM_MAX_HASH_FUNCS;
+    if (filter->hashFuncs < 1) filter->hashFuncs = 1; // more than length*8/ln2 elements, filter will be saturated
     filter->tweak = tweak;
     filter->flags = flags;
 
@@ -153,6 +154,19 @@ void BRBloomFilterInsertData(BRBloomFilter *filter, const uint8_t *data, size_t
     if (data) filter->elemCount++;
 }
 
+// the probability that data not inserted into filter is matched by it, given the fraction of filter bits that are set
+double BRBloomFilterFalsePositiveRate(const BRBloomFilter *filter)
+{
+    size_t bits = 0;
+
+    assert(filter != NULL);
+    for (size_t i = 0; i < filter->length; i++) {
+        for (uint8_t b = filter->filter[i]; b; b &= b - 1) bits++;
+    }
+
+    return (filter->length > 0) ? pow((double)bits/(filter->length*8), filter->hashFuncs) : 1.0;
+}
+
 // frees memory allocated for filter
 void BRBloomFilterFree(BRBloomFilter *filter)
 {
@@ -71,6 +71,11 @@ int BRBloomFilterContainsData(const BRBloomFilter *filter, const uint8_t *data,
 // add data to filter
 void BRBloomFilterInsertData(BRBloomFilter *filter, const uint8_t *data, size_t dataLen);
 
+// the probability that data not inserted into filter is matched by it, based on how many filter bits are set
+// when elemCount exceeds what BLOOM_MAX_FILTER_LENGTH allows for, this will be higher than the rate the filter was
+// created for
+double BRBloomFilterFalsePositiveRate(const BRBloomFilter *filter);
+
 // frees memory allocated for filter
 void BRBloomFilterFree(BRBloomFilter *filter);
 
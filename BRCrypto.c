@@ -191,6 +191,59 @@ void BRSHA256(void *md32, const void *data, size_t len)
     mem_clean(buf, sizeof(buf));
 }
 
+void BRSHA256Init(BRSHA256Context *ctx)
+{
+    static const uint32_t buf[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                    0x1f83d9ab, 0x5be0cd19 }; // initial buffer values
+    
+    assert(ctx != NULL);
+    memcpy(ctx->buf, buf, sizeof(buf));
+    memset(ctx->x, 0, sizeof(ctx->x));
+    ctx->len = 0;
+}
+
+void BRSHA256Update(BRSHA256Context *ctx, const void *data, size_t len)
+{
+    size_t i = 0, off;
+    
+    assert(ctx != NULL);
+    assert(data != NULL || len == 0);
+    off = ctx->len % 64;
+    ctx->len += len;
+    
+    if (off > 0) { // fill the partial block left from the last update
+        i = (len < 64 - off) ? len : 64 - off;
+        memcpy((uint8_t *)ctx->x + off, data, i);
+        if (off + i < 64) return;
+        _BRSHA256Compress(ctx->buf, ctx->x);
+    }
+    
+    for (; i + 64 <= len; i += 64) { // process data in 64 byte blocks
+        memcpy(ctx->x, (const uint8_t *)data + i, 64);
+        _BRSHA256Compress(ctx->buf, ctx->x);
+    }
+    
+    if (i < len) memcpy(ctx->x, (const uint8_t *)data + i, len - i); // keep the remainder for the next update
+}
+
+// writes the hash of all data passed to BRSHA256Update() to md32, after which ctx must be initialized again to reuse
+void BRSHA256Final(BRSHA256Context *ctx, void *md32)
+{
+    size_t i, off;
+    
+    assert(ctx != NULL);
+    assert(md32 != NULL);
+    off = ctx->len % 64;
+    memset((uint8_t *)ctx->x + off, 0, 64 - off); // clear remainder of x
+    ((uint8_t *)ctx->x)[off] = 0x80; // append padding
+    if (off >= 56) _BRSHA256Compress(ctx->buf, ctx->x), memset(ctx->x, 0, 64); // length goes to next block
+    ctx->x[14] = be32((uint32_t)(ctx->len >> 29)), ctx->x[15] = be32((uint32_t)(ctx->len << 3)); // length in bits
+    _BRSHA256Compress(ctx->buf, ctx->x); // finalize
+    for (i = 0; i < 8; i++) ctx->buf[i] = be32(ctx->buf[i]); // endian swap
+    memcpy(md32, ctx->buf, 32); // write to md
+    mem_clean(ctx, sizeof(*ctx));
+}
+
 // double-sha-256 = sha-256(sha-256(x))
 void BRSHA256_2(void *md32, const void *data, size_t len)
 {
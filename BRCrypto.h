@@ -44,6 +44,21 @@ void BRSHA224(void *md28, const void *data, size_t len);
 // double-sha-256 = sha-256(sha-256(x))
 void BRSHA256_2(void *md32, const void *data, size_t len);
 
+// incremental sha-256 for data that comes in pieces, a copy of a context part way through can be used to hash several
+// messages that start with the same data without hashing it again
+typedef struct {
+    uint32_t buf[8];
+    uint32_t x[16];
+    uint64_t len;
+} BRSHA256Context;
+
+void BRSHA256Init(BRSHA256Context *ctx);
+
+void BRSHA256Update(BRSHA256Context *ctx, const void *data, size_t len);
+
+// writes the hash of all data passed to BRSHA256Update() to md32, after which ctx must be initialized again to reuse
+void BRSHA256Final(BRSHA256Context *ctx, void *md32);
+
 void BRSHA384(void *md48, const void *data, size_t len);
 
 void BRSHA512(void *md64, const void *data, size_t len);
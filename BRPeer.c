@@ -103,7 +103,7 @@ typedef struct {
     int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks;
     UInt256 lastBlockHash;
     BRMerkleBlock *currentBlock;
-    UInt256 *currentBlockTxHashes, *knownBlockHashes, *knownTxHashes;
+    UInt256 *currentBlockTxHashes, *knownBlockHashes, **knownTxHashes;
     BRSet *knownTxHashSet;
     volatile int socket;
     void *info;
@@ -139,19 +139,13 @@ inline static int _BRPeerIsIPv4(const BRPeer *peer)
 static void _BRPeerAddKnownTxHashes(const BRPeer *peer, const UInt256 txHashes[], size_t txCount)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    UInt256 *knownTxHashes = ctx->knownTxHashes;
-    size_t i, j;
+    size_t i, n;
     
     for (i = 0; i < txCount; i++) {
         if (! BRSetContains(ctx->knownTxHashSet, &txHashes[i])) {
-            array_add(knownTxHashes, txHashes[i]);
-            
-            if (ctx->knownTxHashes != knownTxHashes) { // check if knownTxHashes was moved to a new memory location
-                ctx->knownTxHashes = knownTxHashes;
-                BRSetClear(ctx->knownTxHashSet);
-                for (j = array_count(knownTxHashes); j > 0; j--) BRSetAdd(ctx->knownTxHashSet, &knownTxHashes[j - 1]);
-            }
-            else BRSetAdd(ctx->knownTxHashSet, &knownTxHashes[array_count(knownTxHashes) - 1]);
+            n = chunk_array_count(ctx->knownTxHashes);
+            chunk_array_add(ctx->knownTxHashes, txHashes[i]);
+            BRSetAdd(ctx->knownTxHashSet, &chunk_array_item(ctx->knownTxHashes, n)); // chunk array items never move
         }
     }
 }
@@ -341,7 +335,7 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             r = 0;
         }
         else if (ctx->currentBlockHeight > 0 && blockCount > 2 && blockCount < 500 &&
-                 ctx->currentBlockHeight + array_count(ctx->knownBlockHashes) + blockCount < ctx->lastblock) {
+                 ctx->currentBlockHeight + deque_count(ctx->knownBlockHashes) + blockCount < ctx->lastblock) {
             peer_log(peer, "non-standard inv, %zu is fewer block hash(es) than expected", blockCount);
             r = 0;
         }
@@ -355,11 +349,11 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             for (i = 0; i < blockCount; i++) {
                 blockHashes[i] = UInt256Get(blocks[i]);
                 // remember blockHashes in case we need to re-request them with an updated bloom filter
-                array_add(ctx->knownBlockHashes, blockHashes[i]);
+                deque_push_back(ctx->knownBlockHashes, blockHashes[i]);
             }
         
-            while (array_count(ctx->knownBlockHashes) > MAX_GETDATA_HASHES) {
-                array_rm_range(ctx->knownBlockHashes, 0, array_count(ctx->knownBlockHashes)/3);
+            while (deque_count(ctx->knownBlockHashes) > MAX_GETDATA_HASHES) {
+                deque_rm_front(ctx->knownBlockHashes, deque_count(ctx->knownBlockHashes)/3);
             }
         
             if (ctx->needsFilterUpdate) blockCount = 0;
@@ -398,25 +392,25 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
 static int _BRPeerAcceptTxMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    BRTransaction *tx = BRTransactionParse(msg, msgLen);
+    BRTransactionView view;
     UInt256 txHash;
     int r = 1;
 
-    if (! tx) {
+    // tx is only copied out of msg once it's known to be relayed to the wallet
+    if (! BRTransactionViewParse(&view, msg, msgLen)) {
         peer_log(peer, "malformed tx message with length: %zu", msgLen);
         r = 0;
     }
     else if (! ctx->sentFilter && ! ctx->sentGetdata) {
         peer_log(peer, "got tx message before loading filter");
-        BRTransactionFree(tx);
         r = 0;
     }
     else {
-        txHash = tx->txHash;
+        txHash = view.txHash;
         peer_log(peer, "got tx: %s", u256hex(txHash));
 
-        size_t txSize = BRTransactionSize(tx);
-        uint64_t feeAmount = BRTransactionStandardFee(tx);
+        size_t txSize = BRTransactionViewSize(&view);
+        uint64_t feeAmount = BRTransactionStandardFeeForSize(txSize);
 
         //DEV: uncomment for debugging
 //        peer_log(peer, "tx details: hash=%s, version=%d, blockHeight=%d, timestamp=%d, lockTime=%u",
@@ -439,26 +433,24 @@ static int _BRPeerAcceptTxMessage(BRPeer *peer, const uint8_t *msg, size_t msgLe
 //
 //        peer_log(peer, "tx size=%zu bytes, fee=%llu", txSize, feeAmount);
 
-        if (txSize > 0 && tx->blockHeight == TX_UNCONFIRMED && feeAmount/txSize < 10) {
+        if (txSize > 0 && feeAmount/txSize < 10) { // a parsed tx is always unconfirmed
             //don't relay to wallet
             peer_log(peer, "skipping stuck transaction: %s, (low fee: %llu litoshis/byte, min. is 10 litoshis/byte)", u256hex(txHash), feeAmount/txSize);
-            BRTransactionFree(tx);
             if (ctx->rejectedTx) ctx->rejectedTx(ctx->info, txHash, REJECT_LOWFEE);
             r = 1;
         }
         else if (ctx->relayedTx) {
-            ctx->relayedTx(ctx->info, tx);
+            ctx->relayedTx(ctx->info, BRTransactionViewMaterialize(&view));
         }
-        else BRTransactionFree(tx);
 
         if (ctx->currentBlock) { // we're collecting tx messages for a merkleblock
-            for (size_t i = array_count(ctx->currentBlockTxHashes); i > 0; i--) {
-                if (! UInt256Eq(txHash, ctx->currentBlockTxHashes[i - 1])) continue;
-                array_rm(ctx->currentBlockTxHashes, i - 1);
+            for (size_t i = 0; i < deque_count(ctx->currentBlockTxHashes); i++) { // tx usually arrive in block order
+                if (! UInt256Eq(txHash, deque_item(ctx->currentBlockTxHashes, i))) continue;
+                deque_rm(ctx->currentBlockTxHashes, i);
                 break;
             }
         
-            if (array_count(ctx->currentBlockTxHashes) == 0) { // we received the entire block including all matched tx
+            if (deque_count(ctx->currentBlockTxHashes) == 0) { // we received the entire block including all matched tx
                 BRMerkleBlock *block = ctx->currentBlock;
             
                 ctx->currentBlock = NULL;
@@ -748,16 +740,16 @@ static int _BRPeerAcceptMerkleblockMessage(BRPeer *peer, const uint8_t *msg, siz
         assert(hashes != NULL);
         count = BRMerkleBlockTxHashes(block, hashes, count);
 
-        for (size_t i = count; i > 0; i--) { // reverse order for more efficient removal as tx arrive
-            if (BRSetContains(ctx->knownTxHashSet, &hashes[i - 1])) continue;
-            array_add(ctx->currentBlockTxHashes, hashes[i - 1]);
+        for (size_t i = 0; i < count; i++) {
+            if (BRSetContains(ctx->knownTxHashSet, &hashes[i])) continue;
+            deque_push_back(ctx->currentBlockTxHashes, hashes[i]);
         }
 
         if (hashes != _hashes) free(hashes);
     }
 
     if (block) {
-        if (array_count(ctx->currentBlockTxHashes) > 0) { // wait til we get all tx messages before processing the block
+        if (deque_count(ctx->currentBlockTxHashes) > 0) { // wait til we get all tx messages before processing the block
             ctx->currentBlock = block;
         }
         else if (ctx->relayedBlock) {
@@ -845,8 +837,8 @@ static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen,
     
     if (ctx->currentBlock && strncmp(MSG_TX, type, 12) != 0) { // if we receive a non-tx message, merkleblock is done
         peer_log(peer, "incomplete merkleblock %s, expected %zu more tx, got %s", u256hex(ctx->currentBlock->blockHash),
-                 array_count(ctx->currentBlockTxHashes), type);
-        array_clear(ctx->currentBlockTxHashes);
+                 deque_count(ctx->currentBlockTxHashes), type);
+        deque_clear(ctx->currentBlockTxHashes);
         ctx->currentBlock = NULL;
         r = 0;
     }
@@ -1082,9 +1074,9 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
     assert(ctx != NULL);
     ctx->magicNumber = magicNumber;
     array_new(ctx->useragent, 40);
-    array_new(ctx->knownBlockHashes, 10);
-    array_new(ctx->currentBlockTxHashes, 10);
-    array_new(ctx->knownTxHashes, 10);
+    deque_new(ctx->knownBlockHashes, 16);
+    deque_new(ctx->currentBlockTxHashes, 16);
+    chunk_array_new(ctx->knownTxHashes, 100);
     ctx->knownTxHashSet = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     array_new(ctx->pongInfo, 10);
     array_new(ctx->pongCallback, 10);
@@ -1458,10 +1450,10 @@ void BRPeerSendGetblocks(BRPeer *peer, const UInt256 locators[], size_t locators
 void BRPeerSendInv(BRPeer *peer, const UInt256 txHashes[], size_t txCount)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    size_t knownCount = array_count(ctx->knownTxHashes);
+    size_t knownCount = chunk_array_count(ctx->knownTxHashes);
 
     _BRPeerAddKnownTxHashes(peer, txHashes, txCount);
-    txCount = array_count(ctx->knownTxHashes) - knownCount;
+    txCount = chunk_array_count(ctx->knownTxHashes) - knownCount;
 
     if (txCount > 0) {
         size_t i, off = 0, msgLen = BRVarIntSize(txCount) + (sizeof(uint32_t) + sizeof(*txHashes))*txCount;
@@ -1472,7 +1464,7 @@ void BRPeerSendInv(BRPeer *peer, const UInt256 txHashes[], size_t txCount)
         for (i = 0; i < txCount; i++) {
             UInt32SetLE(&msg[off], inv_tx);
             off += sizeof(uint32_t);
-            UInt256Set(&msg[off], ctx->knownTxHashes[knownCount + i]);
+            UInt256Set(&msg[off], chunk_array_item(ctx->knownTxHashes, knownCount + i));
             off += sizeof(UInt256);
         }
 
@@ -1537,14 +1529,15 @@ void BRPeerSendPing(BRPeer *peer, void *info, void (*pongCallback)(void *info, i
 void BRPeerRerequestBlocks(BRPeer *peer, UInt256 fromBlock)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    size_t i = array_count(ctx->knownBlockHashes);
+    size_t i = deque_count(ctx->knownBlockHashes);
     
-    while (i > 0 && ! UInt256Eq(ctx->knownBlockHashes[i - 1], fromBlock)) i--;
+    while (i > 0 && ! UInt256Eq(deque_item(ctx->knownBlockHashes, i - 1), fromBlock)) i--;
    
     if (i > 0) {
-        array_rm_range(ctx->knownBlockHashes, 0, i - 1);
-        peer_log(peer, "re-requesting %zu block(s)", array_count(ctx->knownBlockHashes));
-        BRPeerSendGetdata(peer, NULL, 0, ctx->knownBlockHashes, array_count(ctx->knownBlockHashes));
+        deque_rm_front(ctx->knownBlockHashes, i - 1);
+        deque_linearize(ctx->knownBlockHashes); // getdata needs the hashes contiguous
+        peer_log(peer, "re-requesting %zu block(s)", deque_count(ctx->knownBlockHashes));
+        BRPeerSendGetdata(peer, NULL, 0, ctx->knownBlockHashes, deque_count(ctx->knownBlockHashes));
     }
 }
 
@@ -1553,9 +1546,9 @@ void BRPeerFree(BRPeer *peer)
     BRPeerContext *ctx = (BRPeerContext *)peer;
     
     if (ctx->useragent) array_free(ctx->useragent);
-    if (ctx->currentBlockTxHashes) array_free(ctx->currentBlockTxHashes);
-    if (ctx->knownBlockHashes) array_free(ctx->knownBlockHashes);
-    if (ctx->knownTxHashes) array_free(ctx->knownTxHashes);
+    if (ctx->currentBlockTxHashes) deque_free(ctx->currentBlockTxHashes);
+    if (ctx->knownBlockHashes) deque_free(ctx->knownBlockHashes);
+    if (ctx->knownTxHashes) chunk_array_free(ctx->knownTxHashes);
     if (ctx->knownTxHashSet) BRSetFree(ctx->knownTxHashSet);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
     if (ctx->pongCallback) array_free(ctx->pongCallback);
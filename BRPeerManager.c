@@ -44,6 +44,7 @@
 #define MAX_CONNECT_FAILURES  20 // notify user of network problems after this many connect failures in a row
 #define PEER_FLAG_SYNCED      0x01
 #define PEER_FLAG_NEEDSUPDATE 0x02
+#define TX_UPDATE_BATCH_MAX   10000 // most block tx updates to defer during chain sync before applying them
 
 #define genesis_block_hash(params) UInt256Reverse((params)->checkpoints[0].hash)
 
@@ -73,11 +74,13 @@ typedef struct {
 // true if peer is contained in the list of peers associated with txHash
 static int _BRTxPeerListHasPeer(const BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
 {
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (! UInt256Eq(list[i - 1].txHash, txHash)) continue;
+    for (size_t i = deque_count(list); i > 0; i--) {
+        const BRTxPeerList *item = &deque_item(list, i - 1);
 
-        for (size_t j = array_count(list[i - 1].peers); j > 0; j--) {
-            if (BRPeerEq(&list[i - 1].peers[j - 1], peer)) return 1;
+        if (! UInt256Eq(item->txHash, txHash)) continue;
+
+        for (size_t j = array_count(item->peers); j > 0; j--) {
+            if (BRPeerEq(&item->peers[j - 1], peer)) return 1;
         }
 
         break;
@@ -89,8 +92,8 @@ static int _BRTxPeerListHasPeer(const BRTxPeerList *list, UInt256 txHash, const
 // number of peers associated with txHash
 static size_t _BRTxPeerListCount(const BRTxPeerList *list, UInt256 txHash)
 {
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (UInt256Eq(list[i - 1].txHash, txHash)) return array_count(list[i - 1].peers);
+    for (size_t i = deque_count(list); i > 0; i--) {
+        if (UInt256Eq(deque_item(list, i - 1).txHash, txHash)) return array_count(deque_item(list, i - 1).peers);
     }
 
     return 0;
@@ -99,32 +102,36 @@ static size_t _BRTxPeerListCount(const BRTxPeerList *list, UInt256 txHash)
 // adds peer to the list of peers associated with txHash and returns the new total number of peers
 static size_t _BRTxPeerListAddPeer(BRTxPeerList **list, UInt256 txHash, const BRPeer *peer)
 {
-    for (size_t i = array_count(*list); i > 0; i--) {
-        if (! UInt256Eq((*list)[i - 1].txHash, txHash)) continue;
+    for (size_t i = deque_count(*list); i > 0; i--) {
+        BRTxPeerList *item = &deque_item(*list, i - 1);
+
+        if (! UInt256Eq(item->txHash, txHash)) continue;
 
-        for (size_t j = array_count((*list)[i - 1].peers); j > 0; j--) {
-            if (BRPeerEq(&(*list)[i - 1].peers[j - 1], peer)) return array_count((*list)[i - 1].peers);
+        for (size_t j = array_count(item->peers); j > 0; j--) {
+            if (BRPeerEq(&item->peers[j - 1], peer)) return array_count(item->peers);
         }
 
-        array_add((*list)[i - 1].peers, *peer);
-        return array_count((*list)[i - 1].peers);
+        array_add(item->peers, *peer);
+        return array_count(item->peers);
     }
 
-    array_add(*list, ((BRTxPeerList) { txHash, NULL }));
-    array_new((*list)[array_count(*list) - 1].peers, PEER_MAX_CONNECTIONS);
-    array_add((*list)[array_count(*list) - 1].peers, *peer);
+    deque_push_back(*list, ((BRTxPeerList) { txHash, NULL }));
+    array_new(deque_back(*list).peers, PEER_MAX_CONNECTIONS);
+    array_add(deque_back(*list).peers, *peer);
     return 1;
 }
 
 // removes peer from the list of peers associated with txHash, returns true if peer was found
 static int _BRTxPeerListRemovePeer(BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
 {
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (! UInt256Eq(list[i - 1].txHash, txHash)) continue;
+    for (size_t i = deque_count(list); i > 0; i--) {
+        BRTxPeerList *item = &deque_item(list, i - 1);
+
+        if (! UInt256Eq(item->txHash, txHash)) continue;
 
-        for (size_t j = array_count(list[i - 1].peers); j > 0; j--) {
-            if (! BRPeerEq(&list[i - 1].peers[j - 1], peer)) continue;
-            array_rm(list[i - 1].peers, j - 1);
+        for (size_t j = array_count(item->peers); j > 0; j--) {
+            if (! BRPeerEq(&item->peers[j - 1], peer)) continue;
+            array_rm(item->peers, j - 1);
             return 1;
         }
 
@@ -169,18 +176,21 @@ inline static int _BRBlockHeightEq(const void *block, const void *otherBlock)
 
 struct BRPeerManagerStruct {
     const BRChainParams *params;
-    BRWallet *wallet;
+    BRWallet **wallets; // wallets synced over these peers, wallets[0] is the one passed to BRPeerManagerNew()
     int isConnected, connectFailureCount, misbehavinCount, dnsThreadCount, maxConnectCount, peerThreadCount;
     BRPeer *peers, *downloadPeer, fixedPeer, **connectedPeers;
     char downloadPeerName[INET6_ADDRSTRLEN + 6];
     uint32_t earliestKeyTime, syncStartHeight, filterUpdateHeight, estimatedHeight;
     BRBloomFilter *bloomFilter;
-    double fpRate, averageTxPerBlock;
+    size_t filterAddrCount; // number of wallet addresses when bloomFilter was loaded
+    double fpRate, averageTxPerBlock, filterFpRate; // filterFpRate is the rate bloomFilter can achieve at best
     BRSet *blocks, *orphans, *checkpoints;
     BRMerkleBlock *lastBlock, *lastOrphan;
     BRTxPeerList *txRelays, *txRequests;
     BRPublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
+    BRTxUpdate *txUpdates; // block tx updates deferred during chain sync, see _BRPeerManagerFlushTxUpdates()
+    int walletBatch; // true while wallet callbacks are coalesced for the chain sync, see BRWalletBeginBatch()
     void *info;
     void (*syncStarted)(void *info);
     void (*syncStopped)(void *info, int error);
@@ -192,6 +202,82 @@ struct BRPeerManagerStruct {
     pthread_mutex_t lock;
 };
 
+// returns the tx with the given hash from whichever wallet has it, or NULL if none do
+static BRTransaction *_BRPeerManagerTxForHash(BRPeerManager *manager, UInt256 txHash)
+{
+    BRTransaction *tx = NULL;
+
+    for (size_t i = 0; ! tx && i < array_count(manager->wallets); i++) {
+        tx = BRWalletTransactionForHash(manager->wallets[i], txHash);
+    }
+
+    return tx;
+}
+
+// returns the wallet that tx sends from, or NULL if it doesn't spend from any of them
+static BRWallet *_BRPeerManagerSendingWallet(BRPeerManager *manager, const BRTransaction *tx)
+{
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (BRWalletAmountSentByTx(manager->wallets[i], tx) > 0) return manager->wallets[i];
+    }
+
+    return NULL;
+}
+
+// true if tx sends from or to any of the wallets
+static int _BRPeerManagerContainsTx(BRPeerManager *manager, const BRTransaction *tx)
+{
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (BRWalletContainsTransaction(manager->wallets[i], tx)) return 1;
+    }
+
+    return 0;
+}
+
+// true if one of the wallets owns tx itself, rather than a copy of it
+static int _BRPeerManagerWalletOwnsTx(BRPeerManager *manager, const BRTransaction *tx)
+{
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (BRWalletTransactionForHash(manager->wallets[i], tx->txHash) == tx) return 1;
+    }
+
+    return 0;
+}
+
+// true if tx is owned by a wallet or the publish list, so it mustn't be given to another wallet or freed
+static int _BRPeerManagerTxIsOwned(BRPeerManager *manager, const BRTransaction *tx)
+{
+    for (size_t i = deque_count(manager->publishedTx); i > 0; i--) {
+        if (deque_item(manager->publishedTx, i - 1).tx == tx) return 1;
+    }
+
+    return _BRPeerManagerWalletOwnsTx(manager, tx);
+}
+
+// registers tx with each wallet it belongs to, or if it belongs to none and is unconfirmed, with each wallet's pool of
+// non-wallet tx for invalid tx checks, a wallet that already has the tx keeps its own (which refreshes it in the pool)
+// the first wallet without it takes ownership of tx unless it's already owned, and the others get copies, so no two
+// wallets ever own the same tx, and tx is freed if nothing ends up owning it
+// returns true if tx belongs to any of the wallets, tx must be looked up again afterward, since it may have been freed
+static int _BRPeerManagerRegisterTx(BRPeerManager *manager, BRTransaction *tx)
+{
+    int r = _BRPeerManagerContainsTx(manager, tx), owned = _BRPeerManagerTxIsOwned(manager, tx);
+    BRTransaction *t;
+
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        BRWallet *wallet = manager->wallets[i];
+
+        if (r ? ! BRWalletContainsTransaction(wallet, tx) : tx->blockHeight != TX_UNCONFIRMED) continue;
+        t = BRWalletTransactionForHash(wallet, tx->txHash);
+        if (t) BRWalletRegisterTransaction(wallet, t);
+        else if (! owned) owned = 1, BRWalletRegisterTransaction(wallet, tx);
+        else BRWalletRegisterTransaction(wallet, BRTransactionCopy(tx));
+    }
+
+    if (! owned) BRTransactionFree(tx);
+    return r;
+}
+
 static void _BRPeerManagerPeerMisbehavin(BRPeerManager *manager, BRPeer *peer)
 {
     for (size_t i = array_count(manager->peers); i > 0; i--) {
@@ -206,14 +292,34 @@ static void _BRPeerManagerPeerMisbehavin(BRPeerManager *manager, BRPeer *peer)
     BRPeerDisconnect(peer);
 }
 
+// applies the block tx updates deferred by _BRPeerManagerUpdateTx() to the wallets in one batch
+// must be called before anything that depends on wallet tx block heights, or before blocks are saved
+static void _BRPeerManagerFlushTxUpdates(BRPeerManager *manager)
+{
+    if (array_count(manager->txUpdates) == 0) return;
+
+    for (size_t i = 0; i < array_count(manager->wallets); i++) { // each wallet skips tx it doesn't have
+        BRWalletUpdateTxBatch(manager->wallets[i], manager->txUpdates, array_count(manager->txUpdates));
+    }
+
+    array_clear(manager->txUpdates);
+}
+
 static void _BRPeerManagerSyncStopped(BRPeerManager *manager)
 {
     manager->syncStartHeight = 0;
+    _BRPeerManagerFlushTxUpdates(manager);
+
+    for (size_t i = 0; manager->walletBatch && i < array_count(manager->wallets); i++) {
+        BRWalletEndBatch(manager->wallets[i]);
+    }
+
+    manager->walletBatch = 0;
 
     if (manager->downloadPeer) {
         // don't cancel timeout if there's a pending tx publish callback
-        for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
-            if (manager->publishedTx[i - 1].callback != NULL) return;
+        for (size_t i = deque_count(manager->publishedTx); i > 0; i--) {
+            if (deque_item(manager->publishedTx, i - 1).callback != NULL) return;
         }
 
         BRPeerScheduleDisconnect(manager->downloadPeer, -1); // cancel sync timeout
@@ -225,16 +331,25 @@ static void _BRPeerManagerAddTxToPublishList(BRPeerManager *manager, BRTransacti
                                              void (*callback)(void *, int))
 {
     if (tx && tx->blockHeight == TX_UNCONFIRMED) {
-        for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
-            if (BRTransactionEq(manager->publishedTx[i - 1].tx, tx)) return;
+        for (size_t i = deque_count(manager->publishedTx); i > 0; i--) {
+            if (BRTransactionEq(deque_item(manager->publishedTx, i - 1).tx, tx)) return;
         }
 
-        array_add(manager->publishedTx, ((BRPublishedTx) { tx, info, callback }));
-        array_add(manager->publishedTxHashes, tx->txHash);
+        deque_push_back(manager->publishedTx, ((BRPublishedTx) { tx, info, callback }));
+        deque_push_back(manager->publishedTxHashes, tx->txHash);
 
         for (size_t i = 0; i < tx->inCount; i++) {
-            _BRPeerManagerAddTxToPublishList(manager, BRWalletTransactionForHash(manager->wallet, tx->inputs[i].txHash),
-                                             NULL, NULL);
+            BRTransaction *t = _BRPeerManagerTxForHash(manager, tx->inputs[i].txHash);
+            size_t j = deque_count(manager->publishedTxHashes);
+
+            while (j > 0 && t && ! UInt256Eq(deque_item(manager->publishedTxHashes, j - 1), t->txHash)) j--;
+
+            // a non-wallet tx is only in the wallets' pools, which free it when it's evicted, so the list keeps a copy
+            if (j == 0 && t && t->blockHeight == TX_UNCONFIRMED && ! _BRPeerManagerContainsTx(manager, t)) {
+                t = BRTransactionCopy(t);
+            }
+
+            _BRPeerManagerAddTxToPublishList(manager, t, NULL, NULL);
         }
     }
 }
@@ -269,29 +384,52 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     // every time a new wallet address is added, the bloom filter has to be rebuilt, and each address is only used
     // for one transaction, so here we generate some spare addresses to avoid rebuilding the filter each time a
     // wallet transaction is encountered during the chain sync
-    BRWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
-    BRWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        BRWalletUnusedAddrs(manager->wallets[i], NULL, BRWalletGapLimit(manager->wallets[i], 0) + 100, 0);
+        BRWalletUnusedAddrs(manager->wallets[i], NULL, BRWalletGapLimit(manager->wallets[i], 1) + 100, 1);
+    }
 
+    _BRPeerManagerFlushTxUpdates(manager); // confirmed tx older than 100 blocks are left out of the filter
     BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
     BRSetClear(manager->orphans); // clear out orphans that may have been received on an old filter
     manager->lastOrphan = NULL;
     manager->filterUpdateHeight = manager->lastBlock->height;
 
-    size_t addrsCount = BRWalletAllAddrs(manager->wallet, NULL, 0);
-    BRAddress *addrs = malloc(addrsCount*sizeof(*addrs));
-    size_t utxosCount = BRWalletUTXOs(manager->wallet, NULL, 0);
-    BRUTXO *utxos = malloc(utxosCount*sizeof(*utxos));
+    // one filter matches the addresses and outputs of all the wallets, so peers and blocks are shared between them
+    size_t walletCount = array_count(manager->wallets), addrsCount = 0, utxosCount = 0, txCount = 0;
+    size_t a = 0, u = 0, n = 0;
     uint32_t blockHeight = (manager->lastBlock->height > 100) ? manager->lastBlock->height - 100 : 0;
-    size_t txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, blockHeight);
-    BRTransaction **transactions = malloc(txCount*sizeof(*transactions));
+    size_t txEnd[walletCount]; // transactions from wallets[i] end at txEnd[i]
+    BRAddress *addrs;
+    BRUTXO *utxos;
+    BRTransaction **transactions;
     BRBloomFilter *filter;
 
+    for (size_t i = 0; i < walletCount; i++) {
+        addrsCount += BRWalletAllAddrs(manager->wallets[i], NULL, 0);
+        utxosCount += BRWalletUTXOs(manager->wallets[i], NULL, 0);
+        txCount += BRWalletTxUnconfirmedBefore(manager->wallets[i], NULL, 0, blockHeight);
+    }
+
+    addrs = malloc(addrsCount*sizeof(*addrs));
+    utxos = malloc(utxosCount*sizeof(*utxos));
+    transactions = malloc(txCount*sizeof(*transactions));
     assert(addrs != NULL);
     assert(utxos != NULL);
     assert(transactions != NULL);
-    addrsCount = BRWalletAllAddrs(manager->wallet, addrs, addrsCount);
-    utxosCount = BRWalletUTXOs(manager->wallet, utxos, utxosCount);
-    txCount = BRWalletTxUnconfirmedBefore(manager->wallet, transactions, txCount, blockHeight);
+
+    for (size_t i = 0; i < walletCount; i++) {
+        a += BRWalletAllAddrs(manager->wallets[i], &addrs[a], addrsCount - a);
+        u += BRWalletUTXOs(manager->wallets[i], &utxos[u], utxosCount - u);
+        n += BRWalletTxUnconfirmedBefore(manager->wallets[i], &transactions[n], txCount - n, blockHeight);
+        txEnd[i] = n;
+    }
+
+    addrsCount = a, utxosCount = u, txCount = n;
+    manager->filterAddrCount = addrsCount;
+
+    // past about 18,000 elements at the default rate, the filter is capped at BLOOM_MAX_FILTER_LENGTH, so a large
+    // wallet gets a filter with a higher false positive rate rather than one that peers would reject
     filter = BRBloomFilterNew(manager->fpRate, addrsCount + utxosCount + txCount + 100, (uint32_t)BRPeerHash(peer),
                               BLOOM_UPDATE_ALL); // BUG: XXX txCount not the same as number of spent wallet outputs
 
@@ -317,14 +455,16 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
 
     free(utxos);
 
-    for (size_t i = 0; i < txCount; i++) { // also add TXOs spent within the last 100 blocks
+    for (size_t i = 0, w = 0; i < txCount; i++) { // also add TXOs spent within the last 100 blocks
+        while (i >= txEnd[w]) w++;
+
         for (size_t j = 0; j < transactions[i]->inCount; j++) {
             BRTxInput *input = &transactions[i]->inputs[j];
-            BRTransaction *tx = BRWalletTransactionForHash(manager->wallet, input->txHash);
+            BRTransaction *tx = BRWalletTransactionForHash(manager->wallets[w], input->txHash);
             uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
 
             if (tx && input->index < tx->outCount &&
-                BRWalletContainsAddress(manager->wallet, tx->outputs[input->index].address)) {
+                BRWalletContainsAddress(manager->wallets[w], tx->outputs[input->index].address)) {
                 UInt256Set(o, input->txHash);
                 UInt32SetLE(&o[sizeof(UInt256)], input->index);
                 if (! BRBloomFilterContainsData(filter, o, sizeof(o))) BRBloomFilterInsertData(filter, o,sizeof(o));
@@ -335,6 +475,7 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     free(transactions);
     if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
     manager->bloomFilter = filter;
+    manager->filterFpRate = BRBloomFilterFalsePositiveRate(filter);
     // TODO: XXX if already synced, recursively add inputs of unconfirmed receives
 
     uint8_t data[BRBloomFilterSerialize(filter, NULL, 0)];
@@ -451,24 +592,39 @@ static void _BRPeerManagerUpdateTx(BRPeerManager *manager, const UInt256 txHashe
 {
     if (blockHeight != TX_UNCONFIRMED) { // remove confirmed tx from publish list and relay counts
         for (size_t i = 0; i < txCount; i++) {
-            for (size_t j = array_count(manager->publishedTx); j > 0; j--) {
-                BRTransaction *tx = manager->publishedTx[j - 1].tx;
+            for (size_t j = deque_count(manager->publishedTx); j > 0; j--) {
+                BRTransaction *tx = deque_item(manager->publishedTx, j - 1).tx;
 
                 if (! UInt256Eq(txHashes[i], tx->txHash)) continue;
-                array_rm(manager->publishedTx, j - 1);
-                array_rm(manager->publishedTxHashes, j - 1);
-                if (! BRWalletTransactionForHash(manager->wallet, tx->txHash)) BRTransactionFree(tx);
+                deque_rm(manager->publishedTx, j - 1);
+                deque_rm(manager->publishedTxHashes, j - 1);
+                if (! _BRPeerManagerWalletOwnsTx(manager, tx)) BRTransactionFree(tx);
+                break; // publish list has no duplicates, and deque_rm() can move the items we haven't checked yet
             }
 
-            for (size_t j = array_count(manager->txRelays); j > 0; j--) {
-                if (! UInt256Eq(txHashes[i], manager->txRelays[j - 1].txHash)) continue;
-                array_free(manager->txRelays[j - 1].peers);
-                array_rm(manager->txRelays, j - 1);
+            for (size_t j = deque_count(manager->txRelays); j > 0; j--) {
+                if (! UInt256Eq(txHashes[i], deque_item(manager->txRelays, j - 1).txHash)) continue;
+                array_free(deque_item(manager->txRelays, j - 1).peers);
+                deque_rm(manager->txRelays, j - 1);
+                break;
             }
         }
+
+        for (size_t i = 0; i < txCount; i++) {
+            array_add(manager->txUpdates, ((BRTxUpdate) { txHashes[i], blockHeight, timestamp }));
+        }
+
+        // while catching up, the wallet is updated once for many blocks, rather than re-sorted after each one
+        if (manager->syncStartHeight == 0 || blockHeight >= manager->estimatedHeight ||
+            array_count(manager->txUpdates) >= TX_UPDATE_BATCH_MAX) _BRPeerManagerFlushTxUpdates(manager);
     }
+    else {
+        _BRPeerManagerFlushTxUpdates(manager); // keep updates to the same tx in order
 
-    BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, blockHeight, timestamp);
+        for (size_t i = 0; i < array_count(manager->wallets); i++) {
+            BRWalletUpdateTransactions(manager->wallets[i], txHashes, txCount, blockHeight, timestamp);
+        }
+    }
 }
 
 // unconfirmed transactions that aren't in the mempools of any of connected peers have likely dropped off the network
@@ -481,6 +637,7 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
 
     free(info);
     pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerFlushTxUpdates(manager); // tx confirmed in a deferred update must not look unconfirmed
     if (success) peer->flags |= PEER_FLAG_SYNCED;
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
@@ -493,27 +650,28 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
 
     // don't remove transactions until we're connected to maxConnectCount peers, and all peers have finished
     // relaying their mempools
-    if (count >= manager->maxConnectCount) {
+    for (size_t w = 0; count >= manager->maxConnectCount && w < array_count(manager->wallets); w++) {
+        BRWallet *wallet = manager->wallets[w];
         UInt256 hash;
-        size_t txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, TX_UNCONFIRMED);
+        size_t txCount = BRWalletTxUnconfirmedBefore(wallet, NULL, 0, TX_UNCONFIRMED);
         BRTransaction *tx[(txCount*sizeof(BRTransaction *) <= 0x1000) ? txCount : 0x1000/sizeof(BRTransaction *)];
 
-        txCount = BRWalletTxUnconfirmedBefore(manager->wallet, tx, sizeof(tx)/sizeof(*tx), TX_UNCONFIRMED);
+        txCount = BRWalletTxUnconfirmedBefore(wallet, tx, sizeof(tx)/sizeof(*tx), TX_UNCONFIRMED);
 
         for (size_t i = txCount; i > 0; i--) {
             hash = tx[i - 1]->txHash;
             isPublishing = 0;
 
-            for (size_t j = array_count(manager->publishedTx); ! isPublishing && j > 0; j--) {
-                if (BRTransactionEq(manager->publishedTx[j - 1].tx, tx[i - 1]) &&
-                    manager->publishedTx[j - 1].callback != NULL) isPublishing = 1;
+            for (size_t j = deque_count(manager->publishedTx); ! isPublishing && j > 0; j--) {
+                if (BRTransactionEq(deque_item(manager->publishedTx, j - 1).tx, tx[i - 1]) &&
+                    deque_item(manager->publishedTx, j - 1).callback != NULL) isPublishing = 1;
             }
 
             if (! isPublishing && _BRTxPeerListCount(manager->txRelays, hash) == 0 &&
                 _BRTxPeerListCount(manager->txRequests, hash) == 0) {
                 peer_log(peer, "removing tx unconfirmed at: %d, txHash: %s", manager->lastBlock->height, u256hex(hash));
                 assert(tx[i - 1]->blockHeight == TX_UNCONFIRMED);
-                BRWalletRemoveTransaction(manager->wallet, hash);
+                BRWalletRemoveTransaction(wallet, hash);
             }
             else if (! isPublishing && _BRTxPeerListCount(manager->txRelays, hash) < manager->maxConnectCount) {
                 // set timestamp 0 to mark as unverified
@@ -528,11 +686,20 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
 static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *peer)
 {
     BRPeerCallbackInfo *info;
-    size_t hashCount = 0, txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, TX_UNCONFIRMED);
+    size_t hashCount = 0, txCount = 0, n = 0;
+
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        txCount += BRWalletTxUnconfirmedBefore(manager->wallets[i], NULL, 0, TX_UNCONFIRMED);
+    }
+
     BRTransaction *tx[txCount];
     UInt256 txHashes[txCount];
 
-    txCount = BRWalletTxUnconfirmedBefore(manager->wallet, tx, txCount, TX_UNCONFIRMED);
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        n += BRWalletTxUnconfirmedBefore(manager->wallets[i], &tx[n], txCount - n, TX_UNCONFIRMED);
+    }
+
+    txCount = n;
 
     for (size_t i = 0; i < txCount; i++) {
         if (! _BRTxPeerListHasPeer(manager->txRelays, tx[i]->txHash, peer) &&
@@ -558,13 +725,14 @@ static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *pee
 
 static void _BRPeerManagerPublishPendingTx(BRPeerManager *manager, BRPeer *peer)
 {
-    for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
-        if (manager->publishedTx[i - 1].callback == NULL) continue;
+    for (size_t i = deque_count(manager->publishedTx); i > 0; i--) {
+        if (deque_item(manager->publishedTx, i - 1).callback == NULL) continue;
         BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // schedule publish timeout
         break;
     }
 
-    BRPeerSendInv(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes));
+    deque_linearize(manager->publishedTxHashes);
+    BRPeerSendInv(peer, manager->publishedTxHashes, deque_count(manager->publishedTxHashes));
 }
 
 static void _mempoolDone(void *info, int success)
@@ -601,7 +769,8 @@ static void _loadBloomFilterDone(void *info, int success)
     pthread_mutex_lock(&manager->lock);
 
     if (success) {
-        BRPeerSendMempool(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes), info,
+        deque_linearize(manager->publishedTxHashes);
+        BRPeerSendMempool(peer, manager->publishedTxHashes, deque_count(manager->publishedTxHashes), info,
                           _mempoolDone);
         pthread_mutex_unlock(&manager->lock);
     }
@@ -636,8 +805,11 @@ static void _BRPeerManagerLoadMempools(BRPeerManager *manager)
             _BRPeerManagerPublishPendingTx(manager, peer);
             BRPeerSendPing(peer, info, _loadBloomFilterDone); // load mempool after updating bloomfilter
         }
-        else BRPeerSendMempool(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes), info,
-                               _mempoolDone);
+        else {
+            deque_linearize(manager->publishedTxHashes);
+            BRPeerSendMempool(peer, manager->publishedTxHashes, deque_count(manager->publishedTxHashes), info,
+                              _mempoolDone);
+        }
     }
 }
 
@@ -869,6 +1041,14 @@ static void _BRPeerManagerFindPeersV2(BRPeerManager *manager)
             NULL // Terminator
     };
 
+    if (! UInt128IsZero(manager->fixedPeer.address)) { // a fixed peer is used instead of the hardcoded ones
+        array_set_count(manager->peers, 1);
+        manager->peers[0] = manager->fixedPeer;
+        manager->peers[0].services = services;
+        manager->peers[0].timestamp = now;
+        return;
+    }
+
     for (int i = 0; hardcodedIPs[i] != NULL; i++) {
         UInt128 peerAddr = UINT128_ZERO;
         struct in6_addr v6addr;
@@ -1002,8 +1182,8 @@ static void _peerDisconnected(void *info, int error)
     //free(info);
     pthread_mutex_lock(&manager->lock);
 
-    void *txInfo[array_count(manager->publishedTx)];
-    void (*txCallback[array_count(manager->publishedTx)])(void *, int);
+    void *txInfo[deque_count(manager->publishedTx)];
+    void (*txCallback[deque_count(manager->publishedTx)])(void *, int);
 
     if (error == EPROTO) { // if it's protocol error, the peer isn't following standard policy
         _BRPeerManagerPeerMisbehavin(manager, peer);
@@ -1021,8 +1201,8 @@ static void _peerDisconnected(void *info, int error)
                                    array_count(manager->connectedPeers) == 1)) txError = ETIMEDOUT;
     }
 
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        peerList = &manager->txRelays[i - 1];
+    for (size_t i = deque_count(manager->txRelays); i > 0; i--) {
+        peerList = &deque_item(manager->txRelays, i - 1);
 
         for (size_t j = array_count(peerList->peers); j > 0; j--) {
             if (BRPeerEq(&peerList->peers[j - 1], peer)) array_rm(peerList->peers, j - 1);
@@ -1046,16 +1226,25 @@ static void _peerDisconnected(void *info, int error)
     }
     else if (manager->connectFailureCount < MAX_CONNECT_FAILURES) willReconnect = 1;
 
-    if (txError) {
-        for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
-            if (manager->publishedTx[i - 1].callback == NULL) continue;
+    if (txError) { // rotate through the publish list once, dropping tx with pending callbacks and keeping the rest
+        for (size_t i = deque_count(manager->publishedTx); i > 0; i--) {
+            BRPublishedTx pub = deque_front(manager->publishedTx);
+            UInt256 hash = deque_front(manager->publishedTxHashes);
+
+            deque_pop_front(manager->publishedTx);
+            deque_pop_front(manager->publishedTxHashes);
+
+            if (pub.callback == NULL) {
+                deque_push_back(manager->publishedTx, pub);
+                deque_push_back(manager->publishedTxHashes, hash);
+                continue;
+            }
+
             peer_log(peer, "transaction canceled: %s", strerror(txError));
-            txInfo[txCount] = manager->publishedTx[i - 1].info;
-            txCallback[txCount] = manager->publishedTx[i - 1].callback;
+            txInfo[txCount] = pub.info;
+            txCallback[txCount] = pub.callback;
             txCount++;
-            BRTransactionFree(manager->publishedTx[i - 1].tx);
-            array_rm(manager->publishedTxHashes, i - 1);
-            array_rm(manager->publishedTx, i - 1);
+            BRTransactionFree(pub.tx);
         }
     }
 
@@ -1112,6 +1301,7 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRWallet *wallet;
     void *txInfo = NULL;
     void (*txCallback)(void *, int) = NULL;
     int isWalletTx = 0, hasPendingCallbacks = 0;
@@ -1120,15 +1310,15 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
     pthread_mutex_lock(&manager->lock);
     peer_log(peer, "relayed tx: %s", u256hex(tx->txHash));
 
-    for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
-        if (UInt256Eq(manager->publishedTxHashes[i - 1], tx->txHash)) {
-            txInfo = manager->publishedTx[i - 1].info;
-            txCallback = manager->publishedTx[i - 1].callback;
-            manager->publishedTx[i - 1].info = NULL;
-            manager->publishedTx[i - 1].callback = NULL;
+    for (size_t i = deque_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
+        if (UInt256Eq(deque_item(manager->publishedTxHashes, i - 1), tx->txHash)) {
+            txInfo = deque_item(manager->publishedTx, i - 1).info;
+            txCallback = deque_item(manager->publishedTx, i - 1).callback;
+            deque_item(manager->publishedTx, i - 1).info = NULL;
+            deque_item(manager->publishedTx, i - 1).callback = NULL;
             relayCount = _BRTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
         }
-        else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
+        else if (deque_item(manager->publishedTx, i - 1).callback != NULL) hasPendingCallbacks = 1;
     }
 
     // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
@@ -1136,9 +1326,11 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
-    if (manager->syncStartHeight == 0 || BRWalletContainsTransaction(manager->wallet, tx)) {
-        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
+    if (manager->syncStartHeight == 0 || _BRPeerManagerContainsTx(manager, tx)) {
+        UInt256 txHash = tx->txHash;
+
+        isWalletTx = _BRPeerManagerRegisterTx(manager, tx);
+        tx = _BRPeerManagerTxForHash(manager, txHash);
     }
     else {
         BRTransactionFree(tx);
@@ -1151,7 +1343,9 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
             BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
         }
 
-        if (BRWalletAmountSentByTx(manager->wallet, tx) > 0 && BRWalletTransactionIsValid(manager->wallet, tx)) {
+        wallet = _BRPeerManagerSendingWallet(manager, tx);
+
+        if (wallet && BRWalletTransactionIsValid(wallet, tx)) {
             _BRPeerManagerAddTxToPublishList(manager, tx, NULL, NULL); // add valid send tx to mempool
         }
 
@@ -1162,21 +1356,20 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
         _BRTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
 
         if (manager->bloomFilter != NULL) { // check if bloom filter is already being updated
-            BRAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
-            UInt160 hash;
-
-            // the transaction likely consumed one or more wallet addresses, so check that at least the next <gap limit>
-            // unused addresses are still matched by the bloom filter
-            BRWalletUnusedAddrs(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-            BRWalletUnusedAddrs(manager->wallet, addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-
-            for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
-                if (! BRAddressHash160(&hash, addrs[i].s) ||
-                    BRBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
-                if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
+            size_t addrsCount = 0;
+
+            // the transaction likely consumed one or more addresses of the wallets it belongs to, and wallets only
+            // generate an address once it's within the gap limit of the last used one, while the filter was loaded
+            // with 100 more, so any address generated since then must be added, and the others are still matched
+            // (this doesn't have to look up thousands of unused addresses in the filter for wallets with large gaps)
+            for (size_t w = 0; w < array_count(manager->wallets); w++) {
+                addrsCount += BRWalletAllAddrs(manager->wallets[w], NULL, 0);
+            }
+
+            if (addrsCount > manager->filterAddrCount) {
+                BRBloomFilterFree(manager->bloomFilter);
                 manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
                 _BRPeerManagerUpdateFilter(manager);
-                break;
             }
         }
     }
@@ -1201,19 +1394,19 @@ static void _peerHasTx(void *info, UInt256 txHash)
     size_t relayCount = 0;
 
     pthread_mutex_lock(&manager->lock);
-    tx = BRWalletTransactionForHash(manager->wallet, txHash);
+    tx = _BRPeerManagerTxForHash(manager, txHash);
     peer_log(peer, "has tx: %s", u256hex(txHash));
 
-    for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
-        if (UInt256Eq(manager->publishedTxHashes[i - 1], txHash)) {
-            if (! tx) tx = manager->publishedTx[i - 1].tx;
-            txInfo = manager->publishedTx[i - 1].info;
-            txCallback = manager->publishedTx[i - 1].callback;
-            manager->publishedTx[i - 1].info = NULL;
-            manager->publishedTx[i - 1].callback = NULL;
+    for (size_t i = deque_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
+        if (UInt256Eq(deque_item(manager->publishedTxHashes, i - 1), txHash)) {
+            if (! tx) tx = deque_item(manager->publishedTx, i - 1).tx;
+            txInfo = deque_item(manager->publishedTx, i - 1).info;
+            txCallback = deque_item(manager->publishedTx, i - 1).callback;
+            deque_item(manager->publishedTx, i - 1).info = NULL;
+            deque_item(manager->publishedTx, i - 1).callback = NULL;
             relayCount = _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
         }
-        else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
+        else if (deque_item(manager->publishedTx, i - 1).callback != NULL) hasPendingCallbacks = 1;
     }
 
     // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
@@ -1222,8 +1415,8 @@ static void _peerHasTx(void *info, UInt256 txHash)
     }
 
     if (tx) {
-        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
+        isWalletTx = _BRPeerManagerRegisterTx(manager, tx);
+        tx = _BRPeerManagerTxForHash(manager, txHash);
 
         // reschedule sync timeout
         if (manager->syncStartHeight > 0 && peer == manager->downloadPeer && isWalletTx) {
@@ -1251,10 +1444,12 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     BRTransaction *tx, *t;
+    BRWallet *wallet;
 
     pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerFlushTxUpdates(manager); // tx confirmed in a deferred update must not look unconfirmed
     peer_log(peer, "rejected tx: %s", u256hex(txHash));
-    tx = BRWalletTransactionForHash(manager->wallet, txHash);
+    tx = _BRPeerManagerTxForHash(manager, txHash);
     _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
 
     if (tx) {
@@ -1262,18 +1457,29 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
         // Handle tx rejection
         if (tx->blockHeight == TX_UNCONFIRMED && (code == REJECT_DUST || code == REJECT_LOWFEE || code == REJECT_NONSTANDARD)) {
             peer_log(peer, "transaction rejected as dust/lowfee/nonstandard, removing: %s", u256hex(txHash));
-            BRWalletRemoveTransaction(manager->wallet, txHash);
+
+            for (size_t i = deque_count(manager->publishedTx); i > 0; i--) { // the wallets free it, so keep a copy
+                t = deque_item(manager->publishedTx, i - 1).tx;
+                if (! UInt256Eq(t->txHash, txHash) || ! _BRPeerManagerWalletOwnsTx(manager, t)) continue;
+                deque_item(manager->publishedTx, i - 1).tx = BRTransactionCopy(t);
+            }
+
+            for (size_t i = 0; i < array_count(manager->wallets); i++) {
+                BRWalletRemoveTransaction(manager->wallets[i], txHash);
+            }
+
+            tx = _BRPeerManagerTxForHash(manager, txHash);
         }
 
-        if (_BRTxPeerListRemovePeer(manager->txRelays, txHash, peer) && tx->blockHeight == TX_UNCONFIRMED) {
+        if (_BRTxPeerListRemovePeer(manager->txRelays, txHash, peer) && tx && tx->blockHeight == TX_UNCONFIRMED) {
             // set timestamp 0 to mark tx as unverified
             _BRPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, 0);
         }
 
         // if we get rejected for any reason other than double-spend, the peer is likely misconfigured
-        if (code != REJECT_SPENT && BRWalletAmountSentByTx(manager->wallet, tx) > 0) {
+        if (code != REJECT_SPENT && tx && (wallet = _BRPeerManagerSendingWallet(manager, tx)) != NULL) {
             for (size_t i = 0; i < tx->inCount; i++) { // check that all inputs are confirmed before dropping peer
-                t = BRWalletTransactionForHash(manager->wallet, tx->inputs[i].txHash);
+                t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
                 if (! t || t->blockHeight != TX_UNCONFIRMED) continue;
                 tx = NULL;
                 break;
@@ -1364,7 +1570,7 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     // track the observed bloom filter false positive rate using a low pass filter to smooth out variance
     if (peer == manager->downloadPeer && block->totalTx > 0) {
         for (i = 0; i < txCount; i++) { // wallet tx are not false-positives
-            if (! BRWalletTransactionForHash(manager->wallet, txHashes[i])) fpCount++;
+            if (! _BRPeerManagerTxForHash(manager, txHashes[i])) fpCount++;
         }
 
         // moving average number of tx-per-block
@@ -1377,8 +1583,9 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         peer_log(peer, "adjusted preferred fpRate: %f", manager->fpRate);
 
         // false positive rate sanity check
+        // (a saturated filter matches more than that, so it's compared to the rate expected of the filter too)
         if (BRPeerConnectStatus(peer) == BRPeerStatusConnected &&
-            manager->fpRate > BLOOM_DEFAULT_FALSEPOSITIVE_RATE*10.0) {
+            manager->fpRate > BLOOM_DEFAULT_FALSEPOSITIVE_RATE*10.0 && manager->fpRate > manager->filterFpRate*10.0) {
             peer_log(peer, "bloom filter false positive rate %f too high after %"PRIu32" blocks, disconnecting...",
                      manager->fpRate, manager->lastBlock->height + 1 - manager->filterUpdateHeight);
 
@@ -1388,7 +1595,8 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
             BRPeerDisconnect(peer);
         }
         else if (manager->lastBlock->height + 500 < BRPeerLastBlock(peer) &&
-                 manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*10.0) {
+                 manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*10.0 &&
+                 manager->fpRate > manager->filterFpRate*10.0) {
             _BRPeerManagerUpdateFilter(manager); // rebuild bloom filter when it starts to degrade
         }
     }
@@ -1508,7 +1716,11 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
 
             peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, block->height);
 
-            BRWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
+            _BRPeerManagerFlushTxUpdates(manager);
+
+            for (i = 0; i < array_count(manager->wallets); i++) { // mark tx after the join point as unconfirmed
+                BRWalletSetTxUnconfirmedAfter(manager->wallets[i], b->height);
+            }
 
             b = block;
 
@@ -1526,9 +1738,14 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
                 count = BRMerkleBlockTxHashes(b, txHashes, count);
                 b = BRSetGet(manager->blocks, &b->prevBlock);
                 if (b) timestamp = timestamp/2 + b->timestamp/2;
-                if (count > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, count, height, timestamp);
+
+                for (i = 0; i < count; i++) {
+                    array_add(manager->txUpdates, ((BRTxUpdate) { txHashes[i], height, timestamp }));
+                }
             }
 
+            _BRPeerManagerFlushTxUpdates(manager); // the whole new main chain is applied as one batch
+
             manager->lastBlock = block;
 
             if (block->height == manager->estimatedHeight) { // chain download is complete
@@ -1560,6 +1777,9 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
     if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
     assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
+
+    // wallet tx heights must be current once their blocks are saved, or confirmations are reported
+    if (i > 0 || (block && block->height >= BRPeerLastBlock(peer))) _BRPeerManagerFlushTxUpdates(manager);
     pthread_mutex_unlock(&manager->lock);
     if (i > 0 && manager->saveBlocks) manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
 
@@ -1601,10 +1821,13 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
         if (BRPeerFeePerKb(p) > maxFeePerKb) secondFeePerKb = maxFeePerKb, maxFeePerKb = BRPeerFeePerKb(p);
     }
 
-    if (secondFeePerKb*3/2 > DEFAULT_FEE_PER_KB && secondFeePerKb*3/2 <= MAX_FEE_PER_KB &&
-        secondFeePerKb*3/2 > BRWalletFeePerKb(manager->wallet)) {
-        peer_log(peer, "increasing feePerKb to %"PRIu64" based on feefilter messages from peers", secondFeePerKb*3/2);
-        BRWalletSetFeePerKb(manager->wallet, secondFeePerKb*3/2);
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (secondFeePerKb*3/2 > DEFAULT_FEE_PER_KB && secondFeePerKb*3/2 <= MAX_FEE_PER_KB &&
+            secondFeePerKb*3/2 > BRWalletFeePerKb(manager->wallets[i])) {
+            peer_log(peer, "increasing feePerKb to %"PRIu64" based on feefilter messages from peers",
+                     secondFeePerKb*3/2);
+            BRWalletSetFeePerKb(manager->wallets[i], secondFeePerKb*3/2);
+        }
     }
 
     pthread_mutex_unlock(&manager->lock);
@@ -1633,32 +1856,38 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
 //    BRPeerCallbackInfo *pingInfo;
     BRTransaction *tx = NULL;
+    BRWallet *wallet;
     void *txInfo = NULL;
     void (*txCallback)(void *, int) = NULL;
     int hasPendingCallbacks = 0, error = 0;
+    size_t rmIdx = 0;
 
     pthread_mutex_lock(&manager->lock);
 
-    for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
-        if (UInt256Eq(manager->publishedTxHashes[i - 1], txHash)) {
-            tx = manager->publishedTx[i - 1].tx;
-            txInfo = manager->publishedTx[i - 1].info;
-            txCallback = manager->publishedTx[i - 1].callback;
-            manager->publishedTx[i - 1].info = NULL;
-            manager->publishedTx[i - 1].callback = NULL;
-
-            if (tx && ! BRWalletTransactionIsValid(manager->wallet, tx)) {
-                error = EINVAL;
-                array_rm(manager->publishedTx, i - 1);
-                array_rm(manager->publishedTxHashes, i - 1);
-
-                if (! BRWalletTransactionForHash(manager->wallet, txHash)) {
-                    BRTransactionFree(tx);
-                    tx = NULL;
-                }
+    for (size_t i = deque_count(manager->publishedTx); i > 0; i--) {
+        if (UInt256Eq(deque_item(manager->publishedTxHashes, i - 1), txHash)) {
+            tx = deque_item(manager->publishedTx, i - 1).tx;
+            txInfo = deque_item(manager->publishedTx, i - 1).info;
+            txCallback = deque_item(manager->publishedTx, i - 1).callback;
+            deque_item(manager->publishedTx, i - 1).info = NULL;
+            deque_item(manager->publishedTx, i - 1).callback = NULL;
+
+            wallet = (tx) ? _BRPeerManagerSendingWallet(manager, tx) : NULL;
+            if (tx && ! BRWalletTransactionIsValid((wallet) ? wallet : manager->wallets[0], tx)) {
+                error = EINVAL, rmIdx = i - 1;
             }
         }
-        else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
+        else if (deque_item(manager->publishedTx, i - 1).callback != NULL) hasPendingCallbacks = 1;
+    }
+
+    if (error) { // remove after the scan, since deque_rm() can move the items we haven't checked yet
+        deque_rm(manager->publishedTx, rmIdx);
+        deque_rm(manager->publishedTxHashes, rmIdx);
+
+        if (! _BRPeerManagerWalletOwnsTx(manager, tx)) {
+            BRTransactionFree(tx);
+            tx = NULL;
+        }
     }
 
     // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
@@ -1668,7 +1897,7 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
 
     if (tx && ! error) {
         _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
-        BRWalletRegisterTransaction(manager->wallet, tx);
+        _BRPeerManagerRegisterTx(manager, tx);
     }
 
 //    pingInfo = calloc(1, sizeof(*pingInfo));
@@ -1720,7 +1949,8 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     assert(blocks != NULL || blocksCount == 0);
     assert(peers != NULL || peersCount == 0);
     manager->params = params;
-    manager->wallet = wallet;
+    array_new(manager->wallets, 1);
+    array_add(manager->wallets, wallet);
     manager->earliestKeyTime = earliestKeyTime;
     manager->averageTxPerBlock = 1400;
     manager->maxConnectCount = PEER_MAX_CONNECTIONS;
@@ -1728,7 +1958,7 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     if (peers) array_add_array(manager->peers, peers, peersCount);
     qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
     array_new(manager->connectedPeers, PEER_MAX_CONNECTIONS);
-    manager->blocks = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, blocksCount);
+    manager->blocks = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, blocksCount + params->checkpointsCount);
     manager->orphans = BRSetNew(_BRPrevBlockHash, _BRPrevBlockEq, blocksCount); // orphans are indexed by prevBlock
     manager->checkpoints = BRSetNew(_BRBlockHeightHash, _BRBlockHeightEq, 100); // checkpoints are indexed by height
     manager->fpRate = fpRate; //loading the preferred rate
@@ -1745,10 +1975,10 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     }
 
     block = NULL;
+    if (blocks) BRSetAddBulk(manager->orphans, (void **)blocks, blocksCount);
 
     for (size_t i = 0; blocks && i < blocksCount; i++) {
         assert(blocks[i]->height != BLOCK_UNKNOWN_HEIGHT); // height must be saved/restored along with serialized block
-        BRSetAdd(manager->orphans, blocks[i]);
 
         if ((blocks[i]->height % BLOCK_DIFFICULTY_INTERVAL) == 0 &&
             (! block || blocks[i]->height > block->height)) block = blocks[i]; // find last transition block
@@ -1763,10 +1993,11 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
         block = BRSetGet(manager->orphans, &orphan);
     }
 
-    array_new(manager->txRelays, 10);
-    array_new(manager->txRequests, 10);
-    array_new(manager->publishedTx, 10);
-    array_new(manager->publishedTxHashes, 10);
+    deque_new(manager->txRelays, 16);
+    deque_new(manager->txRequests, 16);
+    deque_new(manager->publishedTx, 16);
+    deque_new(manager->publishedTxHashes, 16);
+    array_new(manager->txUpdates, 100);
     pthread_mutex_init(&manager->lock, NULL);
     manager->threadCleanup = _dummyThreadCleanup;
     return manager;
@@ -1816,6 +2047,64 @@ void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t
     pthread_mutex_unlock(&manager->lock);
 }
 
+// adds a wallet to sync over the same peers, header chain and bloom filter as the wallet passed to BRPeerManagerNew()
+// each tx is registered with every wallet it belongs to, earliestKeyTime is when the wallet's keys were created, and
+// BRPeerManagerRescan() is needed to find its tx in blocks that were already synced
+void BRPeerManagerAddWallet(BRPeerManager *manager, BRWallet *wallet, uint32_t earliestKeyTime)
+{
+    assert(manager != NULL);
+    assert(wallet != NULL);
+    pthread_mutex_lock(&manager->lock);
+
+    for (size_t i = 0; wallet && i < array_count(manager->wallets); i++) {
+        if (manager->wallets[i] == wallet) wallet = NULL; // already added
+    }
+
+    if (wallet) {
+        array_add(manager->wallets, wallet);
+        if (manager->walletBatch) BRWalletBeginBatch(wallet);
+        if (earliestKeyTime < manager->earliestKeyTime) manager->earliestKeyTime = earliestKeyTime;
+        if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
+        manager->bloomFilter = NULL; // reset bloom filter so it's recreated with the new wallet's addresses
+        _BRPeerManagerUpdateFilter(manager);
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// stops syncing a wallet added with BRPeerManagerAddWallet(), after which it can be freed
+// the bloom filter isn't rebuilt, so it matches the wallet's addresses until the next filter update
+void BRPeerManagerRemoveWallet(BRPeerManager *manager, BRWallet *wallet)
+{
+    BRTransaction *tx, *t;
+    size_t n;
+
+    assert(manager != NULL);
+    assert(wallet != NULL && wallet != manager->wallets[0]);
+    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerFlushTxUpdates(manager); // deferred updates may include the wallet's tx
+
+    for (size_t i = array_count(manager->wallets); i > 1; i--) {
+        if (manager->wallets[i - 1] != wallet) continue;
+        array_rm(manager->wallets, i - 1);
+
+        for (size_t j = deque_count(manager->publishedTx); j > 0; j--) { // don't leave tx it owns in the publish list
+            tx = deque_item(manager->publishedTx, j - 1).tx;
+            if (BRWalletTransactionForHash(wallet, tx->txHash) != tx) continue;
+            t = _BRPeerManagerTxForHash(manager, tx->txHash); // another wallet's copy, or else the list owns one
+            deque_item(manager->publishedTx, j - 1).tx = (t) ? t : BRTransactionCopy(tx);
+        }
+
+        // its addresses stay in the filter until it's next loaded, but mustn't hide new addresses of the others
+        n = BRWalletAllAddrs(wallet, NULL, 0);
+        manager->filterAddrCount = (manager->filterAddrCount > n) ? manager->filterAddrCount - n : 0;
+        if (manager->walletBatch) BRWalletEndBatch(wallet);
+        break;
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+}
+
 uint16_t BRPeerManagerStandardPort(BRPeerManager *manager)
 {
     assert(manager != NULL);
@@ -1853,6 +2142,12 @@ void BRPeerManagerConnect(BRPeerManager *manager)
     if ((! manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) &&
         manager->syncStartHeight == 0) {
         manager->syncStartHeight = manager->lastBlock->height + 1;
+
+        for (size_t i = 0; ! manager->walletBatch && i < array_count(manager->wallets); i++) {
+            BRWalletBeginBatch(manager->wallets[i]); // a rescan continues the current batch
+        }
+
+        manager->walletBatch = 1;
         pthread_mutex_unlock(&manager->lock);
         if (manager->syncStarted) manager->syncStarted(manager->info);
         pthread_mutex_lock(&manager->lock);
@@ -1974,6 +2269,8 @@ void BRPeerManagerRescan(BRPeerManager *manager)
     pthread_mutex_lock(&manager->lock);
 
     if (manager->isConnected) {
+        _BRPeerManagerFlushTxUpdates(manager);
+
         // start the chain download from the most recent checkpoint that's at least a week older than earliestKeyTime
         for (size_t i = manager->params->checkpointsCount; i > 0; i--) {
             if (i - 1 == 0 || manager->params->checkpoints[i - 1].timestamp + 7*24*60*60 < manager->earliestKeyTime) {
@@ -2172,9 +2469,9 @@ size_t BRPeerManagerRelayCount(BRPeerManager *manager, UInt256 txHash)
     assert(! UInt256IsZero(txHash));
     pthread_mutex_lock(&manager->lock);
 
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        if (! UInt256Eq(manager->txRelays[i - 1].txHash, txHash)) continue;
-        count = array_count(manager->txRelays[i - 1].peers);
+    for (size_t i = deque_count(manager->txRelays); i > 0; i--) {
+        if (! UInt256Eq(deque_item(manager->txRelays, i - 1).txHash, txHash)) continue;
+        count = array_count(deque_item(manager->txRelays, i - 1).peers);
         break;
     }
 
@@ -2187,6 +2484,19 @@ void BRPeerManagerFree(BRPeerManager *manager)
 {
     assert(manager != NULL);
     pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerFlushTxUpdates(manager); // the wallets may outlive the peer manager
+
+    for (size_t i = 0; manager->walletBatch && i < array_count(manager->wallets); i++) {
+        BRWalletEndBatch(manager->wallets[i]);
+    }
+
+    for (size_t i = deque_count(manager->publishedTx); i > 0; i--) { // free copies left by BRPeerManagerRemoveWallet()
+        BRTransaction *tx = deque_item(manager->publishedTx, i - 1).tx;
+
+        if (! _BRPeerManagerWalletOwnsTx(manager, tx)) BRTransactionFree(tx);
+    }
+
+    array_free(manager->wallets);
     array_free(manager->peers);
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) BRPeerFree(manager->connectedPeers[i - 1]);
     array_free(manager->connectedPeers);
@@ -2195,12 +2505,23 @@ void BRPeerManagerFree(BRPeerManager *manager)
     BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
     BRSetFree(manager->orphans);
     BRSetFree(manager->checkpoints);
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) free(manager->txRelays[i - 1].peers);
-    array_free(manager->txRelays);
-    for (size_t i = array_count(manager->txRequests); i > 0; i--) free(manager->txRequests[i - 1].peers);
-    array_free(manager->txRequests);
-    array_free(manager->publishedTx);
-    array_free(manager->publishedTxHashes);
+    while (deque_count(manager->txRelays) > 0) {
+        array_free(deque_front(manager->txRelays).peers);
+        deque_pop_front(manager->txRelays);
+    }
+
+    deque_free(manager->txRelays);
+
+    while (deque_count(manager->txRequests) > 0) {
+        array_free(deque_front(manager->txRequests).peers);
+        deque_pop_front(manager->txRequests);
+    }
+
+    deque_free(manager->txRequests);
+    deque_free(manager->publishedTx);
+    deque_free(manager->publishedTxHashes);
+    array_free(manager->txUpdates);
+    if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
     pthread_mutex_unlock(&manager->lock);
     pthread_mutex_destroy(&manager->lock);
     free(manager);
@@ -72,6 +72,14 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port);
 
+// adds a wallet to sync over the same peers, header chain and bloom filter as the wallet passed to BRPeerManagerNew()
+// each tx is registered with every wallet it belongs to, earliestKeyTime is when the wallet's keys were created, and
+// BRPeerManagerRescan() is needed to find its tx in blocks that were already synced
+void BRPeerManagerAddWallet(BRPeerManager *manager, BRWallet *wallet, uint32_t earliestKeyTime);
+
+// stops syncing a wallet added with BRPeerManagerAddWallet(), after which it can be freed
+void BRPeerManagerRemoveWallet(BRPeerManager *manager, BRWallet *wallet);
+
 // current connect status
 BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager);
 
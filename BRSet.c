@@ -116,6 +116,27 @@ void *BRSetAdd(BRSet *set, void *item)
     return t;
 }
 
+// adds or replaces count items from the given array, growing the hashtable at most once
+void BRSetAddBulk(BRSet *set, void *items[], size_t count)
+{
+    assert(set != NULL);
+    assert(items != NULL || count == 0);
+    
+    BRSetReserve(set, set->itemCount + count);
+    
+    for (size_t i = 0; i < count; i++) {
+        BRSetAdd(set, items[i]);
+    }
+}
+
+// grows the set if needed so that it can hold capacity items without any further rehashing
+void BRSetReserve(BRSet *set, size_t capacity)
+{
+    assert(set != NULL);
+    
+    if (capacity > ((set->size + 2)/3)*2) _BRSetGrow(set, capacity); // keep load factor at or below 2/3
+}
+
 // removes item equivalent to given item from set and returns item removed if any
 void *BRSetRemove(BRSet *set, const void *item)
 {
@@ -209,6 +230,7 @@ void *BRSetGet(const BRSet *set, const void *item)
 
 // interates over set and returns the next item after previous, or NULL if no more items are available
 // if previous is NULL, an initial item is returned
+// NOTE: each call re-hashes and probes for previous, use BRSetCursorNext() to walk the entire set
 void *BRSetIterate(const BRSet *set, const void *previous)
 {
     assert(set != NULL);
@@ -232,6 +254,21 @@ void *BRSetIterate(const BRSet *set, const void *previous)
     return r;
 }
 
+// returns the next item at or after cursor and advances cursor past it, or NULL if no more items are available
+// the set must not be modified while iterating, since adding or removing items may move other items to new buckets
+void *BRSetCursorNext(const BRSet *set, BRSetCursor *cursor)
+{
+    assert(set != NULL);
+    assert(cursor != NULL);
+    
+    size_t i = cursor->slot, size = set->size;
+    void *r = NULL;
+    
+    while (! r && i < size) r = set->table[i++];
+    cursor->slot = i;
+    return r;
+}
+
 // writes up to count items from set to allItems and returns the number of items written
 size_t BRSetAll(const BRSet *set, void *allItems[], size_t count)
 {
@@ -34,6 +34,13 @@ extern "C" {
 
 typedef struct BRSetStruct BRSet;
 
+// position of an iteration over a set's hashtable, initialize with BR_SET_CURSOR_START before calling BRSetCursorNext()
+typedef struct {
+    size_t slot;
+} BRSetCursor;
+
+#define BR_SET_CURSOR_START ((BRSetCursor) { 0 })
+
 // retruns a newly allocated empty set that must be freed by calling BRSetFree()
 // size_t hash(const void *) is a function that returns a hash value for a given set item
 // int eq(const void *, const void *) is a function that returns true if two set items are equal
@@ -44,6 +51,12 @@ BRSet *BRSetNew(size_t (*hash)(const void *), int (*eq)(const void *, const void
 // adds given item to set or replaces an equivalent existing item and returns item replaced if any
 void *BRSetAdd(BRSet *set, void *item);
 
+// adds or replaces count items from the given array, growing the hashtable at most once
+void BRSetAddBulk(BRSet *set, void *items[], size_t count);
+
+// grows the set if needed so that it can hold capacity items without any further rehashing
+void BRSetReserve(BRSet *set, size_t capacity);
+
 // removes item equivalent to given item from set and returns item removed if any
 void *BRSetRemove(BRSet *set, const void *item);
 
@@ -64,8 +77,13 @@ void *BRSetGet(const BRSet *set, const void *item);
 
 // interates over set and returns the next item after previous, or NULL if no more items are available
 // if previous is NULL, an initial item is returned
+// NOTE: each call re-hashes and probes for previous, use BRSetCursorNext() to walk the entire set
 void *BRSetIterate(const BRSet *set, const void *previous);
 
+// returns the next item at or after cursor and advances cursor past it, or NULL if no more items are available
+// the set must not be modified while iterating, since adding or removing items may move other items to new buckets
+void *BRSetCursorNext(const BRSet *set, BRSetCursor *cursor);
+
 // writes up to count items from set to allItems and returns number of items written
 size_t BRSetAll(const BRSet *set, void *allItems[], size_t count);
 
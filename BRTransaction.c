@@ -182,71 +182,206 @@ static size_t _BRTransactionOutputData(const BRTransaction *tx, uint8_t *data, s
     return (! data || off <= dataLen) ? off : 0;
 }
 
-// writes the BIP143 witness program data that needs to be hashed and signed for the tx input at index
-// https://github.com/bitcoin/bips/blob/master/bip-0143.mediawiki
-// an index of SIZE_MAX will write the entire signed transaction
-// returns number of bytes written, or total len needed if data is NULL
-static size_t _BRTransactionWitnessData(const BRTransaction *tx, uint8_t *data, size_t dataLen, size_t index,
-                                        int hashType)
+// hashes the data _BRTxInputData() would write, without writing it
+static void _BRTxInputHash(BRSHA256Context *ctx, const BRTxInput *input)
 {
-    BRTxInput input;
-    int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f);
-    size_t i, off = 0;
+    uint8_t buf[sizeof(UInt256) + sizeof(uint32_t) + 9];
+    size_t off = 0;
     
-    if (index >= tx->inCount) return 0;
-    if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->version); // tx version
+    memcpy(&buf[off], &input->txHash, sizeof(UInt256)); // previous out
+    off += sizeof(UInt256);
+    UInt32SetLE(&buf[off], input->index);
     off += sizeof(uint32_t);
+    off += BRVarIntSet(&buf[off], sizeof(buf) - off, input->sigLen);
+    BRSHA256Update(ctx, buf, off);
+    BRSHA256Update(ctx, input->signature, input->sigLen); // scriptSig
+    off = 0;
+    
+    if (input->amount != 0) {
+        UInt64SetLE(&buf[off], input->amount);
+        off += sizeof(uint64_t);
+    }
+    
+    UInt32SetLE(&buf[off], input->sequence);
+    off += sizeof(uint32_t);
+    BRSHA256Update(ctx, buf, off);
+}
+
+// hashes the data _BRTransactionOutputData() would write for output, without writing it
+static void _BRTxOutputHash(BRSHA256Context *ctx, const BRTxOutput *output)
+{
+    uint8_t buf[sizeof(uint64_t) + 9];
+    size_t off = 0;
+    
+    UInt64SetLE(&buf[off], output->amount);
+    off += sizeof(uint64_t);
+    off += BRVarIntSet(&buf[off], sizeof(buf) - off, output->scriptLen);
+    BRSHA256Update(ctx, buf, off);
+    BRSHA256Update(ctx, output->script, output->scriptLen);
+}
+
+// writes the double-sha-256 of the data hashed with ctx to md32
+static void _BRSHA256Final_2(BRSHA256Context *ctx, void *md32)
+{
+    uint8_t t[32];
+    
+    BRSHA256Final(ctx, t);
+    BRSHA256(md32, t, sizeof(t));
+}
+
+// BIP143 hashes of the tx outpoints, sequence numbers and outputs, which are the same for every input signed with
+// hashType, so are only computed once when signing all of them
+typedef struct {
+    int hashType;
+    UInt256 prevoutsHash;
+    UInt256 sequenceHash;
+    UInt256 outputsHash; // SIGHASH_ALL outputs, SIGHASH_SINGLE outputs depend on the input
+} BRWitnessHashes;
+
+static void _BRWitnessHashesSet(BRWitnessHashes *hashes, const BRTransaction *tx, int hashType)
+{
+    int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f);
+    uint8_t buf[sizeof(UInt256) + sizeof(uint32_t)];
+    BRSHA256Context ctx;
+    size_t i;
+    
+    hashes->hashType = hashType;
+    hashes->prevoutsHash = hashes->sequenceHash = hashes->outputsHash = UINT256_ZERO;
     
     if (! anyoneCanPay) {
-        uint8_t buf[(sizeof(UInt256) + sizeof(uint32_t))*tx->inCount];
+        BRSHA256Init(&ctx);
         
         for (i = 0; i < tx->inCount; i++) {
-            UInt256Set(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i], tx->inputs[i].txHash);
-            UInt32SetLE(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i + sizeof(UInt256)], tx->inputs[i].index);
+            UInt256Set(buf, tx->inputs[i].txHash);
+            UInt32SetLE(&buf[sizeof(UInt256)], tx->inputs[i].index);
+            BRSHA256Update(&ctx, buf, sizeof(buf));
         }
         
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, sizeof(buf)); // inputs hash
+        _BRSHA256Final_2(&ctx, &hashes->prevoutsHash); // inputs hash
     }
-    else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO); // anyone-can-pay
-    
-    off += sizeof(UInt256);
     
     if (! anyoneCanPay && sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
-        uint8_t buf[sizeof(uint32_t)*tx->inCount];
+        BRSHA256Init(&ctx);
         
-        for (i = 0; i < tx->inCount; i++) UInt32SetLE(&buf[sizeof(uint32_t)*i], tx->inputs[i].sequence);
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, sizeof(buf)); // sequence hash
+        for (i = 0; i < tx->inCount; i++) {
+            UInt32SetLE(buf, tx->inputs[i].sequence);
+            BRSHA256Update(&ctx, buf, sizeof(uint32_t));
+        }
+        
+        _BRSHA256Final_2(&ctx, &hashes->sequenceHash); // sequence hash
     }
-    else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO);
     
-    off += sizeof(UInt256);
-    input = tx->inputs[index];
+    if (sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
+        BRSHA256Init(&ctx);
+        for (i = 0; i < tx->outCount; i++) _BRTxOutputHash(&ctx, &tx->outputs[i]);
+        _BRSHA256Final_2(&ctx, &hashes->outputsHash); // SIGHASH_ALL outputs hash
+    }
+}
+
+// BIP143 digest to sign for the tx input at index, using hashes from _BRWitnessHashesSet()
+// https://github.com/bitcoin/bips/blob/master/bip-0143.mediawiki
+static UInt256 _BRTransactionWitnessSigHash(const BRTransaction *tx, const BRWitnessHashes *hashes, size_t index)
+{
+    BRTxInput input = tx->inputs[index];
+    BRSHA256Context ctx;
+    uint8_t buf[sizeof(UInt256) + sizeof(uint32_t)*2];
+    UInt256 outputsHash = hashes->outputsHash, md;
+    
+    if ((hashes->hashType & 0x1f) == SIGHASH_SINGLE && index < tx->outCount) {
+        BRSHA256Init(&ctx);
+        _BRTxOutputHash(&ctx, &tx->outputs[index]);
+        _BRSHA256Final_2(&ctx, &outputsHash); // SIGHASH_SINGLE outputs hash
+    }
+    
+    BRSHA256Init(&ctx);
+    UInt32SetLE(buf, tx->version); // tx version
+    BRSHA256Update(&ctx, buf, sizeof(uint32_t));
+    BRSHA256Update(&ctx, &hashes->prevoutsHash, sizeof(UInt256));
+    BRSHA256Update(&ctx, &hashes->sequenceHash, sizeof(UInt256));
     input.signature = input.script; // TODO: handle OP_CODESEPARATOR
     input.sigLen = input.scriptLen;
-    off += _BRTxInputData(&input, (data ? &data[off] : NULL), (off <= dataLen ? dataLen - off : 0));
+    _BRTxInputHash(&ctx, &input);
+    UInt256Set(buf, outputsHash);
+    UInt32SetLE(&buf[sizeof(UInt256)], tx->lockTime); // locktime
+    UInt32SetLE(&buf[sizeof(UInt256) + sizeof(uint32_t)], hashes->hashType); // hash type
+    BRSHA256Update(&ctx, buf, sizeof(buf));
+    _BRSHA256Final_2(&ctx, &md);
+    return md;
+}
+
+#define TX_EMPTY_INPUT_SIZE (sizeof(UInt256) + sizeof(uint32_t) + 1 + sizeof(uint32_t)) // input with a 0 length script
+
+// legacy SIGHASH_ALL digests differ only in which input has its script in place, so each input's digest is hashed
+// from the state after the inputs before it, which carries over to the next input, and the rest of the tx, which is
+// serialized once
+typedef struct {
+    BRSHA256Context prefix; // tx version, input count, and inputs before index with empty scripts
+    size_t index;
+    uint8_t *rest; // all inputs with empty scripts, then outputs, locktime and hash type
+    size_t restLen;
+} BRLegacySigHashes;
+
+static void _BRLegacySigHashesNew(BRLegacySigHashes *hashes, const BRTransaction *tx, int hashType)
+{
+    uint8_t buf[sizeof(uint32_t) + 9];
+    size_t i, off = 0;
     
-    if (sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
-        size_t bufLen = _BRTransactionOutputData(tx, NULL, 0, SIZE_MAX);
-        uint8_t _buf[(bufLen <= 0x1000) ? bufLen : 0], *buf = (bufLen <= 0x1000) ? _buf : malloc(bufLen);
-        
-        bufLen = _BRTransactionOutputData(tx, buf, bufLen, SIZE_MAX);
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, bufLen); // SIGHASH_ALL outputs hash
-        if (buf != _buf) free(buf);
-    }
-    else if (sigHash == SIGHASH_SINGLE && index < tx->outCount) {
-        uint8_t buf[_BRTransactionOutputData(tx, NULL, 0, index)];
-        size_t bufLen = _BRTransactionOutputData(tx, buf, sizeof(buf), index);
-        
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, bufLen); //SIGHASH_SINGLE outputs hash
+    assert(hashType == SIGHASH_ALL);
+    hashes->restLen = TX_EMPTY_INPUT_SIZE*tx->inCount + BRVarIntSize(tx->outCount) +
+                      _BRTransactionOutputData(tx, NULL, 0, SIZE_MAX) + sizeof(uint32_t) + sizeof(uint32_t);
+    hashes->rest = malloc(hashes->restLen);
+    assert(hashes->rest != NULL);
+    
+    for (i = 0; i < tx->inCount; i++) {
+        memcpy(&hashes->rest[off], &tx->inputs[i].txHash, sizeof(UInt256)); // previous out
+        off += sizeof(UInt256);
+        UInt32SetLE(&hashes->rest[off], tx->inputs[i].index);
+        off += sizeof(uint32_t);
+        hashes->rest[off++] = 0; // empty script
+        UInt32SetLE(&hashes->rest[off], tx->inputs[i].sequence);
+        off += sizeof(uint32_t);
     }
-    else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO); // SIGHASH_NONE
     
-    off += sizeof(UInt256);
-    if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->lockTime); // locktime
-    off += sizeof(uint32_t);
-    if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], hashType); // hash type
+    off += BRVarIntSet(&hashes->rest[off], hashes->restLen - off, tx->outCount);
+    off += _BRTransactionOutputData(tx, &hashes->rest[off], hashes->restLen - off, SIZE_MAX);
+    UInt32SetLE(&hashes->rest[off], tx->lockTime); // locktime
     off += sizeof(uint32_t);
-    return (! data || off <= dataLen) ? off : 0;
+    UInt32SetLE(&hashes->rest[off], hashType); // hash type
+    BRSHA256Init(&hashes->prefix);
+    UInt32SetLE(buf, tx->version); // tx version
+    off = sizeof(uint32_t);
+    off += BRVarIntSet(&buf[off], sizeof(buf) - off, tx->inCount);
+    BRSHA256Update(&hashes->prefix, buf, off);
+    hashes->index = 0;
+}
+
+// legacy SIGHASH_ALL digest to sign for the tx input at index, the same as the double-sha-256 of what
+// _BRTransactionData() writes, index must not be lower than in the previous call with the same hashes
+static UInt256 _BRLegacySigHash(BRLegacySigHashes *hashes, const BRTransaction *tx, size_t index)
+{
+    BRTxInput input = tx->inputs[index];
+    BRSHA256Context ctx;
+    UInt256 md;
+    
+    assert(index >= hashes->index);
+    BRSHA256Update(&hashes->prefix, &hashes->rest[TX_EMPTY_INPUT_SIZE*hashes->index],
+                   TX_EMPTY_INPUT_SIZE*(index - hashes->index));
+    hashes->index = index;
+    ctx = hashes->prefix;
+    input.signature = input.script; // TODO: handle OP_CODESEPARATOR
+    input.sigLen = input.scriptLen;
+    input.amount = 0;
+    _BRTxInputHash(&ctx, &input);
+    BRSHA256Update(&ctx, &hashes->rest[TX_EMPTY_INPUT_SIZE*(index + 1)],
+                   hashes->restLen - TX_EMPTY_INPUT_SIZE*(index + 1));
+    _BRSHA256Final_2(&ctx, &md);
+    return md;
+}
+
+static void _BRLegacySigHashesFree(BRLegacySigHashes *hashes)
+{
+    free(hashes->rest);
+    hashes->rest = NULL;
 }
 
 // writes the data that needs to be hashed and signed for the tx input at index
@@ -258,7 +393,7 @@ static size_t _BRTransactionData(const BRTransaction *tx, uint8_t *data, size_t
     int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f);
     size_t i, off = 0;
     
-    if (hashType & SIGHASH_FORKID) return _BRTransactionWitnessData(tx, data, dataLen, index, hashType);
+    assert(! (hashType & SIGHASH_FORKID)); // BIP143 digests are hashed by _BRTransactionWitnessSigHash()
     if (anyoneCanPay && index >= tx->inCount) return 0;
     if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->version); // tx version
     off += sizeof(uint32_t);
@@ -359,73 +494,215 @@ BRTransaction *BRTransactionCopy(const BRTransaction *tx)
     return cpy;
 }
 
-// buf must contain a serialized tx
-// retruns a transaction that must be freed by calling BRTransactionFree()
-BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen)
+// reads the input at off, returns the offset after it, or SIZE_MAX if it doesn't fit in bufLen
+static size_t _BRTxInputViewRead(const uint8_t *buf, size_t bufLen, size_t off, BRTxInputView *input)
 {
-    assert(buf != NULL || bufLen == 0);
-    if (! buf) return NULL;
+    size_t sLen, len = 0;
     
+    memset(input, 0, sizeof(*input));
+    if (off > bufLen || sizeof(UInt256) + sizeof(uint32_t) > bufLen - off) return SIZE_MAX;
+    input->txHash = UInt256Get(&buf[off]);
+    off += sizeof(UInt256);
+    input->index = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    sLen = (size_t)BRVarInt(&buf[off], bufLen - off, &len);
+    if (len > bufLen - off) return SIZE_MAX;
+    off += len;
+    if (sLen > bufLen - off) return SIZE_MAX;
+    
+    if (BRAddressFromScriptPubKey(NULL, 0, &buf[off], sLen) > 0) { // unsigned tx inputs have a script and amount
+        input->script = &buf[off];
+        input->scriptLen = sLen;
+        off += sLen;
+        if (sizeof(uint64_t) > bufLen - off) return SIZE_MAX;
+        input->amount = UInt64GetLE(&buf[off]);
+        off += sizeof(uint64_t);
+    }
+    else {
+        input->signature = &buf[off];
+        input->sigLen = sLen;
+        off += sLen;
+    }
+    
+    if (sizeof(uint32_t) > bufLen - off) return SIZE_MAX;
+    input->sequence = UInt32GetLE(&buf[off]);
+    return off + sizeof(uint32_t);
+}
+
+// reads the output at off, returns the offset after it, or SIZE_MAX if it doesn't fit in bufLen
+static size_t _BRTxOutputViewRead(const uint8_t *buf, size_t bufLen, size_t off, BRTxOutputView *output)
+{
+    size_t sLen, len = 0;
+    
+    memset(output, 0, sizeof(*output));
+    if (off > bufLen || sizeof(uint64_t) > bufLen - off) return SIZE_MAX;
+    output->amount = UInt64GetLE(&buf[off]);
+    off += sizeof(uint64_t);
+    sLen = (size_t)BRVarInt(&buf[off], bufLen - off, &len);
+    if (len > bufLen - off) return SIZE_MAX;
+    off += len;
+    if (sLen > bufLen - off) return SIZE_MAX;
+    output->script = &buf[off];
+    output->scriptLen = sLen;
+    return off + sLen;
+}
+
+// buf must contain a serialized tx, which is checked and indexed without being copied
+// returns true if buf contains a valid tx
+int BRTransactionViewParse(BRTransactionView *view, const uint8_t *buf, size_t bufLen)
+{
+    BRTxInputView input;
+    BRTxOutputView output;
     int isSigned = 1;
-    size_t i, off = 0, sLen = 0, len = 0;
-    BRTransaction *tx = BRTransactionNew();
-    BRTxInput *input;
-    BRTxOutput *output;
+    size_t i, off = 0, len = 0;
     
-    tx->version = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
+    assert(view != NULL);
+    assert(buf != NULL || bufLen == 0);
+    memset(view, 0, sizeof(*view));
+    if (! buf) return 0;
+    
+    view->buf = buf;
+    view->version = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
     off += sizeof(uint32_t);
-    tx->inCount = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    view->inCount = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
     off += len;
-    array_set_count(tx->inputs, tx->inCount);
+    view->inOff = off;
     
-    for (i = 0; off <= bufLen && i < tx->inCount; i++) {
-        input = &tx->inputs[i];
-        input->txHash = (off + sizeof(UInt256) <= bufLen) ? UInt256Get(&buf[off]) : UINT256_ZERO;
-        off += sizeof(UInt256);
-        input->index = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-        off += sizeof(uint32_t);
-        sLen = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    for (i = 0; off <= bufLen && i < view->inCount; i++) {
+        off = _BRTxInputViewRead(buf, bufLen, off, &input);
+        if (input.script) isSigned = 0;
+    }
+    
+    view->inEnd = off;
+    
+    if (off <= bufLen) {
+        view->outCount = (size_t)BRVarInt(&buf[off], bufLen - off, &len);
         off += len;
+        view->outOff = off;
+    }
+    
+    for (i = 0; off <= bufLen && i < view->outCount; i++) {
+        off = _BRTxOutputViewRead(buf, bufLen, off, &output);
+    }
+    
+    if (off <= bufLen && sizeof(uint32_t) <= bufLen - off) {
+        view->lockTime = UInt32GetLE(&buf[off]);
+        off += sizeof(uint32_t);
+    }
+    else off = SIZE_MAX; // tx is truncated
+    
+    if (view->inCount == 0 || off > bufLen) {
+        memset(view, 0, sizeof(*view));
+        return 0;
+    }
+    
+    view->len = off;
+    if (isSigned) BRSHA256_2(&view->txHash, buf, off);
+    return 1;
+}
+
+// reads the input at offset off in view->buf, starting with view->inOff for the first input
+// returns the offset of the next input, or 0 if off is not part of the inputs
+size_t BRTransactionViewInput(const BRTransactionView *view, size_t off, BRTxInputView *input)
+{
+    assert(view != NULL);
+    assert(input != NULL);
+    
+    size_t end = view->inEnd;
+    
+    if (off < view->inOff || off >= end) return 0;
+    off = _BRTxInputViewRead(view->buf, end, off, input);
+    return (off <= end) ? off : 0;
+}
+
+// reads the output at offset off in view->buf, starting with view->outOff for the first output
+// returns the offset of the next output, or 0 if off is not part of the outputs
+size_t BRTransactionViewOutput(const BRTransactionView *view, size_t off, BRTxOutputView *output)
+{
+    assert(view != NULL);
+    assert(output != NULL);
+    
+    size_t end = view->len - sizeof(uint32_t);
+    
+    if (off < view->outOff || off >= end) return 0;
+    off = _BRTxOutputViewRead(view->buf, end, off, output);
+    return (off <= end) ? off : 0;
+}
+
+// size in bytes if signed, or estimated size assuming compact pubkey sigs, the same as BRTransactionSize() would be
+size_t BRTransactionViewSize(const BRTransactionView *view)
+{
+    BRTxInputView input;
+    BRTxOutputView output;
+    size_t i, off, size;
+    
+    assert(view != NULL);
+    size = 8 + BRVarIntSize(view->inCount) + BRVarIntSize(view->outCount);
+    
+    for (i = 0, off = view->inOff; i < view->inCount; i++) {
+        off = BRTransactionViewInput(view, off, &input);
         
-        if (off + sLen <= bufLen && BRAddressFromScriptPubKey(NULL, 0, &buf[off], sLen) > 0) {
-            BRTxInputSetScript(input, &buf[off], sLen);
-            input->amount = (off + sLen + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off + sLen]) : 0;
-            off += sizeof(uint64_t);
-            isSigned = 0;
+        if (input.signature) {
+            size += sizeof(UInt256) + sizeof(uint32_t) + BRVarIntSize(input.sigLen) + input.sigLen + sizeof(uint32_t);
         }
-        else if (off + sLen <= bufLen) BRTxInputSetSignature(input, &buf[off], sLen);
-        
-        off += sLen;
-        input->sequence = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-        off += sizeof(uint32_t);
+        else size += TX_INPUT_SIZE;
     }
     
-    tx->outCount = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
-    off += len;
-    array_set_count(tx->outputs, tx->outCount);
+    for (i = 0, off = view->outOff; i < view->outCount; i++) {
+        off = BRTransactionViewOutput(view, off, &output);
+        size += sizeof(uint64_t) + BRVarIntSize(output.scriptLen) + output.scriptLen;
+    }
     
-    for (i = 0; off <= bufLen && i < tx->outCount; i++) {
-        output = &tx->outputs[i];
-        output->amount = (off + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off]) : 0;
-        off += sizeof(uint64_t);
-        sLen = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
-        off += len;
-        if (off + sLen <= bufLen) BRTxOutputSetScript(output, &buf[off], sLen);
-        off += sLen;
+    return size;
+}
+
+// returns a transaction with a copy of everything in view that must be freed by calling BRTransactionFree()
+BRTransaction *BRTransactionViewMaterialize(const BRTransactionView *view)
+{
+    BRTransaction *tx = BRTransactionNew();
+    BRTxInputView input;
+    BRTxOutputView output;
+    size_t i, off;
+    
+    assert(view != NULL);
+    tx->txHash = view->txHash;
+    tx->version = view->version;
+    tx->lockTime = view->lockTime;
+    array_set_count(tx->inputs, view->inCount);
+    tx->inCount = view->inCount;
+    
+    for (i = 0, off = view->inOff; i < view->inCount; i++) {
+        off = BRTransactionViewInput(view, off, &input);
+        tx->inputs[i].txHash = input.txHash;
+        tx->inputs[i].index = input.index;
+        tx->inputs[i].amount = input.amount;
+        tx->inputs[i].sequence = input.sequence;
+        if (input.script) BRTxInputSetScript(&tx->inputs[i], input.script, input.scriptLen);
+        if (input.signature) BRTxInputSetSignature(&tx->inputs[i], input.signature, input.sigLen);
     }
     
-    tx->lockTime = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-    off += sizeof(uint32_t);
+    array_set_count(tx->outputs, view->outCount);
+    tx->outCount = view->outCount;
     
-    if (tx->inCount == 0 || off > bufLen) {
-        BRTransactionFree(tx);
-        tx = NULL;
+    for (i = 0, off = view->outOff; i < view->outCount; i++) {
+        off = BRTransactionViewOutput(view, off, &output);
+        tx->outputs[i].amount = output.amount;
+        BRTxOutputSetScript(&tx->outputs[i], output.script, output.scriptLen);
     }
-    else if (isSigned) BRSHA256_2(&tx->txHash, buf, off);
     
     return tx;
 }
 
+// buf must contain a serialized tx
+// retruns a transaction that must be freed by calling BRTransactionFree()
+BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen)
+{
+    BRTransactionView view;
+    
+    assert(buf != NULL || bufLen == 0);
+    return (BRTransactionViewParse(&view, buf, bufLen)) ? BRTransactionViewMaterialize(&view) : NULL;
+}
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL
 // (tx->blockHeight and tx->timestamp are not serialized)
 size_t BRTransactionSerialize(const BRTransaction *tx, uint8_t *buf, size_t bufLen)
@@ -515,7 +792,13 @@ size_t BRTransactionSize(const BRTransaction *tx)
 uint64_t BRTransactionStandardFee(const BRTransaction *tx)
 {
     assert(tx != NULL);
-    return ((BRTransactionSize(tx) + 999)/1000)*TX_FEE_PER_KB;
+    return BRTransactionStandardFeeForSize(BRTransactionSize(tx));
+}
+
+// minimum fee needed to relay a tx of the given size, TX_FEE_PER_KB per kb rounded up to the nearest kb
+uint64_t BRTransactionStandardFeeForSize(size_t size)
+{
+    return ((size + 999)/1000)*TX_FEE_PER_KB;
 }
 
 // checks if all signatures exist, but does not verify them
@@ -536,16 +819,25 @@ int BRTransactionIsSigned(const BRTransaction *tx)
 int BRTransactionSign(BRTransaction *tx, int forkId, BRKey keys[], size_t keysCount)
 {
     BRAddress addrs[keysCount], address;
-    size_t i, j;
+    BRWitnessHashes hashes;
+    BRLegacySigHashes legacyHashes;
+    BRSHA256Context ctx;
+    uint8_t buf[sizeof(uint32_t) + 9];
+    size_t i, j, off;
     
     assert(tx != NULL);
     assert(keys != NULL || keysCount == 0);
+    if (! tx) return 0;
+    
+    // the digest of each input is the same but for that input, and signatures don't change it
+    if (forkId) _BRWitnessHashesSet(&hashes, tx, forkId | SIGHASH_ALL);
+    else _BRLegacySigHashesNew(&legacyHashes, tx, SIGHASH_ALL);
     
-    for (i = 0; tx && i < keysCount; i++) {
+    for (i = 0; i < keysCount; i++) {
         if (! BRKeyAddress(&keys[i], addrs[i].s, sizeof(addrs[i]))) addrs[i] = BR_ADDRESS_NONE;
     }
     
-    for (i = 0; tx && i < tx->inCount; i++) {
+    for (i = 0; i < tx->inCount; i++) {
         BRTxInput *input = &tx->inputs[i];
         
         if (! BRAddressFromScriptPubKey(address.s, sizeof(address), input->script, input->scriptLen)) continue;
@@ -559,39 +851,41 @@ int BRTransactionSign(BRTransaction *tx, int forkId, BRKey keys[], size_t keysCo
         size_t pkLen = BRKeyPubKey(&keys[j], pubKey, sizeof(pubKey));
         uint8_t sig[73], script[1 + sizeof(sig) + 1 + sizeof(pubKey)];
         size_t sigLen, scriptLen;
-        UInt256 md = UINT256_ZERO;
+        UInt256 md = (forkId) ? _BRTransactionWitnessSigHash(tx, &hashes, i) : _BRLegacySigHash(&legacyHashes, tx, i);
+        
+        sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
+        sig[sigLen++] = forkId | SIGHASH_ALL;
+        scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
         
         if (elemsCount >= 2 && *elems[elemsCount - 2] == OP_EQUALVERIFY) { // pay-to-pubkey-hash
-            uint8_t data[_BRTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _BRTransactionData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-            
-            BRSHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
             scriptLen += BRScriptPushData(&script[scriptLen], sizeof(script) - scriptLen, pubKey, pkLen);
-            BRTxInputSetSignature(input, script, scriptLen);
-        }
-        else { // pay-to-pubkey
-            uint8_t data[_BRTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _BRTransactionData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-            
-            BRSHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
-            BRTxInputSetSignature(input, script, scriptLen);
         }
+        
+        BRTxInputSetSignature(input, script, scriptLen); // pay-to-pubkey needs only the sig
     }
     
-    if (tx && BRTransactionIsSigned(tx)) {
-        uint8_t data[_BRTransactionData(tx, NULL, 0, SIZE_MAX, 0)];
-        size_t len = _BRTransactionData(tx, data, sizeof(data), SIZE_MAX, 0);
+    if (! forkId) _BRLegacySigHashesFree(&legacyHashes);
+    if (! BRTransactionIsSigned(tx)) return 0;
+    BRSHA256Init(&ctx); // txHash of the signed tx, hashed as it's serialized by BRTransactionSerialize()
+    UInt32SetLE(buf, tx->version);
+    off = sizeof(uint32_t);
+    off += BRVarIntSet(&buf[off], sizeof(buf) - off, tx->inCount);
+    BRSHA256Update(&ctx, buf, off);
+    
+    for (i = 0; i < tx->inCount; i++) {
+        BRTxInput input = tx->inputs[i];
         
-        BRSHA256_2(&tx->txHash, data, len);
-        return 1;
+        input.amount = 0;
+        _BRTxInputHash(&ctx, &input);
     }
-    else return 0;
+    
+    off = BRVarIntSet(buf, sizeof(buf), tx->outCount);
+    BRSHA256Update(&ctx, buf, off);
+    for (i = 0; i < tx->outCount; i++) _BRTxOutputHash(&ctx, &tx->outputs[i]);
+    UInt32SetLE(buf, tx->lockTime);
+    BRSHA256Update(&ctx, buf, sizeof(uint32_t));
+    _BRSHA256Final_2(&ctx, &tx->txHash);
+    return 1;
 }
 
 // true if tx meets IsStandard() rules: https://bitcoin.org/en/developer-guide#standard-transactions
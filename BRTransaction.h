@@ -126,6 +126,9 @@ size_t BRTransactionSize(const BRTransaction *tx);
 // minimum transaction fee needed for tx to relay across the bitcoin network
 uint64_t BRTransactionStandardFee(const BRTransaction *tx);
 
+// minimum fee needed to relay a tx of the given size, TX_FEE_PER_KB per kb rounded up to the nearest kb
+uint64_t BRTransactionStandardFeeForSize(size_t size);
+
 // checks if all signatures exist, but does not verify them
 int BRTransactionIsSigned(const BRTransaction *tx);
 
@@ -152,6 +155,56 @@ inline static int BRTransactionEq(const void *tx, const void *otherTx)
 // frees memory allocated for tx
 void BRTransactionFree(BRTransaction *tx);
 
+// a read-only view of a serialized tx that points into the buffer it was parsed from instead of copying it, for
+// inspecting a tx without allocating, the buffer must stay unchanged for as long as the view or its parts are used
+typedef struct {
+    const uint8_t *buf;
+    size_t len; // bytes of buf that are part of the tx
+    UInt256 txHash; // zero if the tx is unsigned
+    uint32_t version;
+    size_t inCount;
+    size_t inOff; // offset of the first input in buf
+    size_t inEnd; // offset just past the last input in buf
+    size_t outCount;
+    size_t outOff; // offset of the first output in buf
+    uint32_t lockTime;
+} BRTransactionView;
+
+typedef struct {
+    UInt256 txHash;
+    uint32_t index;
+    uint64_t amount;
+    const uint8_t *script; // NULL unless the tx is unsigned
+    size_t scriptLen;
+    const uint8_t *signature; // NULL if the input is unsigned
+    size_t sigLen;
+    uint32_t sequence;
+} BRTxInputView;
+
+typedef struct {
+    uint64_t amount;
+    const uint8_t *script;
+    size_t scriptLen;
+} BRTxOutputView;
+
+// buf must contain a serialized tx, which is checked and indexed without being copied
+// returns true if buf contains a valid tx
+int BRTransactionViewParse(BRTransactionView *view, const uint8_t *buf, size_t bufLen);
+
+// reads the input at offset off in view->buf, starting with view->inOff for the first input
+// returns the offset of the next input, or 0 if off is not part of the inputs
+size_t BRTransactionViewInput(const BRTransactionView *view, size_t off, BRTxInputView *input);
+
+// reads the output at offset off in view->buf, starting with view->outOff for the first output
+// returns the offset of the next output, or 0 if off is not part of the outputs
+size_t BRTransactionViewOutput(const BRTransactionView *view, size_t off, BRTxOutputView *output);
+
+// size in bytes if signed, or estimated size assuming compact pubkey sigs, the same as BRTransactionSize() would be
+size_t BRTransactionViewSize(const BRTransactionView *view);
+
+// returns a transaction with a copy of everything in view that must be freed by calling BRTransactionFree()
+BRTransaction *BRTransactionViewMaterialize(const BRTransactionView *view);
+
 #ifdef __cplusplus
 }
 #endif
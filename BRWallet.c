@@ -33,89 +33,454 @@
 #include <pthread.h>
 #include <assert.h>
 
+// records how to undo one change made while applying a tx to the balance state, see _BRWalletRewindBalance()
+typedef struct {
+    int type;
+    uint32_t index;
+    const void *item;
+} BRBalanceUndo;
+
+#define BALANCE_UNDO_TX        0 // marks the start of a tx, item is the tx
+#define BALANCE_UNDO_INVALID   1 // tx added to invalidTx
+#define BALANCE_UNDO_PENDING   2 // tx added to pendingTx
+#define BALANCE_UNDO_SPENT     3 // input added to spentOutputs
+#define BALANCE_UNDO_USED      4 // address added to usedAddrs
+#define BALANCE_UNDO_UTXO_ADD  5 // utxo appended to utxos
+#define BALANCE_UNDO_UTXO_RM   6 // utxo removed from utxos at index, item is the input that spent it
+#define BALANCE_UNDO_DEFER     7 // input appended to deferredSpent
+#define BALANCE_UNDO_TAKE      8 // input taken from the end of deferredSpent
+
+
+#define CHAIN_ADDRESS_LEN 35 // a base58check P2PKH address is at most 34 characters, plus the NULL terminator
+
+// a generated wallet address, allAddrs maps address strings to these so the chain position is an O(1) lookup
+// only the address characters are stored rather than a full BRAddress, since large wallets keep one for every address
+typedef struct {
+    char s[CHAIN_ADDRESS_LEN]; // must be first, so BRAddressHash() and BRAddressEq() work on it
+    uint8_t chain; // SEQUENCE_INTERNAL_CHAIN or SEQUENCE_EXTERNAL_CHAIN
+    uint32_t index;
+} BRChainAddress;
+
+// the wallet tx with an input or output to a wallet address, in the same order as wallet->transactions
+typedef struct {
+    BRAddress address; // must be first, so BRAddressHash() and BRAddressEq() work on it
+    BRTransaction **txs;
+} BRAddressTxs;
+
+#define TX_STATUS_INVALID    0x01
+#define TX_STATUS_PENDING    0x02
+#define TX_STATUS_UNVERIFIED 0x04
+#define TX_STATUS_VOLATILE   0x08 // depends on the current time, block height or non-wallet tx, so can't be cached
+
+// memoized validity, pending and verified status of a wallet tx, as of when it was last applied to the balance state
+typedef struct {
+    UInt256 txHash; // must be first, so BRTransactionHash() and BRTransactionEq() work on it
+    const BRTransaction *tx;
+    uint32_t flags;
+} BRTxStatus;
+
+// an input of a wallet tx, indexed by the outpoint it spends
+typedef struct _BRTxSpend {
+    BRUTXO outpoint; // must be first, so BRUTXOHash() and BRUTXOEq() work on it
+    BRTransaction *tx;
+    struct _BRTxSpend *next; // another wallet tx spending the same outpoint (a double spend), or NULL
+} BRTxSpend;
+
+// an unconfirmed non-wallet tx, kept so the validity of wallet tx spending it can be checked
+typedef struct {
+    UInt256 txHash; // must be first, so BRTransactionHash() and BRTransactionEq() work on it
+    BRTransaction *tx;
+    time_t relayed; // when tx was last registered
+    size_t seq; // matches the newest wallet->poolOrder entry for tx, older entries are stale
+} BRPoolTx;
+
+typedef struct {
+    UInt256 txHash;
+    size_t seq;
+} BRPoolOrder;
+
+typedef struct {
+    uint64_t amount;
+    size_t index; // position in wallet->utxos
+} BRUTXOValue;
+
+#define TX_EVENT_ADDED   0x01
+#define TX_EVENT_UPDATED 0x02
+#define TX_EVENT_DELETED 0x04
+
+// the callbacks still due for a tx while they're being coalesced, see BRWalletBeginBatch()
+typedef struct {
+    UInt256 txHash; // must be first, so BRTransactionHash() and BRTransactionEq() work on it
+    BRTransaction *tx; // the added tx, if flags has TX_EVENT_ADDED
+    uint32_t flags, blockHeight, timestamp;
+    int notifyUser, recommendRescan;
+} BRTxEvent;
+
+// balance and totals as of the last balance update, which can be read without waiting on a wallet->lock writer
+typedef struct {
+    uint64_t balance, totalSent, totalReceived;
+} BRBalanceSnapshot;
+
 struct BRWalletStruct {
     uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
     uint32_t blockHeight;
     BRUTXO *utxos;
+    BRUTXOValue *utxoOrder; // wallet->utxos largest first, rebuilt by _BRWalletUTXOOrder() after utxos change
+    int utxoOrderValid;
     BRTransaction **transactions;
+    BRTransaction **sentTx, **receivedTx; // wallet->transactions split by direction, in the same order
+    BRBalanceUndo *balanceUndo;
+    const BRTxInput **deferredSpent; // inputs of pending tx that haven't been removed from utxos yet
+    BRTxStatus **statusHist; // status of each tx in wallet->transactions that has been applied, in the same order
     BRMasterPubKey masterPubKey;
-    BRAddress *internalChain, *externalChain;
-    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs, *allAddrs;
+    BRChainAddress **internalChain, **externalChain;
+    uint32_t gapLimits[2]; // unused addresses kept at the end of each chain, indexed by chain
+    size_t chainUsed[2]; // chain position after the last address in usedAddrs, indexed by chain
+    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs, *allAddrs, *txStatus;
+    BRSet *spends; // outpoint to the BRTxSpend of the first wallet tx spending it, others are chained through next
+    BRSet *addrTx; // wallet address to the wallet tx using it, as BRAddressTxs
+    BRSet *poolTx; // unconfirmed non-wallet tx in allTx, as BRPoolTx
+    BRPoolOrder *poolOrder; // deque of poolTx entries, least recently relayed first
+    size_t poolSeq, poolMaxCount;
+    uint32_t poolMaxAge;
+    BRTxPoolStats poolStats;
     void *callbackInfo;
     void (*balanceChanged)(void *info, uint64_t balance);
     void (*txAdded)(void *info, BRTransaction *tx);
     void (*txUpdated)(void *info, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight, uint32_t timestamp);
     void (*txDeleted)(void *info, UInt256 txHash, int notifyUser, int recommendRescan);
-    pthread_mutex_t lock;
+    void (*txBatchUpdated)(void *info, const BRTxUpdate updates[], size_t updateCount);
+    pthread_rwlock_t lock; // readers share it, writers are the network threads registering and updating tx
+    pthread_mutex_t writerGate; // held by a writer waiting for wallet->lock, so new readers can't starve it
+    pthread_mutex_t snapshotLock; // only held to copy the balance snapshot, never while holding wallet->lock for reading
+    pthread_mutex_t utxoOrderLock; // held by a reader rebuilding utxoOrder, since readers share wallet->lock
+    BRBalanceSnapshot snapshot;
+    pthread_mutex_t eventLock; // guards the batch state below, never held while making callbacks
+    int batchDepth; // number of BRWalletBeginBatch() calls not yet ended
+    uint64_t batchBalance; // balance when the outermost batch began
+    BRTxEvent **txEvents; // chunk_array of callbacks due when the batch ends, in the order each tx was first seen
+    BRSet *txEventSet; // txHash to its entry in txEvents
 };
 
+// use instead of pthread_rwlock_rdlock(), since rwlocks may prefer readers, and a busy UI could then starve sync
+inline static void _BRWalletReadLock(BRWallet *wallet)
+{
+    pthread_mutex_lock(&wallet->writerGate);
+    pthread_mutex_unlock(&wallet->writerGate);
+    pthread_rwlock_rdlock(&wallet->lock);
+}
+
+inline static void _BRWalletWriteLock(BRWallet *wallet)
+{
+    pthread_mutex_lock(&wallet->writerGate);
+    pthread_rwlock_wrlock(&wallet->lock);
+    pthread_mutex_unlock(&wallet->writerGate);
+}
+
+inline static BRAddress _chainAddress(const BRChainAddress *chainAddr)
+{
+    BRAddress address = BR_ADDRESS_NONE;
+
+    memcpy(address.s, chainAddr->s, sizeof(chainAddr->s));
+    return address;
+}
+
+// call after adding addr to usedAddrs, so BRWalletUnusedAddrs() doesn't have to search for the last used address
+inline static void _BRWalletAddrUsed(BRWallet *wallet, const char *addr)
+{
+    const BRChainAddress *chainAddr = BRSetGet(wallet->allAddrs, addr);
+
+    if (chainAddr && chainAddr->index >= wallet->chainUsed[chainAddr->chain]) {
+        wallet->chainUsed[chainAddr->chain] = chainAddr->index + 1;
+    }
+}
+
+// call after removing addr from usedAddrs
+static void _BRWalletAddrUnused(BRWallet *wallet, const char *addr)
+{
+    const BRChainAddress *chainAddr = BRSetGet(wallet->allAddrs, addr);
+    BRChainAddress **addrChain;
+    size_t *used;
+
+    if (! chainAddr || chainAddr->index + 1 != wallet->chainUsed[chainAddr->chain]) return;
+    addrChain = (chainAddr->chain == SEQUENCE_INTERNAL_CHAIN) ? wallet->internalChain : wallet->externalChain;
+    used = &wallet->chainUsed[chainAddr->chain];
+
+    // it was the last used address, so move back to the one before it (each address is passed over at most once
+    // while a rewind removes addresses in reverse order of use)
+    do (*used)--; while (*used > 0 && ! BRSetContains(wallet->usedAddrs, &chunk_array_item(addrChain, *used - 1)));
+}
+
 inline static uint64_t _txFee(uint64_t feePerKb, size_t size)
 {
-    uint64_t standardFee = ((size + 999)/1000)*TX_FEE_PER_KB, // standard fee based on tx size rounded up to nearest kb
+    uint64_t standardFee = BRTransactionStandardFeeForSize(size), // standard fee, rounded up to nearest kb
              fee = (((size*feePerKb/1000) + 99)/100)*100; // fee using feePerKb, rounded up to nearest 100 satoshi
     
     return (fee > standardFee) ? fee : standardFee;
 }
 
-// chain position of first tx output address that appears in chain
-inline static size_t _txChainIndex(const BRTransaction *tx, const BRAddress *addrChain)
+// outputs below this amount are uneconomical due to fees
+inline static uint64_t _txMinOutputAmount(uint64_t feePerKb)
 {
-    for (size_t i = array_count(addrChain); i > 0; i--) {
-        for (size_t j = 0; j < tx->outCount; j++) {
-            if (BRAddressEq(tx->outputs[j].address, &addrChain[i - 1])) return i - 1;
-        }
+    uint64_t amount = (TX_MIN_OUTPUT_AMOUNT*feePerKb + MIN_FEE_PER_KB - 1)/MIN_FEE_PER_KB;
+
+    return (amount > TX_MIN_OUTPUT_AMOUNT) ? amount : TX_MIN_OUTPUT_AMOUNT;
+}
+
+// last chain position of any tx output address in the given chain, or SIZE_MAX if none are in it
+inline static size_t _txChainIndex(BRWallet *wallet, const BRTransaction *tx, uint32_t chain)
+{
+    size_t index = SIZE_MAX;
+
+    for (size_t i = 0; i < tx->outCount; i++) {
+        const BRChainAddress *addr = BRSetGet(wallet->allAddrs, tx->outputs[i].address);
+
+        if (addr && addr->chain == chain && (index == SIZE_MAX || addr->index > index)) index = addr->index;
     }
     
-    return SIZE_MAX;
+    return index;
 }
 
-inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
+// index of the first tx in list with a block height of at least blockHeight, list must be sorted by block height
+// wallet->transactions always is, since _BRWalletSortTxs() orders by block height first
+inline static size_t _txListLowerBound(BRTransaction *const list[], size_t count, uint32_t blockHeight)
 {
-    if (! tx1 || ! tx2) return 0;
-    if (tx1->blockHeight > tx2->blockHeight) return 1;
-    if (tx1->blockHeight < tx2->blockHeight) return 0;
-    
-    for (size_t i = 0; i < tx1->inCount; i++) {
-        if (UInt256Eq(tx1->inputs[i].txHash, tx2->txHash)) return 1;
+    size_t lo = 0, hi = count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (list[mid]->blockHeight < blockHeight) lo = mid + 1;
+        else hi = mid;
     }
-    
-    for (size_t i = 0; i < tx2->inCount; i++) {
-        if (UInt256Eq(tx2->inputs[i].txHash, tx1->txHash)) return 0;
+
+    return lo;
+}
+
+// index of tx in list, searching only the tx at blockHeight, or count if it's not there
+inline static size_t _txListFind(BRTransaction *const list[], size_t count, const BRTransaction *tx,
+                                 uint32_t blockHeight)
+{
+    size_t i = _txListLowerBound(list, count, blockHeight);
+
+    while (i < count && list[i]->blockHeight == blockHeight && list[i] != tx) i++;
+    return (i < count && list[i]->blockHeight == blockHeight && list[i] == tx) ? i : count;
+}
+
+// inserts a tx that's already in wallet->transactions into list, a subset of wallet->transactions in the same order
+static void _BRWalletTxListAdd(BRWallet *wallet, BRTransaction ***list, BRTransaction *tx)
+{
+    size_t i = _txListLowerBound(*list, array_count(*list), tx->blockHeight),
+           j = _txListLowerBound(wallet->transactions, array_count(wallet->transactions), tx->blockHeight);
+
+    // tx in the same block are ordered by dependencies and chain index, so follow their order in wallet->transactions
+    while (i < array_count(*list) && (*list)[i]->blockHeight == tx->blockHeight && wallet->transactions[j] != tx) {
+        if (wallet->transactions[j++] == (*list)[i]) i++;
     }
 
-    for (size_t i = 0; i < tx1->inCount; i++) {
-        if (_BRWalletTxIsAscending(wallet, BRSetGet(wallet->allTx, &(tx1->inputs[i].txHash)), tx2)) return 1;
+    array_insert(*list, i, tx);
+}
+
+// removes tx from list if it's there, tx must have the same block height it had when it was added
+inline static void _BRWalletTxListRemove(BRTransaction ***list, const BRTransaction *tx)
+{
+    size_t i = _txListFind(*list, array_count(*list), tx, tx->blockHeight);
+
+    if (i < array_count(*list)) array_rm(*list, i);
+}
+
+// true if any input of tx is signed by a wallet address, meaning the wallet sent it
+inline static int _BRWalletTxIsSent(BRWallet *wallet, const BRTransaction *tx)
+{
+    for (size_t i = 0; i < tx->inCount; i++) {
+        if (BRSetContains(wallet->allAddrs, tx->inputs[i].address)) return 1;
     }
 
     return 0;
 }
 
-inline static int _BRWalletTxCompare(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
+static void _BRWalletAddrTxAdd(BRWallet *wallet, const char *addr, BRTransaction *tx)
 {
-    size_t i, j;
+    const BRChainAddress *chainAddr = BRSetGet(wallet->allAddrs, addr);
+    BRAddressTxs *entry = (chainAddr) ? BRSetGet(wallet->addrTx, addr) : NULL;
 
-    if (_BRWalletTxIsAscending(wallet, tx1, tx2)) return 1;
-    if (_BRWalletTxIsAscending(wallet, tx2, tx1)) return -1;
-    i = _txChainIndex(tx1, wallet->internalChain);
-    j = _txChainIndex(tx2, (i == SIZE_MAX) ? wallet->externalChain : wallet->internalChain);
-    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex((BRTransaction *)tx1, wallet->externalChain);
-    if (i != SIZE_MAX && j != SIZE_MAX && i != j) return (i > j) ? 1 : -1;
-    return 0;
+    if (! chainAddr) return;
+
+    if (! entry) {
+        entry = calloc(1, sizeof(*entry));
+        assert(entry != NULL);
+        entry->address = _chainAddress(chainAddr);
+        array_new(entry->txs, 1);
+        BRSetAdd(wallet->addrTx, entry);
+    }
+    else if (_txListFind(entry->txs, array_count(entry->txs), tx, tx->blockHeight) < array_count(entry->txs)) return;
+
+    _BRWalletTxListAdd(wallet, &entry->txs, tx);
 }
 
-// inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first (insertion sort)
-inline static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+static void _BRAddressTxsFree(void *info, void *entry)
 {
-    size_t i = array_count(wallet->transactions);
-    
-    array_set_count(wallet->transactions, i + 1);
-    
-    while (i > 0 && _BRWalletTxCompare(wallet, wallet->transactions[i - 1], tx) > 0) {
-        wallet->transactions[i] = wallet->transactions[i - 1];
-        i--;
+    array_free(((BRAddressTxs *)entry)->txs);
+    free(entry);
+}
+
+static void _BRWalletAddrTxRemove(BRWallet *wallet, const char *addr, const BRTransaction *tx)
+{
+    BRAddressTxs *entry = BRSetGet(wallet->addrTx, addr);
+
+    if (! entry) return;
+    _BRWalletTxListRemove(&entry->txs, tx);
+
+    if (array_count(entry->txs) == 0) {
+        BRSetRemove(wallet->addrTx, entry);
+        _BRAddressTxsFree(NULL, entry);
     }
-    
-    wallet->transactions[i] = tx;
+}
+
+// adds a tx that's already in wallet->transactions to the direction and address indexes used by BRWalletTxPage()
+static void _BRWalletIndexTx(BRWallet *wallet, BRTransaction *tx)
+{
+    _BRWalletTxListAdd(wallet, (_BRWalletTxIsSent(wallet, tx)) ? &wallet->sentTx : &wallet->receivedTx, tx);
+    for (size_t i = 0; i < tx->inCount; i++) _BRWalletAddrTxAdd(wallet, tx->inputs[i].address, tx);
+    for (size_t i = 0; i < tx->outCount; i++) _BRWalletAddrTxAdd(wallet, tx->outputs[i].address, tx);
+}
+
+// must be called before changing tx->blockHeight, since the indexes are searched by block height
+static void _BRWalletUnindexTx(BRWallet *wallet, const BRTransaction *tx)
+{
+    _BRWalletTxListRemove(&wallet->sentTx, tx); // direction may have changed if more addresses were generated
+    _BRWalletTxListRemove(&wallet->receivedTx, tx);
+    for (size_t i = 0; i < tx->inCount; i++) _BRWalletAddrTxRemove(wallet, tx->inputs[i].address, tx);
+    for (size_t i = 0; i < tx->outCount; i++) _BRWalletAddrTxRemove(wallet, tx->outputs[i].address, tx);
+}
+
+static void _BRWalletRewindBalance(BRWallet *wallet, size_t txIdx);
+
+typedef struct {
+    BRTransaction *tx;
+    uint32_t blockHeight, timestamp;
+    size_t internal, external;
+} BRTxLoadKey;
+
+typedef struct {
+    BRTransaction *tx;
+    size_t n; // next input to check
+} BRTxLoadFrame;
+
+inline static int _txLoadCompare(const void *key, const void *otherKey)
+{
+    const BRTxLoadKey *k1 = key, *k2 = otherKey;
+
+    if (k1->blockHeight != k2->blockHeight) return (k1->blockHeight < k2->blockHeight) ? -1 : 1;
+    if (k1->internal != k2->internal) return (k1->internal < k2->internal) ? -1 : 1;
+    if (k1->external != k2->external) return (k1->external < k2->external) ? -1 : 1;
+    if (k1->timestamp != k2->timestamp) return (k1->timestamp < k2->timestamp) ? -1 : 1;
+    return memcmp(&k1->tx->txHash, &k2->tx->txHash, sizeof(UInt256)); // total order, so ties don't depend on history
+}
+
+// sorts txs by block height, then dependencies (a tx after any same height tx it spends), then internal and then
+// external chain index, then timestamp, then hash, in O(n log n)
+// the order depends only on which tx are sorted and the wallet's address chains, not on the order they were added in
+// unconfirmed tx are timestamped when first seen, so of two conflicting tx with the same chain indexes, the earlier
+// one is applied first, a tx with a lower chain index is applied first whatever its timestamp, and a timestamp of 0
+// (unverified) sorts last among tx that tie on chain index
+// txs must already be in wallet->allTx
+static void _BRWalletSortTxs(BRWallet *wallet, BRTransaction *txs[], size_t txCount)
+{
+    BRSet *remaining = BRSetNew(BRTransactionHash, BRTransactionEq, txCount);
+    BRTxLoadKey *keys = calloc(txCount + 1, sizeof(*keys));
+    BRTxLoadFrame *stack;
+    size_t i, j = 0;
+
+    assert(keys != NULL);
+    BRSetAddBulk(remaining, (void **)txs, txCount);
+
+    for (i = 0; i < txCount; i++) {
+        keys[i] = (BRTxLoadKey) { txs[i], txs[i]->blockHeight, (txs[i]->timestamp) ? txs[i]->timestamp : UINT32_MAX,
+                                  _txChainIndex(wallet, txs[i], SEQUENCE_INTERNAL_CHAIN),
+                                  _txChainIndex(wallet, txs[i], SEQUENCE_EXTERNAL_CHAIN) };
+    }
+
+    qsort(keys, txCount, sizeof(*keys), _txLoadCompare);
+    array_new(stack, 10);
+
+    // depth first walk that places each tx after any tx in the same block that it depends on
+    for (i = 0; i < txCount; i++) {
+        if (! BRSetContains(remaining, keys[i].tx)) continue;
+        array_add(stack, ((BRTxLoadFrame) { keys[i].tx, 0 }));
+        BRSetRemove(remaining, keys[i].tx);
+
+        while (array_count(stack) > 0) {
+            BRTransaction *tx = stack[array_count(stack) - 1].tx, *t = NULL;
+
+            while (! t && stack[array_count(stack) - 1].n < tx->inCount) {
+                t = BRSetGet(wallet->allTx, &tx->inputs[stack[array_count(stack) - 1].n++].txHash);
+                if (t && (t->blockHeight != tx->blockHeight || ! BRSetContains(remaining, t))) t = NULL;
+            }
+
+            if (t) {
+                array_add(stack, ((BRTxLoadFrame) { t, 0 }));
+                BRSetRemove(remaining, t);
+            }
+            else {
+                txs[j++] = tx; // keys hold their own copy of each tx pointer, so txs can be overwritten in place
+                array_rm_last(stack);
+            }
+        }
+    }
+
+    array_free(stack);
+    BRSetFree(remaining);
+    free(keys);
+}
+
+// sorts the count tx at wallet->transactions[idx], which must be whole blocks, with _BRWalletSortTxs(), and rewinds the
+// balance state to the first one that moved
+// tx in unindexed are indexed, or all of them if unindexed is NULL, and the rest are re-indexed in any block where
+// their order changed, since the direction and address indexes follow the order of wallet->transactions in a block
+static void _BRWalletSortRange(BRWallet *wallet, size_t idx, size_t count, BRSet *unindexed)
+{
+    BRTransaction **txs = &wallet->transactions[idx], **old = malloc((count + 1)*sizeof(*old));
+    size_t i, j, k, l;
+    int changed;
+
+    assert(old != NULL);
+    memcpy(old, txs, count*sizeof(*old));
+    _BRWalletSortTxs(wallet, txs, count);
+    for (i = 0; i < count && txs[i] == old[i]; i++);
+    _BRWalletRewindBalance(wallet, idx + i);
+
+    for (i = 0, j = 0; i < count; i = k) {
+        for (k = i, changed = 0; k < count && txs[k]->blockHeight == txs[i]->blockHeight; k++) {
+            if (! unindexed || BRSetContains(unindexed, txs[k])) continue;
+            while (BRSetContains(unindexed, old[j])) j++; // tx that are already indexed kept their block height
+            if (old[j++] != txs[k]) changed = 1;
+        }
+
+        for (l = i; changed && l < k; l++) {
+            if (! BRSetContains(unindexed, txs[l])) _BRWalletUnindexTx(wallet, txs[l]);
+        }
+
+        for (l = i; l < k; l++) {
+            if (changed || ! unindexed || BRSetContains(unindexed, txs[l])) _BRWalletIndexTx(wallet, txs[l]);
+        }
+    }
+
+    free(old);
+}
+
+// inserts tx into wallet->transactions, keeping wallet->transactions sorted by _BRWalletSortTxs(), and indexes it
+static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+{
+    BRSet *unindexed = BRSetNew(BRTransactionHash, BRTransactionEq, 1);
+    size_t count = array_count(wallet->transactions),
+           lo = _txListLowerBound(wallet->transactions, count, tx->blockHeight), hi = lo;
+
+    while (hi < count && wallet->transactions[hi]->blockHeight == tx->blockHeight) hi++;
+    _BRWalletRewindBalance(wallet, hi); // tx from hi onward will shift, so their balance state must be re-applied
+    array_insert(wallet->transactions, hi, tx);
+    BRSetAdd(unindexed, tx);
+    _BRWalletSortRange(wallet, lo, hi + 1 - lo, unindexed); // only the block tx is added to can change order
+    BRSetFree(unindexed);
 }
 
 // non-threadsafe version of BRWalletContainsTransaction()
@@ -137,140 +502,612 @@ static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx)
     return r;
 }
 
-static void _BRWalletUpdateBalance(BRWallet *wallet)
+inline static void _BRWalletUndoAdd(BRWallet *wallet, int type, size_t index, const void *item)
+{
+    array_add(wallet->balanceUndo, ((BRBalanceUndo) { type, (uint32_t)index, item }));
+}
+
+// adds the inputs of a wallet tx to wallet->spends, the BRTxSpend for all inputs are allocated in one block
+static void _BRWalletAddSpends(BRWallet *wallet, BRTransaction *tx)
+{
+    BRTxSpend *spend, *block = (tx->inCount > 0) ? calloc(tx->inCount, sizeof(*block)) : NULL;
+
+    assert(block != NULL || tx->inCount == 0);
+
+    for (size_t i = 0; i < tx->inCount; i++) {
+        block[i] = (BRTxSpend) { { tx->inputs[i].txHash, tx->inputs[i].index }, tx, NULL };
+        spend = BRSetGet(wallet->spends, &block[i].outpoint);
+
+        if (spend) { // double spend, append to the outpoint's chain
+            while (spend->next) spend = spend->next;
+            spend->next = &block[i];
+        }
+        else BRSetAdd(wallet->spends, &block[i]);
+    }
+}
+
+// removes the inputs of a wallet tx from wallet->spends, and frees their BRTxSpend block
+static void _BRWalletRemoveSpends(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRTxSpend *head, *spend, *block = NULL;
+
+    for (size_t i = 0; i < tx->inCount; i++) {
+        head = spend = BRSetGet(wallet->spends, &tx->inputs[i]);
+        while (spend && spend->tx != tx) spend = spend->next;
+        if (! spend) continue;
+        if (i == 0) block = spend;
+
+        if (spend == head) { // the next spend of the same outpoint becomes the head of the chain
+            if (spend->next) BRSetAdd(wallet->spends, spend->next);
+            else BRSetRemove(wallet->spends, spend);
+        }
+        else {
+            while (head->next != spend) head = head->next;
+            head->next = spend->next;
+        }
+    }
+
+    free(block);
+}
+
+// drops tx from the non-wallet tx pool without freeing it, if it's there
+static void _BRWalletPoolForget(BRWallet *wallet, const BRTransaction *tx)
 {
+    BRPoolTx *entry = BRSetGet(wallet->poolTx, tx);
+
+    if (entry) {
+        BRSetRemove(wallet->poolTx, entry);
+        free(entry);
+        wallet->poolStats.removed++;
+    }
+}
+
+// evicts and frees the least recently relayed non-wallet tx until there's room for one more within the pool limits,
+// along with any that haven't been relayed in maxAge seconds
+static void _BRWalletPoolEvict(BRWallet *wallet, time_t now)
+{
+    BRPoolOrder o;
+    BRPoolTx *entry;
+
+    while (deque_count(wallet->poolOrder) > 0) {
+        o = deque_front(wallet->poolOrder);
+        entry = BRSetGet(wallet->poolTx, &o.txHash);
+
+        if (entry && entry->seq == o.seq) {
+            if (BRSetCount(wallet->poolTx) >= wallet->poolMaxCount) wallet->poolStats.evictedCount++;
+            else if (entry->relayed + wallet->poolMaxAge <= now) wallet->poolStats.evictedAge++;
+            else break;
+
+            // wallet tx spending it are marked TX_STATUS_VOLATILE, so their status doesn't depend on it being kept
+            BRSetRemove(wallet->allTx, entry->tx);
+            BRSetRemove(wallet->poolTx, entry);
+            BRTransactionFree(entry->tx);
+            free(entry);
+        }
+
+        deque_pop_front(wallet->poolOrder);
+    }
+
+    // entries for tx that were relayed again or removed are stale, so drop them once they outnumber the pool
+    if (deque_count(wallet->poolOrder) > BRSetCount(wallet->poolTx)*2 + 16) {
+        for (size_t i = deque_count(wallet->poolOrder); i > 0; i--) {
+            o = deque_front(wallet->poolOrder);
+            deque_pop_front(wallet->poolOrder);
+            entry = BRSetGet(wallet->poolTx, &o.txHash);
+            if (entry && entry->seq == o.seq) deque_push_back(wallet->poolOrder, o);
+        }
+    }
+}
+
+// adds an unconfirmed non-wallet tx to allTx and the pool, or marks it as just relayed if it's already there
+static void _BRWalletPoolAdd(BRWallet *wallet, BRTransaction *tx)
+{
+    time_t now = time(NULL);
+    BRPoolTx *entry = BRSetGet(wallet->poolTx, tx);
+
+    if (! entry) {
+        _BRWalletPoolEvict(wallet, now);
+        entry = calloc(1, sizeof(*entry));
+        assert(entry != NULL);
+        entry->txHash = tx->txHash;
+        entry->tx = tx;
+        BRSetAdd(wallet->poolTx, entry);
+        BRSetAdd(wallet->allTx, tx);
+        wallet->poolStats.added++;
+    }
+
+    entry->relayed = now;
+    entry->seq = ++wallet->poolSeq;
+    deque_push_back(wallet->poolOrder, ((BRPoolOrder) { entry->txHash, entry->seq }));
+}
+
+// TX_STATUS_ flags for tx, the same as the recursive checks BRWalletTransactionIsValid(), BRWalletTransactionIsPending()
+// and BRWalletTransactionIsVerified() would make, using the memoized status of input tx where available
+// wallet->lock must be held
+static uint32_t _BRWalletTxStatus(BRWallet *wallet, const BRTransaction *tx, time_t now, int useCache)
+{
+    const BRTxStatus *status = (useCache) ? BRSetGet(wallet->txStatus, tx) : NULL;
+    const BRTransaction *t;
+    uint32_t flags = 0, f;
+    size_t i;
+
+    if (tx->blockHeight != TX_UNCONFIRMED) return 0; // confirmed tx are valid, not pending and verified
+    if (status && status->tx == tx && ! (status->flags & TX_STATUS_VOLATILE)) return status->flags;
+
+    if (! BRSetContains(wallet->allTx, tx)) {
+        for (i = 0; i < tx->inCount; i++) {
+            if (BRSetContains(wallet->spentOutputs, &tx->inputs[i])) flags |= TX_STATUS_INVALID;
+        }
+
+        flags |= TX_STATUS_VOLATILE; // later wallet tx may spend the same outputs
+    }
+    else if (BRSetContains(wallet->invalidTx, tx)) flags |= TX_STATUS_INVALID;
+
+    if (BRTransactionSize(tx) > TX_MAX_SIZE) flags |= TX_STATUS_PENDING; // check tx size is under TX_MAX_SIZE
+
+    for (i = 0; i < tx->outCount; i++) {
+        if (tx->outputs[i].amount < TX_MIN_OUTPUT_AMOUNT) flags |= TX_STATUS_PENDING; // check that no outputs are dust
+    }
+
+    for (i = 0; i < tx->inCount; i++) {
+        if (tx->inputs[i].sequence < UINT32_MAX - 1) flags |= TX_STATUS_PENDING; // check for replace-by-fee
+
+        // future lockTime, which stops being pending as blocks arrive and time passes
+        if (tx->inputs[i].sequence < UINT32_MAX && ((tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+            tx->lockTime > wallet->blockHeight + 1) || tx->lockTime > now)) {
+            flags |= TX_STATUS_PENDING | TX_STATUS_VOLATILE;
+        }
+
+        t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
+        if (! t) continue;
+        status = BRSetGet(wallet->txStatus, t);
+        f = _BRWalletTxStatus(wallet, t, now, 1);
+        flags |= f; // inputs that are invalid, pending or unverified make tx the same
+        if (! status || status->tx != t) flags |= TX_STATUS_VOLATILE; // non-wallet tx status can change at any time
+    }
+
+    if (tx->timestamp == 0 || (flags & (TX_STATUS_INVALID | TX_STATUS_PENDING))) flags |= TX_STATUS_UNVERIFIED;
+    return flags;
+}
+
+// removes the utxo spent by the given input, if it's in the utxo set, and returns its amount
+static uint64_t _BRWalletSpendUTXO(BRWallet *wallet, const BRTxInput *input)
+{
+    BRTransaction *t = BRSetGet(wallet->allTx, &input->txHash);
+    uint32_t n = input->index;
+
+    // only outputs to wallet addresses can be utxos
+    if (! t || n >= t->outCount || ! BRSetContains(wallet->allAddrs, t->outputs[n].address)) return 0;
+
+    for (size_t i = array_count(wallet->utxos); i > 0; i--) {
+        if (wallet->utxos[i - 1].n != n || ! UInt256Eq(wallet->utxos[i - 1].hash, input->txHash)) continue;
+        array_rm(wallet->utxos, i - 1);
+        wallet->utxoOrderValid = 0;
+        _BRWalletUndoAdd(wallet, BALANCE_UNDO_UTXO_RM, i - 1, input);
+        return t->outputs[n].amount;
+    }
+
+    return 0;
+}
+
+// applies the next tx in wallet->transactions to the utxo set, spent outputs, balance and balance history
+static void _BRWalletApplyTx(BRWallet *wallet, BRTransaction *tx, time_t now)
+{
+    size_t i = array_count(wallet->balanceHist), j, spentCount = 0;
+    uint64_t balance = (i > 0) ? wallet->balanceHist[i - 1] : 0, prevBalance = balance;
+    const BRTxInput *spent[tx->inCount + 1]; // + 1 so it isn't a zero length array for a tx with no inputs
     int isInvalid, isPending;
-    uint64_t balance = 0, prevBalance = 0;
+
+    _BRWalletUndoAdd(wallet, BALANCE_UNDO_TX, i, tx);
+
+    // check if any inputs are invalid or already spent
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        for (j = 0, isInvalid = 0; ! isInvalid && j < tx->inCount; j++) {
+            if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
+                BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
+        }
+
+        if (isInvalid) {
+            BRSetAdd(wallet->invalidTx, tx);
+            _BRWalletUndoAdd(wallet, BALANCE_UNDO_INVALID, 0, tx);
+            array_add(wallet->balanceHist, balance);
+            return;
+        }
+    }
+
+    // add inputs to spent output set
+    for (j = 0; j < tx->inCount; j++) {
+        if (BRSetContains(wallet->spentOutputs, &tx->inputs[j])) continue;
+        BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+        _BRWalletUndoAdd(wallet, BALANCE_UNDO_SPENT, 0, &tx->inputs[j]);
+        spent[spentCount++] = &tx->inputs[j];
+    }
+
+    // check if tx is pending
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
+
+        for (j = 0; ! isPending && j < tx->outCount; j++) {
+            if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
+        }
+
+        for (j = 0; ! isPending && j < tx->inCount; j++) {
+            if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+                tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
+            if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
+            // TODO: XXX handle BIP68 check lock time verify rules
+        }
+
+        if (isPending) {
+            BRSetAdd(wallet->pendingTx, tx);
+            _BRWalletUndoAdd(wallet, BALANCE_UNDO_PENDING, 0, tx);
+
+            // outputs spent by a pending tx stay in the utxo set until the next tx that isn't pending or invalid
+            for (j = 0; j < spentCount; j++) {
+                array_add(wallet->deferredSpent, spent[j]);
+                _BRWalletUndoAdd(wallet, BALANCE_UNDO_DEFER, 0, spent[j]);
+            }
+
+            array_add(wallet->balanceHist, balance);
+            return;
+        }
+    }
+
+    // add outputs to UTXO set
+    // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
+    // TODO: don't add coin generation outputs < 100 blocks deep
+    // NOTE: balance/UTXOs will then need to be recalculated when last block changes
+    for (j = 0; j < tx->outCount; j++) {
+        if (tx->outputs[j].address[0] == '\0') continue;
+
+        if (! BRSetContains(wallet->usedAddrs, tx->outputs[j].address)) {
+            BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
+            _BRWalletAddrUsed(wallet, tx->outputs[j].address);
+            _BRWalletUndoAdd(wallet, BALANCE_UNDO_USED, 0, tx->outputs[j].address);
+        }
+
+        if (BRSetContains(wallet->allAddrs, tx->outputs[j].address)) {
+            BRUTXO utxo = { tx->txHash, (uint32_t)j };
+
+            // transaction ordering is not guaranteed, so the output may already be spent by an earlier tx
+            if (BRSetContains(wallet->spentOutputs, &utxo)) continue;
+            array_add(wallet->utxos, utxo);
+            wallet->utxoOrderValid = 0;
+            _BRWalletUndoAdd(wallet, BALANCE_UNDO_UTXO_ADD, 0, tx);
+            balance += tx->outputs[j].amount;
+        }
+    }
+
+    // every other utxo was already checked against the spent outputs that existed when it was added, so only outputs
+    // spent since then, by this tx or by pending tx before it, need to be removed
+    while (array_count(wallet->deferredSpent) > 0) {
+        const BRTxInput *input = wallet->deferredSpent[array_count(wallet->deferredSpent) - 1];
+
+        array_rm_last(wallet->deferredSpent);
+        _BRWalletUndoAdd(wallet, BALANCE_UNDO_TAKE, 0, input);
+        balance -= _BRWalletSpendUTXO(wallet, input);
+    }
+
+    for (j = 0; j < spentCount; j++) {
+        balance -= _BRWalletSpendUTXO(wallet, spent[j]);
+    }
+
+    if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
+    if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
+    array_add(wallet->balanceHist, balance);
+}
+
+// undoes _BRWalletApplyTx() for wallet->transactions from txIdx to the end, this must be called before the tx at txIdx
+// or later are inserted, removed or modified, and _BRWalletUpdateBalance() must be called before releasing the lock
+static void _BRWalletRewindBalance(BRWallet *wallet, size_t txIdx)
+{
+    size_t i = array_count(wallet->balanceHist);
+    BRBalanceUndo u;
+
+    for (; i > txIdx; i--) {
+        uint64_t balance = wallet->balanceHist[i - 1], prevBalance = (i > 1) ? wallet->balanceHist[i - 2] : 0;
+
+        if (prevBalance < balance) wallet->totalReceived -= balance - prevBalance;
+        if (balance < prevBalance) wallet->totalSent -= prevBalance - balance;
+        array_rm_last(wallet->balanceHist);
+        BRSetRemove(wallet->txStatus, &chunk_array_item(wallet->statusHist, i - 1));
+        chunk_array_rm_last(wallet->statusHist);
+
+        do {
+            u = wallet->balanceUndo[array_count(wallet->balanceUndo) - 1];
+            array_rm_last(wallet->balanceUndo);
+
+            switch (u.type) {
+                case BALANCE_UNDO_INVALID: BRSetRemove(wallet->invalidTx, u.item); break;
+                case BALANCE_UNDO_PENDING: BRSetRemove(wallet->pendingTx, u.item); break;
+                case BALANCE_UNDO_SPENT: BRSetRemove(wallet->spentOutputs, u.item); break;
+                case BALANCE_UNDO_USED:
+                    BRSetRemove(wallet->usedAddrs, u.item);
+                    _BRWalletAddrUnused(wallet, u.item);
+                    break;
+                case BALANCE_UNDO_UTXO_ADD:
+                    array_rm_last(wallet->utxos);
+                    wallet->utxoOrderValid = 0;
+                    break;
+                case BALANCE_UNDO_DEFER: array_rm_last(wallet->deferredSpent); break;
+                case BALANCE_UNDO_TAKE: array_add(wallet->deferredSpent, u.item); break;
+                case BALANCE_UNDO_UTXO_RM:
+                    array_insert(wallet->utxos, u.index, ((BRUTXO) { ((const BRTxInput *)u.item)->txHash,
+                                                                     ((const BRTxInput *)u.item)->index }));
+                    wallet->utxoOrderValid = 0;
+                    break;
+            }
+        } while (u.type != BALANCE_UNDO_TX);
+    }
+
+    i = array_count(wallet->balanceHist);
+    wallet->balance = (i > 0) ? wallet->balanceHist[i - 1] : 0;
+}
+
+#if WALLET_VERIFY_BALANCE
+// debug cross-check of the incremental balance state against a full recomputation from scratch
+// NOTE: pending status depends on the current time, so a tx whose lockTime passed since it was applied will mismatch
+static void _BRWalletVerifyBalance(BRWallet *wallet)
+{
+    BRSet *spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, 100), *invalidTx = BRSetNew(BRTransactionHash,
+          BRTransactionEq, 10), *pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    uint64_t balance = 0, prevBalance = 0, totalSent = 0, totalReceived = 0, *balanceHist;
     time_t now = time(NULL);
-    size_t i, j;
+    size_t i, j, k;
+    BRUTXO *utxos;
     BRTransaction *tx, *t;
-    
-    array_clear(wallet->utxos);
-    array_clear(wallet->balanceHist);
-    BRSetClear(wallet->spentOutputs);
-    BRSetClear(wallet->invalidTx);
-    BRSetClear(wallet->pendingTx);
-    BRSetClear(wallet->usedAddrs);
-    wallet->totalSent = 0;
-    wallet->totalReceived = 0;
+    int isInvalid, isPending;
+
+    array_new(utxos, array_count(wallet->utxos));
+    array_new(balanceHist, array_count(wallet->transactions));
 
     for (i = 0; i < array_count(wallet->transactions); i++) {
         tx = wallet->transactions[i];
 
-        // check if any inputs are invalid or already spent
         if (tx->blockHeight == TX_UNCONFIRMED) {
             for (j = 0, isInvalid = 0; ! isInvalid && j < tx->inCount; j++) {
-                if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
-                    BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
+                if (BRSetContains(spentOutputs, &tx->inputs[j]) ||
+                    BRSetContains(invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
             }
-        
+
             if (isInvalid) {
-                BRSetAdd(wallet->invalidTx, tx);
-                array_add(wallet->balanceHist, balance);
+                BRSetAdd(invalidTx, tx);
+                array_add(balanceHist, balance);
                 continue;
             }
         }
 
-        // add inputs to spent output set
         for (j = 0; j < tx->inCount; j++) {
-            BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+            BRSetAdd(spentOutputs, &tx->inputs[j]);
         }
 
-        // check if tx is pending
         if (tx->blockHeight == TX_UNCONFIRMED) {
-            isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
-            
+            isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0;
+
             for (j = 0; ! isPending && j < tx->outCount; j++) {
-                if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
+                if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1;
             }
 
             for (j = 0; ! isPending && j < tx->inCount; j++) {
-                if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
+                if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1;
                 if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                    tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
-                if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
-                // TODO: XXX handle BIP68 check lock time verify rules
+                    tx->lockTime > wallet->blockHeight + 1) isPending = 1;
+                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1;
+                if (BRSetContains(pendingTx, &tx->inputs[j].txHash)) isPending = 1;
             }
-            
+
             if (isPending) {
-                BRSetAdd(wallet->pendingTx, tx);
-                array_add(wallet->balanceHist, balance);
+                BRSetAdd(pendingTx, tx);
+                array_add(balanceHist, balance);
                 continue;
             }
         }
 
-        // add outputs to UTXO set
-        // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
-        // TODO: don't add coin generation outputs < 100 blocks deep
-        // NOTE: balance/UTXOs will then need to be recalculated when last block changes
         for (j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') {
-                BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
-                
-                if (BRSetContains(wallet->allAddrs, tx->outputs[j].address)) {
-                    array_add(wallet->utxos, ((BRUTXO) { tx->txHash, (uint32_t)j }));
-                    balance += tx->outputs[j].amount;
-                }
+            if (tx->outputs[j].address[0] == '\0') continue;
+            assert(BRSetContains(wallet->usedAddrs, tx->outputs[j].address));
+
+            if (BRSetContains(wallet->allAddrs, tx->outputs[j].address)) {
+                array_add(utxos, ((BRUTXO) { tx->txHash, (uint32_t)j }));
+                balance += tx->outputs[j].amount;
             }
         }
 
-        // transaction ordering is not guaranteed, so check the entire UTXO set against the entire spent output set
-        for (j = array_count(wallet->utxos); j > 0; j--) {
-            if (! BRSetContains(wallet->spentOutputs, &wallet->utxos[j - 1])) continue;
-            t = BRSetGet(wallet->allTx, &wallet->utxos[j - 1].hash);
-            balance -= t->outputs[wallet->utxos[j - 1].n].amount;
-            array_rm(wallet->utxos, j - 1);
+        for (j = array_count(utxos); j > 0; j--) {
+            if (! BRSetContains(spentOutputs, &utxos[j - 1])) continue;
+            t = BRSetGet(wallet->allTx, &utxos[j - 1].hash);
+            balance -= t->outputs[utxos[j - 1].n].amount;
+            array_rm(utxos, j - 1);
         }
-        
-        if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
-        if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
-        array_add(wallet->balanceHist, balance);
+
+        if (prevBalance < balance) totalReceived += balance - prevBalance;
+        if (balance < prevBalance) totalSent += prevBalance - balance;
+        array_add(balanceHist, balance);
         prevBalance = balance;
     }
 
+    assert(balance == wallet->balance);
+    assert(totalSent == wallet->totalSent && totalReceived == wallet->totalReceived);
+    assert(array_count(balanceHist) == array_count(wallet->balanceHist));
+    assert(memcmp(balanceHist, wallet->balanceHist, array_count(balanceHist)*sizeof(*balanceHist)) == 0);
+    assert(array_count(utxos) == array_count(wallet->utxos));
+    for (k = 0; k < array_count(utxos); k++) assert(BRUTXOEq(&utxos[k], &wallet->utxos[k]));
+    assert(BRSetCount(spentOutputs) == BRSetCount(wallet->spentOutputs));
+    assert(BRSetCount(invalidTx) == BRSetCount(wallet->invalidTx));
+    assert(BRSetCount(pendingTx) == BRSetCount(wallet->pendingTx));
+    assert(chunk_array_count(wallet->statusHist) == array_count(wallet->transactions));
+    assert(BRSetCount(wallet->txStatus) == array_count(wallet->transactions));
+
+    for (k = chunk_array_count(wallet->internalChain); k > 0; k--) {
+        if (BRSetContains(wallet->usedAddrs, &chunk_array_item(wallet->internalChain, k - 1))) break;
+    }
+
+    assert(k == wallet->chainUsed[SEQUENCE_INTERNAL_CHAIN]);
+
+    for (k = chunk_array_count(wallet->externalChain); k > 0; k--) {
+        if (BRSetContains(wallet->usedAddrs, &chunk_array_item(wallet->externalChain, k - 1))) break;
+    }
+
+    assert(k == wallet->chainUsed[SEQUENCE_EXTERNAL_CHAIN]);
+
+    for (k = 0; k < array_count(wallet->transactions); k++) {
+        tx = wallet->transactions[k];
+
+        for (j = 0; j < tx->inCount; j++) {
+            const BRTxSpend *spend = BRSetGet(wallet->spends, &tx->inputs[j]);
+
+            while (spend && spend->tx != tx) spend = spend->next;
+            assert(spend != NULL);
+        }
+
+        assert(BRSetGet(wallet->txStatus, tx) == &chunk_array_item(wallet->statusHist, k));
+        assert(chunk_array_item(wallet->statusHist, k).tx == tx);
+        assert(chunk_array_item(wallet->statusHist, k).flags == _BRWalletTxStatus(wallet, tx, now, 0));
+    }
+
+    array_free(utxos);
+    array_free(balanceHist);
+    BRSetFree(spentOutputs);
+    BRSetFree(invalidTx);
+    BRSetFree(pendingTx);
+}
+#endif
+
+// applies any wallet->transactions not yet reflected in the balance state, i.e. everything after the last rewind
+static void _BRWalletUpdateBalance(BRWallet *wallet)
+{
+    time_t now = time(NULL);
+    size_t i = array_count(wallet->balanceHist);
+    BRTransaction *tx;
+
+    if (i == 0) { // starting from scratch, so drop anything added outside of _BRWalletApplyTx()
+        chunk_array_clear(wallet->statusHist);
+        BRSetClear(wallet->txStatus);
+        array_clear(wallet->utxos);
+        wallet->utxoOrderValid = 0;
+        array_clear(wallet->balanceUndo);
+        array_clear(wallet->deferredSpent);
+        BRSetClear(wallet->spentOutputs);
+        BRSetClear(wallet->invalidTx);
+        BRSetClear(wallet->pendingTx);
+        BRSetClear(wallet->usedAddrs);
+        wallet->chainUsed[SEQUENCE_EXTERNAL_CHAIN] = wallet->chainUsed[SEQUENCE_INTERNAL_CHAIN] = 0;
+        wallet->totalSent = 0;
+        wallet->totalReceived = 0;
+    }
+
+    for (; i < array_count(wallet->transactions); i++) {
+        tx = wallet->transactions[i];
+        _BRWalletApplyTx(wallet, tx, now);
+        // input tx come first in wallet->transactions, so their status is already memoized
+        chunk_array_add(wallet->statusHist, ((BRTxStatus) { tx->txHash, tx, _BRWalletTxStatus(wallet, tx, now, 0) }));
+        BRSetAdd(wallet->txStatus, &chunk_array_item(wallet->statusHist, i));
+    }
+
     assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
-    wallet->balance = balance;
+    i = array_count(wallet->balanceHist);
+    wallet->balance = (i > 0) ? wallet->balanceHist[i - 1] : 0;
+    pthread_mutex_lock(&wallet->snapshotLock);
+    wallet->snapshot = (BRBalanceSnapshot) { wallet->balance, wallet->totalSent, wallet->totalReceived };
+    pthread_mutex_unlock(&wallet->snapshotLock);
+#if WALLET_VERIFY_BALANCE
+    _BRWalletVerifyBalance(wallet);
+#endif
 }
 
 // allocates and populates a BRWallet struct which must be freed by calling BRWalletFree()
 BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk)
+{
+    return BRWalletNewWithGapLimits(transactions, txCount, mpk, SEQUENCE_GAP_LIMIT_EXTERNAL,
+                                    SEQUENCE_GAP_LIMIT_INTERNAL);
+}
+
+// allocates and populates a BRWallet struct like BRWalletNew(), but keeps at least externalGapLimit receive addresses
+// and internalGapLimit change addresses unused at the end of each chain
+BRWallet *BRWalletNewWithGapLimits(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk,
+                                   uint32_t externalGapLimit, uint32_t internalGapLimit)
 {
     BRWallet *wallet = NULL;
     BRTransaction *tx;
+    size_t inCount = 0, outCount = 0;
 
     assert(transactions != NULL || txCount == 0);
     wallet = calloc(1, sizeof(*wallet));
     assert(wallet != NULL);
+    wallet->gapLimits[SEQUENCE_EXTERNAL_CHAIN] =
+        (externalGapLimit > SEQUENCE_GAP_LIMIT_EXTERNAL) ? externalGapLimit : SEQUENCE_GAP_LIMIT_EXTERNAL;
+    wallet->gapLimits[SEQUENCE_INTERNAL_CHAIN] =
+        (internalGapLimit > SEQUENCE_GAP_LIMIT_INTERNAL) ? internalGapLimit : SEQUENCE_GAP_LIMIT_INTERNAL;
     array_new(wallet->utxos, 100);
+    array_new(wallet->utxoOrder, 100);
     array_new(wallet->transactions, txCount + 100);
+    array_new(wallet->sentTx, txCount/2 + 100);
+    array_new(wallet->receivedTx, txCount/2 + 100);
     wallet->feePerKb = DEFAULT_FEE_PER_KB;
     wallet->masterPubKey = mpk;
-    array_new(wallet->internalChain, 100);
-    array_new(wallet->externalChain, 100);
+    chunk_array_new(wallet->internalChain, 100);
+    chunk_array_new(wallet->externalChain, 100);
     array_new(wallet->balanceHist, txCount + 100);
+    array_new(wallet->balanceUndo, txCount*4 + 100);
+    array_new(wallet->deferredSpent, 10);
+    chunk_array_new(wallet->statusHist, 100);
     wallet->allTx = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
     wallet->invalidTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     wallet->pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     wallet->spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
     wallet->usedAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
-    wallet->allAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
-    pthread_mutex_init(&wallet->lock, NULL);
+    wallet->allAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + wallet->gapLimits[SEQUENCE_EXTERNAL_CHAIN] +
+                                wallet->gapLimits[SEQUENCE_INTERNAL_CHAIN] + 100);
+    wallet->txStatus = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
+    wallet->spends = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
+    wallet->addrTx = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
+    wallet->poolTx = BRSetNew(BRTransactionHash, BRTransactionEq, 100);
+    deque_new(wallet->poolOrder, 128);
+    wallet->poolMaxCount = TX_POOL_MAX_COUNT;
+    wallet->poolMaxAge = TX_POOL_MAX_AGE;
+    pthread_rwlock_init(&wallet->lock, NULL);
+    pthread_mutex_init(&wallet->writerGate, NULL);
+    pthread_mutex_init(&wallet->snapshotLock, NULL);
+    pthread_mutex_init(&wallet->utxoOrderLock, NULL);
+    pthread_mutex_init(&wallet->eventLock, NULL);
+    chunk_array_new(wallet->txEvents, 100);
+    wallet->txEventSet = BRSetNew(BRTransactionHash, BRTransactionEq, 100);
+
+    for (size_t i = 0; transactions && i < txCount; i++) {
+        inCount += transactions[i]->inCount;
+        outCount += transactions[i]->outCount;
+    }
+
+    BRSetReserve(wallet->spentOutputs, inCount); // size sets up front to avoid rehashing while loading
+    BRSetReserve(wallet->spends, inCount);
+    BRSetReserve(wallet->usedAddrs, outCount);
+
+    BRTransaction **loadTx = calloc(txCount + 1, sizeof(*loadTx));
+    size_t loadCount = 0;
+
+    assert(loadTx != NULL);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         tx = transactions[i];
         if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
         BRSetAdd(wallet->allTx, tx);
-        _BRWalletInsertTx(wallet, tx);
+        loadTx[loadCount++] = tx;
 
         for (size_t j = 0; j < tx->outCount; j++) {
             if (tx->outputs[j].address[0] != '\0') BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
         }
     }
     
-    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+    BRWalletUnusedAddrs(wallet, NULL, wallet->gapLimits[SEQUENCE_EXTERNAL_CHAIN], 0);
+    BRWalletUnusedAddrs(wallet, NULL, wallet->gapLimits[SEQUENCE_INTERNAL_CHAIN], 1);
+    array_add_array(wallet->transactions, loadTx, loadCount);
+    _BRWalletSortRange(wallet, 0, loadCount, NULL); // sort once, after the address chains are generated
+    for (size_t i = 0; i < loadCount; i++) _BRWalletAddSpends(wallet, wallet->transactions[i]);
+
     _BRWalletUpdateBalance(wallet);
+    free(loadTx);
 
     if (txCount > 0 && ! _BRWalletContainsTx(wallet, transactions[0])) { // verify transactions match master pubKey
         BRWalletFree(wallet);
@@ -303,6 +1140,197 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
     wallet->txDeleted = txDeleted;
 }
 
+// not thread-safe, set once after BRWalletSetCallbacks(), before calling other BRWallet functions
+// void txBatchUpdated(void *, const BRTxUpdate[], size_t)
+//   - called instead of txUpdated with all the block height and timestamp changes made by a single wallet call
+void BRWalletSetTxBatchCallback(BRWallet *wallet,
+                                void (*txBatchUpdated)(void *info, const BRTxUpdate updates[], size_t updateCount))
+{
+    assert(wallet != NULL);
+    wallet->txBatchUpdated = txBatchUpdated;
+}
+
+// calls txBatchUpdated with the updates, or txUpdated for each run of them with the same block height and timestamp
+static void _BRWalletCallTxUpdated(BRWallet *wallet, const BRTxUpdate updates[], size_t updateCount)
+{
+    size_t i, j;
+
+    if (updateCount == 0) return;
+
+    if (wallet->txBatchUpdated) wallet->txBatchUpdated(wallet->callbackInfo, updates, updateCount);
+    else if (wallet->txUpdated) {
+        UInt256 *hashes = malloc(updateCount*sizeof(*hashes));
+
+        assert(hashes != NULL);
+
+        for (i = 0; i < updateCount; i = j) {
+            for (j = i; j < updateCount && updates[j].blockHeight == updates[i].blockHeight &&
+                 updates[j].timestamp == updates[i].timestamp; j++) hashes[j - i] = updates[j].txHash;
+            wallet->txUpdated(wallet->callbackInfo, hashes, j - i, updates[i].blockHeight, updates[i].timestamp);
+        }
+
+        free(hashes);
+    }
+}
+
+// returns the callbacks due for txHash in the current batch, or NULL if callbacks aren't being coalesced
+// must be called with wallet->eventLock held
+static BRTxEvent *_BRWalletTxEvent(BRWallet *wallet, UInt256 txHash)
+{
+    BRTxEvent *event;
+
+    if (wallet->batchDepth == 0) return NULL;
+    event = BRSetGet(wallet->txEventSet, &txHash);
+
+    if (! event) {
+        chunk_array_add(wallet->txEvents, ((BRTxEvent) { txHash, NULL, 0, 0, 0, 0, 0 }));
+        event = &chunk_array_item(wallet->txEvents, chunk_array_count(wallet->txEvents) - 1);
+        BRSetAdd(wallet->txEventSet, event);
+    }
+
+    return event;
+}
+
+// calls balanceChanged with the balance snapshot, unless callbacks are being coalesced, in which case the final balance
+// is reported by BRWalletEndBatch(), called without wallet->lock, so it mustn't read wallet->balance directly
+static void _BRWalletBalanceChanged(BRWallet *wallet)
+{
+    int batched;
+
+    pthread_mutex_lock(&wallet->eventLock);
+    batched = (wallet->batchDepth > 0);
+    pthread_mutex_unlock(&wallet->eventLock);
+    if (! batched && wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, BRWalletBalance(wallet));
+}
+
+// calls txAdded, or records it for BRWalletEndBatch()
+static void _BRWalletTxAdded(BRWallet *wallet, BRTransaction *tx)
+{
+    BRTxEvent *event;
+
+    pthread_mutex_lock(&wallet->eventLock);
+    event = _BRWalletTxEvent(wallet, tx->txHash);
+
+    if (event) { // any earlier update is superseded, txAdded reports the final block height and timestamp
+        event->tx = tx;
+        event->flags = (event->flags & TX_EVENT_DELETED) | TX_EVENT_ADDED;
+    }
+
+    pthread_mutex_unlock(&wallet->eventLock);
+    if (! event && wallet->txAdded) wallet->txAdded(wallet->callbackInfo, tx);
+}
+
+// calls txDeleted, or records it for BRWalletEndBatch()
+static void _BRWalletTxDeleted(BRWallet *wallet, UInt256 txHash, int notifyUser, int recommendRescan)
+{
+    BRTxEvent *event;
+
+    pthread_mutex_lock(&wallet->eventLock);
+    event = _BRWalletTxEvent(wallet, txHash);
+
+    if (event && (event->flags & TX_EVENT_ADDED)) { // added during the batch, so neither is reported
+        event->tx = NULL;
+        event->flags &= TX_EVENT_DELETED;
+    }
+    else if (event) {
+        event->flags = TX_EVENT_DELETED;
+        event->notifyUser = notifyUser;
+        event->recommendRescan = recommendRescan;
+    }
+
+    pthread_mutex_unlock(&wallet->eventLock);
+    if (! event && wallet->txDeleted) wallet->txDeleted(wallet->callbackInfo, txHash, notifyUser, recommendRescan);
+}
+
+// calls txBatchUpdated or txUpdated with the applied updates, or records each tx's new block height and timestamp
+// for BRWalletEndBatch()
+static void _BRWalletNotifyTxUpdates(BRWallet *wallet, const BRTxUpdate updates[], size_t updateCount)
+{
+    BRTxEvent *event;
+    int batched;
+
+    pthread_mutex_lock(&wallet->eventLock);
+    batched = (wallet->batchDepth > 0);
+
+    for (size_t i = 0; batched && i < updateCount; i++) {
+        event = _BRWalletTxEvent(wallet, updates[i].txHash);
+        if (event->flags & (TX_EVENT_ADDED | TX_EVENT_DELETED)) continue; // txAdded already has the final state
+        event->flags |= TX_EVENT_UPDATED;
+        event->blockHeight = updates[i].blockHeight;
+        event->timestamp = updates[i].timestamp;
+    }
+
+    pthread_mutex_unlock(&wallet->eventLock);
+    if (! batched) _BRWalletCallTxUpdated(wallet, updates, updateCount);
+}
+
+inline static int _txUpdateCompare(const void *update, const void *otherUpdate)
+{
+    const BRTxUpdate *u1 = update, *u2 = otherUpdate;
+
+    if (u1->blockHeight != u2->blockHeight) return (u1->blockHeight < u2->blockHeight) ? -1 : 1;
+    if (u1->timestamp != u2->timestamp) return (u1->timestamp < u2->timestamp) ? -1 : 1;
+    return 0;
+}
+
+// starts coalescing callbacks, such as for the duration of a chain sync, batches may be nested
+void BRWalletBeginBatch(BRWallet *wallet)
+{
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->eventLock);
+    if (wallet->batchDepth++ == 0) wallet->batchBalance = BRWalletBalance(wallet);
+    pthread_mutex_unlock(&wallet->eventLock);
+}
+
+// ends a batch started with BRWalletBeginBatch(), and when the outermost batch ends, makes the callbacks still due
+// each tx is reported at most once, with one balanceChanged for the final balance if it differs from when the batch
+// began, then txDeleted, txAdded, and txBatchUpdated or txUpdated with the final block height and timestamp of each
+// tx, in block order
+void BRWalletEndBatch(BRWallet *wallet)
+{
+    BRTxEvent *events = NULL;
+    BRTxUpdate *updates;
+    size_t i, count = 0, updateCount = 0;
+    uint64_t balance = 0, batchBalance = 0;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->eventLock);
+    assert(wallet->batchDepth > 0);
+
+    if (wallet->batchDepth > 0 && --wallet->batchDepth == 0) {
+        count = chunk_array_count(wallet->txEvents);
+        events = malloc((count + 1)*sizeof(*events));
+        assert(events != NULL);
+        for (i = 0; i < count; i++) events[i] = chunk_array_item(wallet->txEvents, i);
+        BRSetClear(wallet->txEventSet);
+        chunk_array_clear(wallet->txEvents);
+        balance = BRWalletBalance(wallet);
+        batchBalance = wallet->batchBalance;
+    }
+
+    pthread_mutex_unlock(&wallet->eventLock);
+    if (! events) return;
+    updates = malloc((count + 1)*sizeof(*updates));
+    assert(updates != NULL);
+    if (balance != batchBalance && wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, balance);
+
+    for (i = 0; i < count; i++) {
+        if (! (events[i].flags & TX_EVENT_DELETED) || ! wallet->txDeleted) continue;
+        wallet->txDeleted(wallet->callbackInfo, events[i].txHash, events[i].notifyUser, events[i].recommendRescan);
+    }
+
+    for (i = 0; i < count; i++) {
+        if ((events[i].flags & TX_EVENT_ADDED) && wallet->txAdded) wallet->txAdded(wallet->callbackInfo, events[i].tx);
+        if (! (events[i].flags & TX_EVENT_UPDATED)) continue;
+        updates[updateCount++] = (BRTxUpdate) { events[i].txHash, events[i].blockHeight, events[i].timestamp };
+    }
+
+    qsort(updates, updateCount, sizeof(*updates), _txUpdateCompare);
+    _BRWalletCallTxUpdated(wallet, updates, updateCount);
+    free(updates);
+    free(events);
+}
+
 // wallets are composed of chains of addresses
 // each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
 // this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
@@ -311,71 +1339,87 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
 // returns the number addresses written to addrs
 size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, int internal)
 {
-    BRAddress *addrChain;
-    size_t i, j = 0, count, startCount;
+    BRChainAddress **addrChain;
+    size_t i, j = 0, k, n, count, startCount;
     uint32_t chain = (internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN;
+    int rewind = 0;
 
     assert(wallet != NULL);
     assert(gapLimit > 0);
-    pthread_mutex_lock(&wallet->lock);
-    addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
-    i = count = startCount = array_count(addrChain);
-    
-    // keep only the trailing contiguous block of addresses with no transactions
-    while (i > 0 && ! BRSetContains(wallet->usedAddrs, &addrChain[i - 1])) i--;
+    _BRWalletReadLock(wallet);
+
+    for (int isWriter = 0;; isWriter = 1) {
+        addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
+        count = startCount = chunk_array_count(addrChain);
+        i = wallet->chainUsed[chain]; // keep only the trailing contiguous block of addresses with no transactions
+        if (isWriter || i + gapLimit <= count) break;
+
+        // new addresses are needed, so trade the read lock for the write lock and check again
+        pthread_rwlock_unlock(&wallet->lock);
+        _BRWalletWriteLock(wallet);
+    }
     
     while (i + gapLimit > count) { // generate new addresses up to gapLimit
-        BRKey key;
-        BRAddress address = BR_ADDRESS_NONE;
-        uint8_t pubKey[BRBIP32PubKey(NULL, 0, wallet->masterPubKey, chain, count)];
-        size_t len = BRBIP32PubKey(pubKey, sizeof(pubKey), wallet->masterPubKey, chain, (uint32_t)count);
-        
-        if (! BRKeySetPubKey(&key, pubKey, len)) break;
-        if (! BRKeyAddress(&key, address.s, sizeof(address)) || BRAddressEq(&address, &BR_ADDRESS_NONE)) break;
-        array_add(addrChain, address);
-        count++;
-        if (BRSetContains(wallet->usedAddrs, &address)) i = count;
+        BRKey keys[64];
+
+        n = BRBIP32PubKeyList(keys, (i + gapLimit - count < 64) ? i + gapLimit - count : 64, wallet->masterPubKey,
+                              chain, (uint32_t)count);
+
+        for (k = 0; k < n; k++) {
+            BRAddress address = BR_ADDRESS_NONE;
+            BRChainAddress chainAddr = { "", chain, (uint32_t)count };
+
+            if (! BRKeyAddress(&keys[k], address.s, sizeof(address)) || BRAddressEq(&address, &BR_ADDRESS_NONE)) break;
+            if (strlen(address.s) >= sizeof(chainAddr.s)) break;
+            memcpy(chainAddr.s, address.s, sizeof(chainAddr.s));
+            chunk_array_add(addrChain, chainAddr);
+            count++;
+            if (BRSetContains(wallet->usedAddrs, &address)) i = wallet->chainUsed[chain] = count;
+        }
+
+        if (k == 0) break;
     }
 
     if (addrs && i + gapLimit <= count) {
         for (j = 0; j < gapLimit; j++) {
-            addrs[j] = addrChain[i + j];
+            addrs[j] = _chainAddress(&chunk_array_item(addrChain, i + j));
         }
     }
     
-    // was addrChain moved to a new memory location?
-    if (addrChain == (internal ? wallet->internalChain : wallet->externalChain)) {
-        for (i = startCount; i < count; i++) {
-            BRSetAdd(wallet->allAddrs, &addrChain[i]);
+    // chain items never move, so only the new addresses need to be added to allAddrs
+    for (k = startCount; k < count; k++) {
+        BRSetAdd(wallet->allAddrs, &chunk_array_item(addrChain, k));
+
+        // a tx already applied to the balance paid an address we only just generated, so its outputs weren't added to
+        // the utxo set and everything must be re-applied (rare, since tx are only added if they use a known address)
+        if (array_count(wallet->balanceHist) > 0 && BRSetContains(wallet->usedAddrs, &chunk_array_item(addrChain, k))) {
+            rewind = 1;
         }
     }
-    else {
-        if (internal) wallet->internalChain = addrChain;
-        if (! internal) wallet->externalChain = addrChain;
-        BRSetClear(wallet->allAddrs); // clear and rebuild allAddrs
 
-        for (i = array_count(wallet->internalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->internalChain[i - 1]);
-        }
-        
-        for (i = array_count(wallet->externalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->externalChain[i - 1]);
-        }
+    // the chunk table may have moved to a new memory location (only when called with the write lock)
+    if (count > startCount && internal) wallet->internalChain = addrChain;
+    if (count > startCount && ! internal) wallet->externalChain = addrChain;
+
+    if (rewind) { // once for all the new addresses, a large gap limit may generate thousands of them at a time
+        _BRWalletRewindBalance(wallet, 0);
+        _BRWalletUpdateBalance(wallet);
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return j;
 }
 
 // current wallet balance, not including transactions known to be invalid
+// balance and totals are read from a snapshot published after each update, so they never wait on wallet sync
 uint64_t BRWalletBalance(BRWallet *wallet)
 {
     uint64_t balance;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    balance = wallet->balance;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_mutex_lock(&wallet->snapshotLock);
+    balance = wallet->snapshot.balance;
+    pthread_mutex_unlock(&wallet->snapshotLock);
     return balance;
 }
 
@@ -383,14 +1427,14 @@ uint64_t BRWalletBalance(BRWallet *wallet)
 size_t BRWalletUTXOs(BRWallet *wallet, BRUTXO *utxos, size_t utxosCount)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     if (! utxos || array_count(wallet->utxos) < utxosCount) utxosCount = array_count(wallet->utxos);
 
     for (size_t i = 0; utxos && i < utxosCount; i++) {
         utxos[i] = wallet->utxos[i];
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return utxosCount;
 }
 
@@ -399,14 +1443,14 @@ size_t BRWalletUTXOs(BRWallet *wallet, BRUTXO *utxos, size_t utxosCount)
 size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], size_t txCount)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     if (! transactions || array_count(wallet->transactions) < txCount) txCount = array_count(wallet->transactions);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         transactions[i] = wallet->transactions[i];
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return txCount;
 }
 
@@ -415,31 +1459,82 @@ size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], siz
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
                                    uint32_t blockHeight)
 {
-    size_t total, n = 0;
+    size_t total, n;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     total = array_count(wallet->transactions);
-    while (n < total && wallet->transactions[(total - n) - 1]->blockHeight >= blockHeight) n++;
+    n = total - _txListLowerBound(wallet->transactions, total, blockHeight);
     if (! transactions || n < txCount) txCount = n;
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         transactions[i] = wallet->transactions[(total - n) + i];
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return txCount;
 }
 
+// writes up to txCount transactions following cursor in the wallet's history to the transactions array, oldest first,
+// or newest first if reverse is true, and only those to or from addr if it isn't NULL, and in the given directions
+// (TX_DIRECTION_SENT and/or TX_DIRECTION_RECEIVED, or 0 for both)
+// cursor is advanced to the last transaction written, use BR_TX_CURSOR_START for the first page
+// returns the number of transactions written, which is less than txCount once the end of the history is reached
+size_t BRWalletTxPage(BRWallet *wallet, BRTransaction *transactions[], size_t txCount, BRTxCursor *cursor,
+                      const char *addr, int directions, int reverse)
+{
+    BRTransaction **list, *tx;
+    const BRAddressTxs *entry;
+    size_t i, count, n = 0;
+
+    assert(wallet != NULL);
+    assert(transactions != NULL || txCount == 0);
+    assert(cursor != NULL);
+    directions &= TX_DIRECTION_SENT | TX_DIRECTION_RECEIVED;
+    if (directions == (TX_DIRECTION_SENT | TX_DIRECTION_RECEIVED)) directions = 0;
+    _BRWalletReadLock(wallet);
+
+    if (addr) { // address filtering takes precedence, directions are then checked for each tx in the address's list
+        entry = BRSetGet(wallet->addrTx, addr);
+        list = (entry) ? entry->txs : NULL;
+    }
+    else if (directions == TX_DIRECTION_SENT) list = wallet->sentTx, directions = 0;
+    else if (directions == TX_DIRECTION_RECEIVED) list = wallet->receivedTx, directions = 0;
+    else list = wallet->transactions;
+
+    count = (list) ? array_count(list) : 0;
+
+    if (UInt256IsZero(cursor->txHash)) i = (reverse) ? count : 0;
+    else {
+        i = _txListFind(list, count, BRSetGet(wallet->allTx, &cursor->txHash), cursor->blockHeight);
+
+        // if the cursor tx was removed or moved to another block, resume at the edge of the cursor's block, so later
+        // tx are repeated rather than skipped
+        if (i < count) i = (reverse) ? i : i + 1;
+        else if (! reverse) i = _txListLowerBound(list, count, cursor->blockHeight);
+        else if (cursor->blockHeight < UINT32_MAX) i = _txListLowerBound(list, count, cursor->blockHeight + 1);
+    }
+
+    while (n < txCount && ((reverse) ? i > 0 : i < count)) {
+        tx = (reverse) ? list[--i] : list[i++];
+        if (directions && (directions == TX_DIRECTION_SENT) != _BRWalletTxIsSent(wallet, tx)) continue;
+        transactions[n++] = tx;
+    }
+
+    if (n > 0) *cursor = (BRTxCursor) { transactions[n - 1]->txHash, transactions[n - 1]->blockHeight };
+    pthread_rwlock_unlock(&wallet->lock);
+    return n;
+}
+
 // total amount spent from the wallet (exluding change)
 uint64_t BRWalletTotalSent(BRWallet *wallet)
 {
     uint64_t totalSent;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    totalSent = wallet->totalSent;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_mutex_lock(&wallet->snapshotLock);
+    totalSent = wallet->snapshot.totalSent;
+    pthread_mutex_unlock(&wallet->snapshotLock);
     return totalSent;
 }
 
@@ -449,9 +1544,9 @@ uint64_t BRWalletTotalReceived(BRWallet *wallet)
     uint64_t totalReceived;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    totalReceived = wallet->totalReceived;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_mutex_lock(&wallet->snapshotLock);
+    totalReceived = wallet->snapshot.totalReceived;
+    pthread_mutex_unlock(&wallet->snapshotLock);
     return totalReceived;
 }
 
@@ -461,18 +1556,25 @@ uint64_t BRWalletFeePerKb(BRWallet *wallet)
     uint64_t feePerKb;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     feePerKb = wallet->feePerKb;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return feePerKb;
 }
 
 void BRWalletSetFeePerKb(BRWallet *wallet, uint64_t feePerKb)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletWriteLock(wallet);
     wallet->feePerKb = feePerKb;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
+}
+
+// number of unused addresses the wallet keeps at the end of the internal (change) or external (receive) chain
+uint32_t BRWalletGapLimit(BRWallet *wallet, int internal)
+{
+    assert(wallet != NULL);
+    return wallet->gapLimits[(internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN]; // immutable after new
 }
 
 // returns the first unused external address
@@ -491,22 +1593,22 @@ size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount)
     size_t i, internalCount = 0, externalCount = 0;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    internalCount = (! addrs || array_count(wallet->internalChain) < addrsCount) ?
-                    array_count(wallet->internalChain) : addrsCount;
+    _BRWalletReadLock(wallet);
+    internalCount = (! addrs || chunk_array_count(wallet->internalChain) < addrsCount) ?
+                    chunk_array_count(wallet->internalChain) : addrsCount;
 
     for (i = 0; addrs && i < internalCount; i++) {
-        addrs[i] = wallet->internalChain[i];
+        addrs[i] = _chainAddress(&chunk_array_item(wallet->internalChain, i));
     }
 
-    externalCount = (! addrs || array_count(wallet->externalChain) < addrsCount - internalCount) ?
-                    array_count(wallet->externalChain) : addrsCount - internalCount;
+    externalCount = (! addrs || chunk_array_count(wallet->externalChain) < addrsCount - internalCount) ?
+                    chunk_array_count(wallet->externalChain) : addrsCount - internalCount;
 
     for (i = 0; addrs && i < externalCount; i++) {
-        addrs[internalCount + i] = wallet->externalChain[i];
+        addrs[internalCount + i] = _chainAddress(&chunk_array_item(wallet->externalChain, i));
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return internalCount + externalCount;
 }
 
@@ -517,23 +1619,78 @@ int BRWalletContainsAddress(BRWallet *wallet, const char *addr)
 
     assert(wallet != NULL);
     assert(addr != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     if (addr) r = BRSetContains(wallet->allAddrs, addr);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return r;
 }
 
 // true if the address was previously used as an output in any wallet transaction
 int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr)
 {
-    int r = 0;
+    int r = 0;
+
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    _BRWalletReadLock(wallet);
+    if (addr) r = BRSetContains(wallet->usedAddrs, addr);
+    pthread_rwlock_unlock(&wallet->lock);
+    return r;
+}
+
+// writes the transactions with an input or output to the given wallet address to the transactions array, oldest first
+// returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletTxForAddress(BRWallet *wallet, const char *addr, BRTransaction *transactions[], size_t txCount)
+{
+    const BRAddressTxs *entry;
+    size_t count;
+
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    _BRWalletReadLock(wallet);
+    entry = (addr) ? BRSetGet(wallet->addrTx, addr) : NULL;
+    count = (entry) ? array_count(entry->txs) : 0;
+    if (! transactions || count < txCount) txCount = count;
+
+    for (size_t i = 0; transactions && i < txCount; i++) {
+        transactions[i] = entry->txs[i];
+    }
+
+    pthread_rwlock_unlock(&wallet->lock);
+    return txCount;
+}
+
+// writes the transactions with an input or output to any of the given wallet addresses to the transactions array,
+// grouped by address in the order given, oldest first within each address, and with each transaction written once
+// the cost is proportional to the number of matching transactions, not to the size of the wallet
+// returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletTxForAddrs(BRWallet *wallet, const BRAddress addrs[], size_t addrsCount,
+                          BRTransaction *transactions[], size_t txCount)
+{
+    const BRAddressTxs *entry;
+    BRSet *seen = NULL;
+    size_t n = 0;
 
     assert(wallet != NULL);
-    assert(addr != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    if (addr) r = BRSetContains(wallet->usedAddrs, addr);
-    pthread_mutex_unlock(&wallet->lock);
-    return r;
+    assert(addrs != NULL || addrsCount == 0);
+    _BRWalletReadLock(wallet);
+
+    for (size_t i = 0; addrs && i < addrsCount && (! transactions || n < txCount); i++) {
+        entry = BRSetGet(wallet->addrTx, &addrs[i]);
+        if (! entry) continue;
+        if (! seen) seen = BRSetNew(BRTransactionHash, BRTransactionEq, array_count(entry->txs)*2);
+
+        for (size_t j = 0; j < array_count(entry->txs) && (! transactions || n < txCount); j++) {
+            if (BRSetContains(seen, entry->txs[j])) continue; // tx also uses an earlier address
+            BRSetAdd(seen, entry->txs[j]);
+            if (transactions) transactions[n] = entry->txs[j];
+            n++;
+        }
+    }
+
+    pthread_rwlock_unlock(&wallet->lock);
+    if (seen) BRSetFree(seen);
+    return n;
 }
 
 // returns an unsigned transaction that sends the specified amount from the wallet to the given address
@@ -580,6 +1737,190 @@ BRTransaction *BRWalletCreateOpsTransaction(BRWallet *wallet,
     return BRWalletCreateTxForOutputs(wallet, outputs, 2);
 }
 
+#define BNB_MAX_TRIES 100000 // branch and bound search steps before falling back to largest-first selection
+
+inline static int _utxoValueCompare(const void *utxo, const void *otherUtxo)
+{
+    const BRUTXOValue *u1 = utxo, *u2 = otherUtxo;
+
+    if (u1->amount != u2->amount) return (u1->amount > u2->amount) ? -1 : 1; // largest first
+    return (u1->index < u2->index) ? -1 : (u1->index > u2->index);
+}
+
+// returns wallet->utxos ordered largest first, and sets count to the number of them, wallet->lock must be held
+// the order is cached until the utxo set changes, which only a writer can do, so it stays valid while the lock is held
+static const BRUTXOValue *_BRWalletUTXOOrder(BRWallet *wallet, size_t *count)
+{
+    BRTransaction *tx;
+
+    pthread_mutex_lock(&wallet->utxoOrderLock);
+
+    if (! wallet->utxoOrderValid) {
+        array_clear(wallet->utxoOrder);
+
+        for (size_t i = 0; i < array_count(wallet->utxos); i++) {
+            tx = BRSetGet(wallet->allTx, &wallet->utxos[i]);
+            if (! tx || wallet->utxos[i].n >= tx->outCount) continue;
+            array_add(wallet->utxoOrder, ((BRUTXOValue) { tx->outputs[wallet->utxos[i].n].amount, i }));
+        }
+
+        qsort(wallet->utxoOrder, array_count(wallet->utxoOrder), sizeof(*wallet->utxoOrder), _utxoValueCompare);
+        wallet->utxoOrderValid = 1;
+    }
+
+    pthread_mutex_unlock(&wallet->utxoOrderLock);
+    *count = array_count(wallet->utxoOrder);
+    return wallet->utxoOrder;
+}
+
+// a transaction planned by BRWalletCreatePayoutTxs()
+typedef struct {
+    size_t outStart, outEnd; // payouts it pays
+    size_t utxoStart, utxoEnd; // utxos it spends, as positions in the largest first selection order
+    size_t outSize; // total serialized size of the payouts
+    uint64_t amount, value; // total of the payouts, and of the utxos
+} BRPayoutPlan;
+
+inline static int _sizeCompare(const void *i, const void *j)
+{
+    return (*(const size_t *)i < *(const size_t *)j) ? -1 : (*(const size_t *)i > *(const size_t *)j);
+}
+
+// size of an unsigned tx with the given number of inputs and outputs, the same as BRTransactionSize() would return
+// outSize is the total serialized size of the outputs
+inline static size_t _txSize(size_t inCount, size_t outCount, size_t outSize)
+{
+    return 8 + BRVarIntSize(inCount) + BRVarIntSize(outCount) + inCount*TX_INPUT_SIZE + outSize;
+}
+
+// selects wallet->utxos to fund amount plus fee for a tx with the given outputs, not including change
+// writes the utxo indexes to selected in utxo order, and sets balance to their total and fee to the fee required
+// first tries a branch and bound search for a set of utxos that needs no change output, then falls back to adding
+// utxos largest first until there's enough for the fee with a change output
+// returns the number of utxos selected, or SIZE_MAX if the tx would be larger than TX_MAX_SIZE, in which case balance
+// and fee are for the utxos selected before reaching the limit
+static size_t _BRWalletSelectUTXOs(BRWallet *wallet, uint64_t amount, size_t outCount, size_t outSize,
+                                   uint64_t minAmount, size_t selected[], uint64_t *balance, uint64_t *fee)
+{
+    size_t i, n, count = 0, bestCount = 0, depth = 0, tries;
+    uint64_t inputFee = TX_INPUT_SIZE*wallet->feePerKb/1000, remaining = 0, value = 0, target, best = UINT64_MAX,
+             bestValue = 0;
+    const BRUTXOValue *utxos = _BRWalletUTXOOrder(wallet, &n);
+    uint8_t *included = calloc(n + 1, sizeof(*included));
+
+    assert(included != NULL);
+    // utxos worth less than the fee to spend them are left out of the search
+    for (i = 0; i < n && utxos[i].amount > inputFee; i++) remaining += utxos[i].amount;
+
+    // branch and bound search over utxos ordered largest first, for a total that covers amount and fee with no change
+    // output, and no more than minAmount left over (which would be too small for a change output anyway)
+    for (tries = 0; tries < BNB_MAX_TRIES; tries++) {
+        int backtrack = 0;
+
+        target = amount + _txFee(wallet->feePerKb, _txSize(count, outCount, outSize));
+
+        if (value + remaining < target || value > target + minAmount ||
+            _txSize(count, outCount, outSize) > TX_MAX_SIZE) backtrack = 1;
+        else if (value >= target) { // found a match, keep it if it has less left over than the best so far
+            if (value - target < best) {
+                best = value - target;
+                bestValue = value;
+                bestCount = 0;
+
+                for (i = 0; i < depth; i++) {
+                    if (included[i]) selected[bestCount++] = utxos[i].index;
+                }
+            }
+
+            if (best == 0) break;
+            backtrack = 1;
+        }
+        else if (depth >= n || utxos[depth].amount <= inputFee) backtrack = 1;
+
+        if (backtrack) { // undo the most recent inclusion and try excluding it instead
+            while (depth > 0 && ! included[depth - 1]) remaining += utxos[--depth].amount;
+            if (depth == 0) break;
+            included[depth - 1] = 0;
+            value -= utxos[depth - 1].amount;
+            count--;
+        }
+        else { // include the next utxo
+            remaining -= utxos[depth].amount;
+            included[depth++] = 1;
+            value += utxos[depth - 1].amount;
+            count++;
+        }
+    }
+
+    if (best != UINT64_MAX) { // changeless match
+        *balance = bestValue;
+        *fee = _txFee(wallet->feePerKb, _txSize(bestCount, outCount, outSize));
+        count = bestCount;
+    }
+    else { // largest first, leaving enough for a change output
+        *balance = *fee = 0;
+
+        for (count = 0; count < n; count++) {
+            if (_txSize(count + 1, outCount, outSize) + TX_OUTPUT_SIZE > TX_MAX_SIZE) {
+                count = SIZE_MAX;
+                break;
+            }
+
+            *balance += utxos[count].amount;
+            selected[count] = utxos[count].index;
+
+            // fee amount after adding a change output
+            *fee = _txFee(wallet->feePerKb, _txSize(count + 1, outCount, outSize) + TX_OUTPUT_SIZE);
+
+            // increase fee to round off remaining wallet balance to nearest 100 satoshi
+            if (wallet->balance > amount + *fee) *fee += (wallet->balance - (amount + *fee)) % 100;
+
+            if (*balance == amount + *fee || *balance >= amount + *fee + minAmount) {
+                count++;
+                break;
+            }
+        }
+    }
+
+    if (count != SIZE_MAX) qsort(selected, count, sizeof(*selected), _sizeCompare); // keep inputs in utxo order
+    free(included);
+    return count;
+}
+
+// fee and input count of the tx BRWalletCreateTxForOutputs() would build for a single output of the given amount and
+// script length, without building it, following the same selection, size limit and change output rules
+// returns the fee, or 0 if the wallet has insufficient funds, wallet->lock must be held
+static uint64_t _BRWalletQuoteTx(BRWallet *wallet, uint64_t amount, size_t scriptLen, size_t *inCount)
+{
+    uint64_t minAmount = _txMinOutputAmount(wallet->feePerKb), balance = 0, feeAmount = 0, fee = 0;
+    size_t count = SIZE_MAX, outSize = sizeof(uint64_t) + BRVarIntSize(scriptLen) + scriptLen,
+           *selected = calloc(array_count(wallet->utxos) + 1, sizeof(*selected));
+
+    assert(selected != NULL);
+
+    while (amount > 0) {
+        count = _BRWalletSelectUTXOs(wallet, amount, 1, outSize, minAmount, selected, &balance, &feeAmount);
+        if (count != SIZE_MAX) break;
+
+        // transaction size-in-bytes too large, check for sufficient total funds before quoting a smaller transaction
+        if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
+                                              2*TX_OUTPUT_SIZE)) break;
+
+        // reduce the output amount, or if it can't be reduced there are no outputs left
+        amount = (amount > amount + feeAmount + minAmount - balance) ? balance - feeAmount : 0;
+    }
+
+    if (count != SIZE_MAX && balance >= amount + feeAmount) {
+        // anything left over that's too small for a change output goes to the fee
+        fee = (balance - (amount + feeAmount) > minAmount) ? feeAmount : balance - amount;
+        if (inCount) *inCount = count;
+    }
+    else if (inCount) *inCount = 0;
+
+    free(selected);
+    return fee;
+}
+
 /// Description:
 /// returns an unsigned transaction that satisifes the given transaction outputs
 /// result must be freed by calling BRTransactionFree()
@@ -588,8 +1929,8 @@ BRTransaction *BRWalletCreateOpsTransaction(BRWallet *wallet,
 BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput outputs[], size_t outCount)
 {
     BRTransaction *tx, *transaction = BRTransactionNew();
-    uint64_t feeAmount, amount = 0, balance = 0, minAmount;
-    size_t i, j, cpfpSize = 0;
+    uint64_t feeAmount = 0, amount = 0, balance = 0, minAmount;
+    size_t i, j, count, outSize = 0, *selected;
     BRUTXO *o;
     BRAddress addr = BR_ADDRESS_NONE;
     
@@ -599,67 +1940,57 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
     for (i = 0; outputs && i < outCount; i++) {
         assert(outputs[i].script != NULL && outputs[i].scriptLen > 0);
         BRTransactionAddOutput(transaction, outputs[i].amount, outputs[i].script, outputs[i].scriptLen);
+        outSize += sizeof(uint64_t) + BRVarIntSize(outputs[i].scriptLen) + outputs[i].scriptLen;
         amount += outputs[i].amount;
     }
     
     minAmount = BRWalletMinOutputAmount(wallet);
-    pthread_mutex_lock(&wallet->lock);
-    feeAmount = _txFee(wallet->feePerKb, BRTransactionSize(transaction) + TX_OUTPUT_SIZE);
+    _BRWalletReadLock(wallet);
+    selected = calloc(array_count(wallet->utxos) + 1, sizeof(*selected));
+    assert(selected != NULL);
     
     // TODO: use up all UTXOs for all used addresses to avoid leaving funds in addresses whose public key is revealed
     // TODO: avoid combining addresses in a single transaction when possible to reduce information leakage
     // TODO: use up UTXOs received from any of the output scripts that this transaction sends funds to, to mitigate an
     //       attacker double spending and requesting a refund
-    for (i = 0; i < array_count(wallet->utxos); i++) {
-        o = &wallet->utxos[i];
-        tx = BRSetGet(wallet->allTx, o);
-        if (! tx || o->n >= tx->outCount) continue;
-        BRTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
-                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
-        
-        if (BRTransactionSize(transaction) + TX_OUTPUT_SIZE > TX_MAX_SIZE) { // transaction size-in-bytes too large
-            BRTransactionFree(transaction);
-            transaction = NULL;
-        
-            // check for sufficient total funds before building a smaller transaction
-            if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
-                                                  (outCount + 1)*TX_OUTPUT_SIZE + cpfpSize)) break;
-            pthread_mutex_unlock(&wallet->lock);
+    count = _BRWalletSelectUTXOs(wallet, amount, outCount, outSize, minAmount, selected, &balance, &feeAmount);
+
+    if (count == SIZE_MAX) { // transaction size-in-bytes too large
+        BRTransactionFree(transaction);
+        transaction = NULL;
+
+        // check for sufficient total funds before building a smaller transaction
+        if (wallet->balance >= amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
+                                               (outCount + 1)*TX_OUTPUT_SIZE)) {
+            pthread_rwlock_unlock(&wallet->lock);
 
             if (outputs[outCount - 1].amount > amount + feeAmount + minAmount - balance) {
                 BRTxOutput newOutputs[outCount];
-                
+
                 for (j = 0; j < outCount; j++) {
                     newOutputs[j] = outputs[j];
                 }
-                
+
                 newOutputs[outCount - 1].amount -= amount + feeAmount - balance; // reduce last output amount
                 transaction = BRWalletCreateTxForOutputs(wallet, newOutputs, outCount);
             }
             else transaction = BRWalletCreateTxForOutputs(wallet, outputs, outCount - 1); // remove last output
 
-            balance = amount = feeAmount = 0;
-            pthread_mutex_lock(&wallet->lock);
-            break;
+            _BRWalletReadLock(wallet);
         }
-        
-        balance += tx->outputs[o->n].amount;
-        
-//        // size of unconfirmed, non-change inputs for child-pays-for-parent fee
-//        // don't include parent tx with more than 10 inputs or 10 outputs
-//        if (tx->blockHeight == TX_UNCONFIRMED && tx->inCount <= 10 && tx->outCount <= 10 &&
-//            ! _BRWalletTxIsSend(wallet, tx)) cpfpSize += BRTransactionSize(tx);
 
-        // fee amount after adding a change output
-        feeAmount = _txFee(wallet->feePerKb, BRTransactionSize(transaction) + TX_OUTPUT_SIZE + cpfpSize);
+        balance = amount = feeAmount = 0;
+    }
 
-        // increase fee to round off remaining wallet balance to nearest 100 satoshi
-        if (wallet->balance > amount + feeAmount) feeAmount += (wallet->balance - (amount + feeAmount)) % 100;
-        
-        if (balance == amount + feeAmount || balance >= amount + feeAmount + minAmount) break;
+    for (i = 0; transaction && count != SIZE_MAX && i < count; i++) {
+        o = &wallet->utxos[selected[i]];
+        tx = BRSetGet(wallet->allTx, o);
+        BRTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
+                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
     }
-    
-    pthread_mutex_unlock(&wallet->lock);
+
+    free(selected);
+    pthread_rwlock_unlock(&wallet->lock);
     
     if (transaction && (outCount < 1 || balance < amount + feeAmount)) { // no outputs/insufficient funds
         BRTransactionFree(transaction);
@@ -677,31 +2008,144 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
     return transaction;
 }
 
+// returns unsigned transactions that pay each of the given outputs once, in order, packed into as few transactions as
+// keeps each under TX_MAX_SIZE, with utxos selected for all of them in one pass rather than once per transaction
+// transactions must have room for outCount transactions, and fees (if not NULL) is set to each output's fee share
+// returns the number of transactions, or 0 if the wallet has insufficient funds to pay all of the outputs
+size_t BRWalletCreatePayoutTxs(BRWallet *wallet, const BRTxOutput outputs[], size_t outCount,
+                               BRTransaction *transactions[], uint64_t fees[])
+{
+    BRPayoutPlan *plans = calloc(outCount + 1, sizeof(*plans)), plan = { 0, 0, 0, 0, 0, 0, 0 };
+    const BRUTXOValue *utxos;
+    BRAddress *changeAddrs;
+    BRTransaction *tx;
+    BRUTXO *o;
+    uint64_t minAmount, inputFee, value, fee, paid;
+    size_t i = 0, j, k, n, txCount = 0, size, *selected;
+
+    assert(wallet != NULL);
+    assert(outputs != NULL || outCount == 0);
+    assert(transactions != NULL || outCount == 0);
+    assert(plans != NULL);
+    minAmount = BRWalletMinOutputAmount(wallet);
+    _BRWalletReadLock(wallet);
+    inputFee = TX_INPUT_SIZE*wallet->feePerKb/1000;
+    utxos = _BRWalletUTXOOrder(wallet, &n);
+    selected = calloc(array_count(wallet->utxos) + 1, sizeof(*selected));
+    assert(selected != NULL);
+
+    while (n > 0 && utxos[n - 1].amount <= inputFee) n--; // utxos worth less than the fee to spend them are left out
+
+    // each payout is added to the current tx, which takes the largest remaining utxos until it has enough for the
+    // payouts and the fee with a change output, and if that would take it over TX_MAX_SIZE, the tx is closed without
+    // the payout, which then starts the next tx
+    while (i < outCount) {
+        assert(outputs[i].script != NULL && outputs[i].scriptLen > 0);
+        size = sizeof(uint64_t) + BRVarIntSize(outputs[i].scriptLen) + outputs[i].scriptLen;
+        j = plan.utxoEnd;
+        value = plan.value;
+        fee = _txFee(wallet->feePerKb, _txSize(j - plan.utxoStart, i + 2 - plan.outStart,
+                                               plan.outSize + size + TX_OUTPUT_SIZE));
+
+        while (value < plan.amount + outputs[i].amount + fee && j < n &&
+               _txSize(j + 1 - plan.utxoStart, i + 2 - plan.outStart, plan.outSize + size + TX_OUTPUT_SIZE) <=
+               TX_MAX_SIZE) {
+            value += utxos[j++].amount;
+            fee = _txFee(wallet->feePerKb, _txSize(j - plan.utxoStart, i + 2 - plan.outStart,
+                                                   plan.outSize + size + TX_OUTPUT_SIZE));
+        }
+
+        if (value < plan.amount + outputs[i].amount + fee ||
+            _txSize(j - plan.utxoStart, i + 2 - plan.outStart, plan.outSize + size + TX_OUTPUT_SIZE) > TX_MAX_SIZE) {
+            if (i == plan.outStart) break; // even a tx with only this payout can't be funded
+            plans[txCount++] = plan;
+            plan = (BRPayoutPlan) { i, i, plan.utxoEnd, plan.utxoEnd, 0, 0, 0 };
+            continue;
+        }
+
+        plan.outEnd = ++i;
+        plan.utxoEnd = j;
+        plan.outSize += size;
+        plan.amount += outputs[i - 1].amount;
+        plan.value = value;
+    }
+
+    if (i < outCount) txCount = 0; // insufficient funds
+    else if (plan.outEnd > plan.outStart) plans[txCount++] = plan;
+
+    for (k = 0; k < txCount; k++) {
+        transactions[k] = BRTransactionNew();
+
+        for (j = plans[k].outStart; j < plans[k].outEnd; j++) {
+            BRTransactionAddOutput(transactions[k], outputs[j].amount, outputs[j].script, outputs[j].scriptLen);
+        }
+
+        for (j = plans[k].utxoStart; j < plans[k].utxoEnd; j++) selected[j - plans[k].utxoStart] = utxos[j].index;
+        qsort(selected, plans[k].utxoEnd - plans[k].utxoStart, sizeof(*selected), _sizeCompare); // utxo order
+
+        for (j = 0; j < plans[k].utxoEnd - plans[k].utxoStart; j++) {
+            o = &wallet->utxos[selected[j]];
+            tx = BRSetGet(wallet->allTx, o);
+            BRTransactionAddInput(transactions[k], tx->txHash, o->n, tx->outputs[o->n].amount,
+                                  tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
+        }
+    }
+
+    free(selected);
+    pthread_rwlock_unlock(&wallet->lock);
+    changeAddrs = calloc(txCount + 1, sizeof(*changeAddrs));
+    assert(changeAddrs != NULL);
+    if (txCount > 0) BRWalletUnusedAddrs(wallet, changeAddrs, (uint32_t)txCount, 1); // a change address for each tx
+
+    for (k = 0; k < txCount; k++) {
+        fee = _txFee(wallet->feePerKb, _txSize(plans[k].utxoEnd - plans[k].utxoStart,
+                                               plans[k].outEnd - plans[k].outStart + 1,
+                                               plans[k].outSize + TX_OUTPUT_SIZE));
+
+        if (plans[k].value - (plans[k].amount + fee) > minAmount) { // add change output
+            uint8_t script[BRAddressScriptPubKey(NULL, 0, changeAddrs[k].s)];
+            size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), changeAddrs[k].s);
+
+            BRTransactionAddOutput(transactions[k], plans[k].value - (plans[k].amount + fee), script, scriptLen);
+            BRTransactionShuffleOutputs(transactions[k]);
+        }
+        else fee = plans[k].value - plans[k].amount; // anything left over that's too small for change goes to the fee
+
+        // each payout pays a share of the fee by its size, and the last one in the tx also pays any rounding remainder
+        for (j = plans[k].outStart, paid = 0; fees && j < plans[k].outEnd; j++) {
+            size = sizeof(uint64_t) + BRVarIntSize(outputs[j].scriptLen) + outputs[j].scriptLen;
+            fees[j] = (j + 1 < plans[k].outEnd) ? fee*size/plans[k].outSize : fee - paid;
+            paid += fees[j];
+        }
+    }
+
+    free(changeAddrs);
+    free(plans);
+    return txCount;
+}
+
 // signs any inputs in tx that can be signed using private keys from the wallet
 // forkId is 0 for bitcoin, 0x40 for b-cash
 // seed is the master private key (wallet seed) corresponding to the master public key given when the wallet was created
 // returns true if all inputs were signed, or false if there was an error or not all inputs were able to be signed
 int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, const void *seed, size_t seedLen)
 {
-    uint32_t j, internalIdx[tx->inCount], externalIdx[tx->inCount];
+    uint32_t internalIdx[tx->inCount + 1], externalIdx[tx->inCount + 1];
     size_t i, internalCount = 0, externalCount = 0;
+    const BRChainAddress *addr;
     int r = 0;
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     
     for (i = 0; tx && i < tx->inCount; i++) {
-        for (j = (uint32_t)array_count(wallet->internalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->internalChain[j - 1])) internalIdx[internalCount++] = j - 1;
-        }
-
-        for (j = (uint32_t)array_count(wallet->externalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->externalChain[j - 1])) externalIdx[externalCount++] = j - 1;
-        }
+        addr = BRSetGet(wallet->allAddrs, tx->inputs[i].address);
+        if (addr && addr->chain == SEQUENCE_INTERNAL_CHAIN) internalIdx[internalCount++] = addr->index;
+        if (addr && addr->chain == SEQUENCE_EXTERNAL_CHAIN) externalIdx[externalCount++] = addr->index;
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
 
     BRKey keys[internalCount + externalCount];
 
@@ -725,9 +2169,9 @@ int BRWalletContainsTransaction(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     if (tx) r = _BRWalletContainsTx(wallet, tx);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return r;
 }
 
@@ -740,7 +2184,7 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
     assert(tx != NULL && BRTransactionIsSigned(tx));
     
     if (tx && BRTransactionIsSigned(tx)) {
-        pthread_mutex_lock(&wallet->lock);
+        _BRWalletWriteLock(wallet);
 
         if (! BRSetContains(wallet->allTx, tx)) {
             if (_BRWalletContainsTx(wallet, tx)) {
@@ -749,32 +2193,82 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
                 //       (for now, replacements appear invalid until confirmation)
                 BRSetAdd(wallet->allTx, tx);
                 _BRWalletInsertTx(wallet, tx);
+                _BRWalletAddSpends(wallet, tx);
                 _BRWalletUpdateBalance(wallet);
                 wasAdded = 1;
             }
             else { // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
-                   // BUG: limit total non-wallet unconfirmed tx to avoid memory exhaustion attack
-                if (tx->blockHeight == TX_UNCONFIRMED) BRSetAdd(wallet->allTx, tx);
+                   // the pool is bounded, and evicts the least recently relayed tx to avoid memory exhaustion attacks
+                if (tx->blockHeight == TX_UNCONFIRMED) {
+                    size_t count = array_count(wallet->transactions), i, j = count;
+
+                    _BRWalletPoolAdd(wallet, tx);
+
+                    // re-apply any unconfirmed wallet tx that spend it, so their memoized status reflects the new input
+                    for (uint32_t n = 0; n < tx->outCount; n++) {
+                        const BRTxSpend *spend = BRSetGet(wallet->spends, &((BRUTXO) { tx->txHash, n }));
+
+                        for (; spend; spend = spend->next) {
+                            if (spend->tx->blockHeight != TX_UNCONFIRMED) continue;
+                            i = _txListFind(wallet->transactions, count, spend->tx, TX_UNCONFIRMED);
+                            if (i < j) j = i;
+                        }
+                    }
+
+                    if (j < count) {
+                        _BRWalletRewindBalance(wallet, j);
+                        _BRWalletUpdateBalance(wallet);
+                    }
+                }
+
+                // the pool owns and frees unconfirmed tx, a confirmed non-wallet tx is left to the caller
                 r = 0;
-                // BUG: XXX memory leak if tx is not added to wallet->allTx, and we can't just free it
             }
         }
+        else if (BRSetContains(wallet->poolTx, tx)) _BRWalletPoolAdd(wallet, tx); // relayed again, so keep it longer
     
-        pthread_mutex_unlock(&wallet->lock);
+        pthread_rwlock_unlock(&wallet->lock);
     }
     else r = 0;
 
     if (wasAdded) {
         // when a wallet address is used in a transaction, generate a new address to replace it
-        BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-        BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-        if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
-        if (wallet->txAdded) wallet->txAdded(wallet->callbackInfo, tx);
+        BRWalletUnusedAddrs(wallet, NULL, wallet->gapLimits[SEQUENCE_EXTERNAL_CHAIN], 0);
+        BRWalletUnusedAddrs(wallet, NULL, wallet->gapLimits[SEQUENCE_INTERNAL_CHAIN], 1);
+        _BRWalletBalanceChanged(wallet);
+        _BRWalletTxAdded(wallet, tx);
     }
 
     return r;
 }
 
+// limits the pool of unconfirmed non-wallet transactions to maxCount, and to those relayed in the last maxAge seconds
+// the least recently relayed transactions are evicted and freed first (defaults are TX_POOL_MAX_COUNT/TX_POOL_MAX_AGE)
+void BRWalletSetTxPoolLimits(BRWallet *wallet, size_t maxCount, uint32_t maxAge)
+{
+    assert(wallet != NULL);
+    assert(maxCount > 0);
+    _BRWalletWriteLock(wallet);
+    wallet->poolMaxCount = maxCount + 1; // evict down to maxCount, rather than making room for another tx
+    wallet->poolMaxAge = maxAge;
+    _BRWalletPoolEvict(wallet, time(NULL));
+    wallet->poolMaxCount = maxCount;
+    pthread_rwlock_unlock(&wallet->lock);
+}
+
+// counts of unconfirmed non-wallet transactions added to, kept in, and evicted from the wallet's pool
+BRTxPoolStats BRWalletTxPoolStats(BRWallet *wallet)
+{
+    BRTxPoolStats stats;
+
+    assert(wallet != NULL);
+    _BRWalletReadLock(wallet);
+    stats = wallet->poolStats;
+    stats.count = BRSetCount(wallet->poolTx);
+    pthread_rwlock_unlock(&wallet->lock);
+    return stats;
+}
+
 // removes a tx from the wallet and calls BRTransactionFree() on it, along with any tx that depend on its outputs
 void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
 {
@@ -784,26 +2278,25 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
 
     assert(wallet != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletWriteLock(wallet);
     tx = BRSetGet(wallet->allTx, &txHash);
 
     if (tx) {
         array_new(hashes, 0);
 
-        for (size_t i = array_count(wallet->transactions); i > 0; i--) { // find depedent transactions
-            t = wallet->transactions[i - 1];
-            if (t->blockHeight < tx->blockHeight) break;
-            if (BRTransactionEq(tx, t)) continue;
-            
-            for (size_t j = 0; j < t->inCount; j++) {
-                if (! UInt256Eq(t->inputs[j].txHash, txHash)) continue;
-                array_add(hashes, t->txHash);
-                break;
+        for (uint32_t n = 0; n < tx->outCount; n++) { // find dependent transactions
+            const BRTxSpend *spend = BRSetGet(wallet->spends, &((BRUTXO) { txHash, n }));
+
+            for (; spend; spend = spend->next) {
+                size_t i = array_count(hashes);
+
+                while (i > 0 && ! UInt256Eq(hashes[i - 1], spend->tx->txHash)) i--;
+                if (i == 0 && ! BRTransactionEq(tx, spend->tx)) array_add(hashes, spend->tx->txHash);
             }
         }
         
         if (array_count(hashes) > 0) {
-            pthread_mutex_unlock(&wallet->lock);
+            pthread_rwlock_unlock(&wallet->lock);
             
             for (size_t i = array_count(hashes); i > 0; i--) {
                 BRWalletRemoveTransaction(wallet, hashes[i - 1]);
@@ -812,16 +2305,38 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
             BRWalletRemoveTransaction(wallet, txHash);
         }
         else {
+            size_t i = _txListFind(wallet->transactions, array_count(wallet->transactions), tx, tx->blockHeight);
+
             BRSetRemove(wallet->allTx, tx);
-            
-            for (size_t i = array_count(wallet->transactions); i > 0; i--) {
-                if (! BRTransactionEq(wallet->transactions[i - 1], tx)) continue;
-                array_rm(wallet->transactions, i - 1);
-                break;
+            _BRWalletPoolForget(wallet, tx);
+
+            if (i < array_count(wallet->transactions)) {
+                size_t lo = _txListLowerBound(wallet->transactions, i, tx->blockHeight), hi = i;
+                int resort = 0;
+
+                _BRWalletRewindBalance(wallet, i);
+                _BRWalletRemoveSpends(wallet, tx);
+                _BRWalletUnindexTx(wallet, tx);
+                array_rm(wallet->transactions, i);
+
+                for (size_t j = 0; j < tx->inCount; j++) {
+                    t = BRSetGet(wallet->allTx, &tx->inputs[j].txHash);
+                    if (t && t->blockHeight == tx->blockHeight) resort = 1;
+                }
+
+                // a tx in the same block that tx depended on may have been placed early for it, so re-sort the block
+                if (resort) {
+                    BRSet *unindexed = BRSetNew(BRTransactionHash, BRTransactionEq, 1);
+
+                    while (hi < array_count(wallet->transactions) &&
+                           wallet->transactions[hi]->blockHeight == tx->blockHeight) hi++;
+                    _BRWalletSortRange(wallet, lo, hi - lo, unindexed);
+                    BRSetFree(unindexed);
+                }
             }
             
             _BRWalletUpdateBalance(wallet);
-            pthread_mutex_unlock(&wallet->lock);
+            pthread_rwlock_unlock(&wallet->lock);
             
             // if this is for a transaction we sent, and it wasn't already known to be invalid, notify user
             if (BRWalletAmountSentByTx(wallet, tx) > 0 && BRWalletTransactionIsValid(wallet, tx)) {
@@ -835,14 +2350,14 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
                 }
             }
 
-            if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
-            if (wallet->txDeleted) wallet->txDeleted(wallet->callbackInfo, txHash, notifyUser, recommendRescan);
+            _BRWalletBalanceChanged(wallet);
+            _BRWalletTxDeleted(wallet, txHash, notifyUser, recommendRescan);
             BRTransactionFree(tx);
         }
         
         array_free(hashes);
     }
-    else pthread_mutex_unlock(&wallet->lock);
+    else pthread_rwlock_unlock(&wallet->lock);
 }
 
 // returns the transaction with the given hash if it's been registered in the wallet
@@ -852,17 +2367,16 @@ BRTransaction *BRWalletTransactionForHash(BRWallet *wallet, UInt256 txHash)
     
     assert(wallet != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     tx = BRSetGet(wallet->allTx, &txHash);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return tx;
 }
 
 // true if no previous wallet transaction spends any of the given transaction's inputs, and no inputs are invalid
 int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
-    int r = 1;
+    uint32_t flags = 0;
 
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
@@ -870,157 +2384,211 @@ int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
     // TODO: XXX attempted double spends should cause conflicted tx to remain unverified until they're confirmed
     // TODO: XXX conflicted tx with the same wallet outputs should be presented as the same tx to the user
 
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be invalid
-        pthread_mutex_lock(&wallet->lock);
+    if (tx) {
+        _BRWalletReadLock(wallet);
+        flags = _BRWalletTxStatus(wallet, tx, time(NULL), 1);
+        pthread_rwlock_unlock(&wallet->lock);
+    }
+    
+    return ! (flags & TX_STATUS_INVALID);
+}
 
-        if (! BRSetContains(wallet->allTx, tx)) {
-            for (size_t i = 0; r && i < tx->inCount; i++) {
-                if (BRSetContains(wallet->spentOutputs, &tx->inputs[i])) r = 0;
-            }
-        }
-        else if (BRSetContains(wallet->invalidTx, tx)) r = 0;
+// writes to conflicts the wallet transactions, other than tx, that spend any of the same outputs as tx (double spends)
+// returns the number of transactions written, or the total number of conflicts if conflicts is NULL
+size_t BRWalletTransactionConflicts(BRWallet *wallet, const BRTransaction *tx, BRTransaction *conflicts[],
+                                    size_t conflictsCount)
+{
+    BRSet *found = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    const BRTxSpend *spend;
+    size_t count = 0;
 
-        pthread_mutex_unlock(&wallet->lock);
+    assert(wallet != NULL);
+    assert(tx != NULL);
+    _BRWalletReadLock(wallet);
 
-        for (size_t i = 0; r && i < tx->inCount; i++) {
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && ! BRWalletTransactionIsValid(wallet, t)) r = 0;
+    for (size_t i = 0; tx && i < tx->inCount; i++) {
+        for (spend = BRSetGet(wallet->spends, &tx->inputs[i]); spend; spend = spend->next) {
+            if (BRTransactionEq(spend->tx, tx) || BRSetContains(found, spend->tx)) continue;
+            BRSetAdd(found, spend->tx);
+            if (conflicts && count < conflictsCount) conflicts[count] = spend->tx;
+            count++;
         }
     }
-    
-    return r;
+
+    pthread_rwlock_unlock(&wallet->lock);
+    BRSetFree(found);
+    return (! conflicts || count < conflictsCount) ? count : conflictsCount;
 }
 
 // true if tx cannot be immediately spent (i.e. if it or an input tx can be replaced-by-fee)
 int BRWalletTransactionIsPending(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
-    time_t now = time(NULL);
-    uint32_t blockHeight;
-    int r = 0;
+    uint32_t flags = 0;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
-    pthread_mutex_lock(&wallet->lock);
-    blockHeight = wallet->blockHeight;
-    pthread_mutex_unlock(&wallet->lock);
 
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be postdated
-        if (BRTransactionSize(tx) > TX_MAX_SIZE) r = 1; // check transaction size is under TX_MAX_SIZE
-        
-        for (size_t i = 0; ! r && i < tx->inCount; i++) {
-            if (tx->inputs[i].sequence < UINT32_MAX - 1) r = 1; // check for replace-by-fee
-            if (tx->inputs[i].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                tx->lockTime > blockHeight + 1) r = 1; // future lockTime
-            if (tx->inputs[i].sequence < UINT32_MAX && tx->lockTime > now) r = 1; // future lockTime
-        }
-        
-        for (size_t i = 0; ! r && i < tx->outCount; i++) { // check that no outputs are dust
-            if (tx->outputs[i].amount < TX_MIN_OUTPUT_AMOUNT) r = 1;
-        }
-        
-        for (size_t i = 0; ! r && i < tx->inCount; i++) { // check if any inputs are known to be pending
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && BRWalletTransactionIsPending(wallet, t)) r = 1;
-        }
+    if (tx) {
+        _BRWalletReadLock(wallet);
+        flags = _BRWalletTxStatus(wallet, tx, time(NULL), 1);
+        pthread_rwlock_unlock(&wallet->lock);
     }
     
-    return r;
+    return (flags & TX_STATUS_PENDING) ? 1 : 0;
 }
 
 // true if tx is considered 0-conf safe (valid and not pending, timestamp is greater than 0, and no unverified inputs)
 int BRWalletTransactionIsVerified(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
-    int r = 1;
+    uint32_t flags = 0;
 
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
 
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be unverified
-        if (tx->timestamp == 0 || ! BRWalletTransactionIsValid(wallet, tx) ||
-            BRWalletTransactionIsPending(wallet, tx)) r = 0;
-            
-        for (size_t i = 0; r && i < tx->inCount; i++) { // check if any inputs are known to be unverified
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && ! BRWalletTransactionIsVerified(wallet, t)) r = 0;
-        }
+    if (tx) {
+        _BRWalletReadLock(wallet);
+        flags = _BRWalletTxStatus(wallet, tx, time(NULL), 1);
+        pthread_rwlock_unlock(&wallet->lock);
     }
     
-    return r;
+    return ! (flags & TX_STATUS_UNVERIFIED);
 }
 
-// set the block heights and timestamps for the given transactions
-// use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
-void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
-                                uint32_t timestamp)
+// applies block height and timestamp updates, then re-sorts from the first tx that moved and re-applies the balance
+// state once for the whole batch, instead of once per tx
+// writes the updates that changed a wallet tx to applied, which must have room for updateCount, and returns their count
+// wallet->lock must be held for writing
+static size_t _BRWalletUpdateTxs(BRWallet *wallet, const BRTxUpdate updates[], size_t updateCount,
+                                 BRTxUpdate applied[])
 {
+    BRSet *moved = BRSetNew(BRTransactionHash, BRTransactionEq, updateCount);
     BRTransaction *tx;
-    UInt256 hashes[txCount];
-    int needsUpdate = 0;
-    size_t i, j, k;
-    
-    assert(wallet != NULL);
-    assert(txHashes != NULL || txCount == 0);
-    pthread_mutex_lock(&wallet->lock);
-    if (blockHeight > wallet->blockHeight) wallet->blockHeight = blockHeight;
-    
-    for (i = 0, j = 0; txHashes && i < txCount; i++) {
-        tx = BRSetGet(wallet->allTx, &txHashes[i]);
-        if (! tx || (tx->blockHeight == blockHeight && tx->timestamp == timestamp)) continue;
-        tx->timestamp = timestamp;
-        tx->blockHeight = blockHeight;
-        
-        if (_BRWalletContainsTx(wallet, tx)) {
-            for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
-                if (! BRTransactionEq(wallet->transactions[k - 1], tx)) continue;
-                array_rm(wallet->transactions, k - 1);
-                _BRWalletInsertTx(wallet, tx);
-                break;
-            }
-            
-            hashes[j++] = txHashes[i];
-            if (BRSetContains(wallet->pendingTx, tx) || BRSetContains(wallet->invalidTx, tx)) needsUpdate = 1;
+    size_t i, j, k, count = array_count(wallet->transactions), first = count;
+
+    // find the earliest position any changed wallet tx is at or will move to, while wallet->transactions is sorted
+    for (i = 0; i < updateCount; i++) {
+        tx = BRSetGet(wallet->allTx, &updates[i].txHash);
+        if (! tx || (tx->blockHeight == updates[i].blockHeight && tx->timestamp == updates[i].timestamp)) continue;
+        k = _txListFind(wallet->transactions, count, tx, tx->blockHeight);
+        if (k == count) continue;
+        if (k < first) first = k;
+        k = _txListLowerBound(wallet->transactions, count, updates[i].blockHeight);
+        if (k < first) first = k;
+        if (BRSetContains(moved, tx)) continue;
+        BRSetAdd(moved, tx);
+        _BRWalletUnindexTx(wallet, tx); // before blockHeight changes
+    }
+
+    // start at a block boundary, so tx in the same block are all ordered together
+    if (first < count) first = _txListLowerBound(wallet->transactions, count, wallet->transactions[first]->blockHeight);
+    _BRWalletRewindBalance(wallet, first);
+
+    for (i = 0, j = 0; i < updateCount; i++) {
+        if (updates[i].blockHeight != TX_UNCONFIRMED && updates[i].blockHeight > wallet->blockHeight) {
+            wallet->blockHeight = updates[i].blockHeight;
         }
-        else if (blockHeight != TX_UNCONFIRMED) { // remove and free confirmed non-wallet tx
+
+        tx = BRSetGet(wallet->allTx, &updates[i].txHash);
+        if (! tx || (tx->blockHeight == updates[i].blockHeight && tx->timestamp == updates[i].timestamp)) continue;
+        tx->timestamp = updates[i].timestamp;
+        tx->blockHeight = updates[i].blockHeight;
+
+        if (BRSetContains(moved, tx) || _BRWalletContainsTx(wallet, tx)) applied[j++] = updates[i];
+        else if (tx->blockHeight != TX_UNCONFIRMED) { // remove and free confirmed non-wallet tx
             BRSetRemove(wallet->allTx, tx);
+            _BRWalletPoolForget(wallet, tx);
             BRTransactionFree(tx);
         }
     }
-    
-    if (needsUpdate) _BRWalletUpdateBalance(wallet);
-    pthread_mutex_unlock(&wallet->lock);
-    if (needsUpdate && wallet->balanceChanged) {
-        wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
+
+    // every block from first onward is re-sorted the same way however many tx moved, re-indexing the ones that did, and
+    // any others in a block whose order changed
+    if (first < count) _BRWalletSortRange(wallet, first, count - first, moved);
+    _BRWalletUpdateBalance(wallet); // re-applies only the tx from the earliest one that moved
+    BRSetFree(moved);
+    return j;
+}
+
+// set the block heights and timestamps for the given transactions
+// use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
+void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
+                                uint32_t timestamp)
+{
+    BRTxUpdate *updates = malloc((txCount + 1)*sizeof(*updates)), *applied = malloc((txCount + 1)*sizeof(*applied));
+    uint64_t balance;
+    size_t count;
+    int changed;
+
+    assert(wallet != NULL);
+    assert(txHashes != NULL || txCount == 0);
+    assert(updates != NULL && applied != NULL);
+
+    for (size_t i = 0; txHashes && i < txCount; i++) {
+        updates[i] = (BRTxUpdate) { txHashes[i], blockHeight, timestamp };
     }
-    if (j > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, j, blockHeight, timestamp);
+
+    _BRWalletWriteLock(wallet);
+    balance = wallet->balance;
+    count = _BRWalletUpdateTxs(wallet, updates, (txHashes) ? txCount : 0, applied);
+    changed = (wallet->balance != balance);
+    pthread_rwlock_unlock(&wallet->lock);
+    if (changed) _BRWalletBalanceChanged(wallet);
+    _BRWalletNotifyTxUpdates(wallet, applied, count);
+    free(applied);
+    free(updates);
+}
+
+// set the block heights and timestamps for transactions from any number of blocks, such as a run of merkleblocks
+// the wallet is re-sorted and its balance updated once for the whole batch, with one txBatchUpdated callback, or one
+// txUpdated callback for each run of updates with the same block height and timestamp if txBatchUpdated isn't set
+void BRWalletUpdateTxBatch(BRWallet *wallet, const BRTxUpdate updates[], size_t updateCount)
+{
+    BRTxUpdate *applied = malloc((updateCount + 1)*sizeof(*applied));
+    uint64_t balance;
+    size_t count;
+    int changed;
+
+    assert(wallet != NULL);
+    assert(updates != NULL || updateCount == 0);
+    assert(applied != NULL);
+    _BRWalletWriteLock(wallet);
+    balance = wallet->balance;
+    count = _BRWalletUpdateTxs(wallet, updates, (updates) ? updateCount : 0, applied);
+    changed = (wallet->balance != balance);
+    pthread_rwlock_unlock(&wallet->lock);
+    if (changed) _BRWalletBalanceChanged(wallet);
+    _BRWalletNotifyTxUpdates(wallet, applied, count);
+    free(applied);
 }
 
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight)
 {
+    BRTxUpdate *updates;
     size_t i, j, count;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletWriteLock(wallet);
     wallet->blockHeight = blockHeight;
     count = i = array_count(wallet->transactions);
     while (i > 0 && wallet->transactions[i - 1]->blockHeight > blockHeight) i--;
     count -= i;
-
-    UInt256 hashes[count];
+    _BRWalletRewindBalance(wallet, i);
+    updates = malloc((count + 1)*sizeof(*updates));
+    assert(updates != NULL);
 
     for (j = 0; j < count; j++) {
+        _BRWalletUnindexTx(wallet, wallet->transactions[i + j]); // before blockHeight changes
         wallet->transactions[i + j]->blockHeight = TX_UNCONFIRMED;
-        hashes[j] = wallet->transactions[i + j]->txHash;
-    }
-    
-    if (count > 0) _BRWalletUpdateBalance(wallet);
-    pthread_mutex_unlock(&wallet->lock);
-    if (count > 0 && wallet->balanceChanged) {
-        wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
+        updates[j] = (BRTxUpdate) { wallet->transactions[i + j]->txHash, TX_UNCONFIRMED, 0 };
     }
-    if (count > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, count, TX_UNCONFIRMED, 0);
+
+    _BRWalletSortRange(wallet, i, count, NULL); // they all join the unconfirmed block, so re-sort and index them again
+    _BRWalletUpdateBalance(wallet);
+    pthread_rwlock_unlock(&wallet->lock);
+    if (count > 0) _BRWalletBalanceChanged(wallet);
+    _BRWalletNotifyTxUpdates(wallet, updates, count);
+    free(updates);
 }
 
 // returns the amount received by the wallet from the transaction (total outputs to change and/or receive addresses)
@@ -1030,14 +2598,14 @@ uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     
     // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
     for (size_t i = 0; tx && i < tx->outCount; i++) {
         if (BRSetContains(wallet->allAddrs, tx->outputs[i].address)) amount += tx->outputs[i].amount;
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return amount;
 }
 
@@ -1048,7 +2616,7 @@ uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     
     for (size_t i = 0; tx && i < tx->inCount; i++) {
         BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
@@ -1059,7 +2627,7 @@ uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx)
         }
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return amount;
 }
 
@@ -1070,7 +2638,7 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     
     for (size_t i = 0; tx && i < tx->inCount && amount != UINT64_MAX; i++) {
         BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
@@ -1082,7 +2650,7 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
         else amount = UINT64_MAX;
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     
     for (size_t i = 0; tx && i < tx->outCount && amount != UINT64_MAX; i++) {
         amount -= tx->outputs[i].amount;
@@ -1094,20 +2662,21 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
 // historical wallet balance after the given transaction, or current balance if transaction is not registered in wallet
 uint64_t BRWalletBalanceAfterTx(BRWallet *wallet, const BRTransaction *tx)
 {
+    const BRTransaction *t;
     uint64_t balance;
+    size_t i;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     balance = wallet->balance;
-    
-    for (size_t i = array_count(wallet->transactions); tx && i > 0; i--) {
-        if (! BRTransactionEq(tx, wallet->transactions[i - 1])) continue;
-        balance = wallet->balanceHist[i - 1];
-        break;
-    }
+    t = (tx) ? BRSetGet(wallet->allTx, tx) : NULL; // tx may be a copy of the registered one
+    i = (t) ? _txListFind(wallet->transactions, array_count(wallet->transactions), t, t->blockHeight) : SIZE_MAX;
+
+    // balanceHist is kept up to date incrementally for rewinding, so it already has a balance for every tx
+    if (i < array_count(wallet->balanceHist)) balance = wallet->balanceHist[i];
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return balance;
 }
 
@@ -1117,33 +2686,40 @@ uint64_t BRWalletFeeForTxSize(BRWallet *wallet, size_t size)
     uint64_t fee;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletReadLock(wallet);
     fee = _txFee(wallet->feePerKb, size);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return fee;
 }
 
 // fee that will be added for a transaction of the given amount
 uint64_t BRWalletFeeForTxAmount(BRWallet *wallet, uint64_t amount)
 {
-    static const uint8_t dummyScript[] = { OP_DUP, OP_HASH160, 20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                           0, 0, 0, 0, 0, 0, 0, 0, 0, OP_EQUALVERIFY, OP_CHECKSIG };
-    BRTxOutput o = BR_TX_OUTPUT_NONE;
-    BRTransaction *tx;
-    uint64_t fee = 0, maxAmount = 0;
+    uint64_t fee, maxAmount = 0;
     
     assert(wallet != NULL);
     assert(amount > 0);
     maxAmount = BRWalletMaxOutputAmount(wallet);
-    o.amount = (amount < maxAmount) ? amount : maxAmount;
-    BRTxOutputSetScript(&o, dummyScript, sizeof(dummyScript)); // unspendable dummy scriptPubKey
-    tx = BRWalletCreateTxForOutputs(wallet, &o, 1);
+    _BRWalletReadLock(wallet);
+    // quote for a standard 25 byte pay-to-pubkey-hash output script
+    fee = _BRWalletQuoteTx(wallet, (amount < maxAmount) ? amount : maxAmount, 25, NULL);
+    pthread_rwlock_unlock(&wallet->lock);
+    return fee;
+}
 
-    if (tx) {
-        fee = BRWalletFeeForTx(wallet, tx);
-        BRTransactionFree(tx);
-    }
+// fee and number of inputs for a transaction sending amount to addr, computed from the wallet utxos without building a
+// transaction, the results are the same as for the transaction BRWalletCreateTransaction() would return
+// returns the fee, or 0 if the wallet has insufficient funds, in which case inCount is set to 0
+uint64_t BRWalletFeeQuote(BRWallet *wallet, uint64_t amount, const char *addr, size_t *inCount)
+{
+    uint64_t fee;
     
+    assert(wallet != NULL);
+    assert(amount > 0);
+    assert(addr != NULL && BRAddressIsValid(addr));
+    _BRWalletReadLock(wallet);
+    fee = _BRWalletQuoteTx(wallet, amount, BRAddressScriptPubKey(NULL, 0, addr), inCount);
+    pthread_rwlock_unlock(&wallet->lock);
     return fee;
 }
 
@@ -1153,39 +2729,26 @@ uint64_t BRWalletMinOutputAmount(BRWallet *wallet)
     uint64_t amount;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    amount = (TX_MIN_OUTPUT_AMOUNT*wallet->feePerKb + MIN_FEE_PER_KB - 1)/MIN_FEE_PER_KB;
-    pthread_mutex_unlock(&wallet->lock);
-    return (amount > TX_MIN_OUTPUT_AMOUNT) ? amount : TX_MIN_OUTPUT_AMOUNT;
+    _BRWalletReadLock(wallet);
+    amount = _txMinOutputAmount(wallet->feePerKb);
+    pthread_rwlock_unlock(&wallet->lock);
+    return amount;
 }
 
 // maximum amount that can be sent from the wallet to a single address after fees
 uint64_t BRWalletMaxOutputAmount(BRWallet *wallet)
 {
-    BRTransaction *tx;
-    BRUTXO *o;
-    uint64_t fee, amount = 0;
-    size_t i, txSize, cpfpSize = 0, inCount = 0;
+    uint64_t fee, amount;
+    size_t inCount;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-
-    for (i = array_count(wallet->utxos); i > 0; i--) {
-        o = &wallet->utxos[i - 1];
-        tx = BRSetGet(wallet->allTx, &o->hash);
-        if (! tx || o->n >= tx->outCount) continue;
-        inCount++;
-        amount += tx->outputs[o->n].amount;
-        
-//        // size of unconfirmed, non-change inputs for child-pays-for-parent fee
-//        // don't include parent tx with more than 10 inputs or 10 outputs
-//        if (tx->blockHeight == TX_UNCONFIRMED && tx->inCount <= 10 && tx->outCount <= 10 &&
-//            ! _BRWalletTxIsSend(wallet, tx)) cpfpSize += BRTransactionSize(tx);
-    }
-
-    txSize = 8 + BRVarIntSize(inCount) + TX_INPUT_SIZE*inCount + BRVarIntSize(2) + TX_OUTPUT_SIZE*2;
-    fee = _txFee(wallet->feePerKb, txSize + cpfpSize);
-    pthread_mutex_unlock(&wallet->lock);
+    _BRWalletReadLock(wallet);
+    // the balance is always the total of the utxo set, so there's no need to walk it
+    amount = wallet->balance;
+    inCount = array_count(wallet->utxos);
+    fee = _txFee(wallet->feePerKb, 8 + BRVarIntSize(inCount) + TX_INPUT_SIZE*inCount + BRVarIntSize(2) +
+                 TX_OUTPUT_SIZE*2);
+    pthread_rwlock_unlock(&wallet->lock);
     
     return (amount > fee) ? amount - fee : 0;
 }
@@ -1194,16 +2757,42 @@ uint64_t BRWalletMaxOutputAmount(BRWallet *wallet)
 void BRWalletFree(BRWallet *wallet)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _BRWalletWriteLock(wallet);
     BRSetFree(wallet->allAddrs);
     BRSetFree(wallet->usedAddrs);
     BRSetFree(wallet->allTx);
     BRSetFree(wallet->invalidTx);
     BRSetFree(wallet->pendingTx);
     BRSetFree(wallet->spentOutputs);
-    array_free(wallet->internalChain);
-    array_free(wallet->externalChain);
+    BRSetFree(wallet->txStatus);
+
+    for (size_t i = array_count(wallet->transactions); i > 0; i--) {
+        _BRWalletRemoveSpends(wallet, wallet->transactions[i - 1]);
+    }
+
+    BRSetFree(wallet->spends);
+    BRSetApply(wallet->addrTx, NULL, _BRAddressTxsFree);
+    BRSetFree(wallet->addrTx);
+    array_free(wallet->sentTx);
+    array_free(wallet->receivedTx);
+
+    for (size_t i = deque_count(wallet->poolOrder); i > 0; i--) {
+        BRPoolTx *entry = BRSetGet(wallet->poolTx, &deque_item(wallet->poolOrder, i - 1).txHash);
+
+        if (! entry) continue;
+        BRSetRemove(wallet->poolTx, entry);
+        BRTransactionFree(entry->tx);
+        free(entry);
+    }
+
+    BRSetFree(wallet->poolTx);
+    deque_free(wallet->poolOrder);
+    chunk_array_free(wallet->statusHist);
+    chunk_array_free(wallet->internalChain);
+    chunk_array_free(wallet->externalChain);
     array_free(wallet->balanceHist);
+    array_free(wallet->balanceUndo);
+    array_free(wallet->deferredSpent);
 
     for (size_t i = array_count(wallet->transactions); i > 0; i--) {
         BRTransactionFree(wallet->transactions[i - 1]);
@@ -1211,8 +2800,15 @@ void BRWalletFree(BRWallet *wallet)
 
     array_free(wallet->transactions);
     array_free(wallet->utxos);
-    pthread_mutex_unlock(&wallet->lock);
-    pthread_mutex_destroy(&wallet->lock);
+    array_free(wallet->utxoOrder);
+    pthread_rwlock_unlock(&wallet->lock);
+    pthread_rwlock_destroy(&wallet->lock);
+    pthread_mutex_destroy(&wallet->writerGate);
+    pthread_mutex_destroy(&wallet->snapshotLock);
+    pthread_mutex_destroy(&wallet->utxoOrderLock);
+    pthread_mutex_destroy(&wallet->eventLock);
+    BRSetFree(wallet->txEventSet); // callbacks still due from an unfinished batch are dropped
+    chunk_array_free(wallet->txEvents);
     free(wallet);
 }
 
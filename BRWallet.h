@@ -38,6 +38,11 @@ extern "C" {
 #define DEFAULT_FEE_PER_KB ((5000ULL*1000 + 99)/100) // bitcoind 0.11 min relay fee on 100bytes
 #define MIN_FEE_PER_KB     ((TX_FEE_PER_KB*1000 + 190)/191) // minimum relay fee on a 191byte tx
 #define MAX_FEE_PER_KB     ((1000100ULL*1000 + 190)/191) // slightly higher than a 10000bit fee on a 191byte tx
+#define TX_POOL_MAX_COUNT  10000 // default number of unconfirmed non-wallet tx kept for input validity checks
+#define TX_POOL_MAX_AGE    (24*60*60) // default seconds to keep an unconfirmed non-wallet tx after it was relayed
+
+#define TX_DIRECTION_SENT     0x01 // tx with an input signed by a wallet address
+#define TX_DIRECTION_RECEIVED 0x02 // tx with no inputs signed by a wallet address
 
 typedef struct {
     UInt256 hash;
@@ -56,11 +61,41 @@ inline static int BRUTXOEq(const void *utxo, const void *otherUtxo)
                                   ((const BRUTXO *)utxo)->n == ((const BRUTXO *)otherUtxo)->n));
 }
 
+// counts for the pool of unconfirmed non-wallet transactions kept by BRWalletRegisterTransaction()
+typedef struct {
+    size_t count; // transactions currently in the pool
+    size_t added; // total transactions added
+    size_t evictedCount; // evicted to stay within the pool's maxCount
+    size_t evictedAge; // evicted after maxAge seconds without being relayed again
+    size_t removed; // removed after being confirmed, or by BRWalletRemoveTransaction()
+} BRTxPoolStats;
+
+// position in the wallet's transaction history, see BRWalletTxPage()
+typedef struct {
+    UInt256 txHash; // last transaction written to the previous page
+    uint32_t blockHeight; // its block height at the time
+} BRTxCursor;
+
+#define BR_TX_CURSOR_START ((const BRTxCursor) { UINT256_ZERO, 0 })
+
+// new block height and timestamp for a transaction, see BRWalletUpdateTxBatch()
+typedef struct {
+    UInt256 txHash;
+    uint32_t blockHeight;
+    uint32_t timestamp;
+} BRTxUpdate;
+
 typedef struct BRWalletStruct BRWallet;
 
 // allocates and populates a BRWallet struct that must be freed by calling BRWalletFree()
 BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk);
 
+// allocates and populates a BRWallet struct like BRWalletNew(), but keeps at least externalGapLimit receive addresses
+// and internalGapLimit change addresses unused at the end of each chain, for watch-only wallets tracking many addresses
+// address storage is sized for the gap limits up front, and BRPeerManager loads that many addresses into its filter
+BRWallet *BRWalletNewWithGapLimits(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk,
+                                   uint32_t externalGapLimit, uint32_t internalGapLimit);
+
 // not thread-safe, set callbacks once after BRWalletNew(), before calling other BRWallet functions
 // info is a void pointer that will be passed along with each callback call
 // void balanceChanged(void *, uint64_t) - called when the wallet balance changes
@@ -75,6 +110,22 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
                                             uint32_t timestamp),
                           void (*txDeleted)(void *info, UInt256 txHash, int notifyUser, int recommendRescan));
 
+// not thread-safe, set once after BRWalletSetCallbacks(), before calling other BRWallet functions
+// void txBatchUpdated(void *, const BRTxUpdate[], size_t)
+//   - called instead of txUpdated with all the block height and timestamp changes made by a single wallet call
+void BRWalletSetTxBatchCallback(BRWallet *wallet,
+                                void (*txBatchUpdated)(void *info, const BRTxUpdate updates[], size_t updateCount));
+
+// starts coalescing callbacks, such as for the duration of a chain sync, batches may be nested
+// until the outermost batch ends, callbacks are recorded instead of made, so clients handle each change only once
+void BRWalletBeginBatch(BRWallet *wallet);
+
+// ends a batch started with BRWalletBeginBatch(), and when the outermost batch ends, makes the callbacks still due
+// each tx is reported at most once, with one balanceChanged for the final balance if it differs from when the batch
+// began, then txDeleted, txAdded, and txBatchUpdated or txUpdated with the final block height and timestamp of each
+// tx, in block order (a tx both added and deleted during the batch isn't reported)
+void BRWalletEndBatch(BRWallet *wallet);
+
 // wallets are composed of chains of addresses
 // each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
 // this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
@@ -83,6 +134,9 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
 // returns the number addresses written to addrs
 size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, int internal);
 
+// number of unused addresses the wallet keeps at the end of the internal (change) or external (receive) chain
+uint32_t BRWalletGapLimit(BRWallet *wallet, int internal);
+
 // returns the first unused external address
 BRAddress BRWalletReceiveAddress(BRWallet *wallet);
 
@@ -96,6 +150,17 @@ int BRWalletContainsAddress(BRWallet *wallet, const char *addr);
 // true if the address was previously used as an input or output in any wallet transaction
 int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr);
 
+// writes the transactions with an input or output to the given wallet address to the transactions array, oldest first
+// returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletTxForAddress(BRWallet *wallet, const char *addr, BRTransaction *transactions[], size_t txCount);
+
+// writes the transactions with an input or output to any of the given wallet addresses to the transactions array,
+// grouped by address in the order given, oldest first within each address, and with each transaction written once
+// the cost is proportional to the number of matching transactions, not to the size of the wallet
+// returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletTxForAddrs(BRWallet *wallet, const BRAddress addrs[], size_t addrsCount,
+                          BRTransaction *transactions[], size_t txCount);
+
 // writes transactions registered in the wallet, sorted by date, oldest first, to the given transactions array
 // returns the number of transactions written, or total number available if transactions is NULL
 size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], size_t txCount);
@@ -105,7 +170,16 @@ size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], siz
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
                                    uint32_t blockHeight);
 
+// writes up to txCount transactions following cursor in the wallet's history to the transactions array, oldest first,
+// or newest first if reverse is true, and only those to or from addr if it isn't NULL, and in the given directions
+// (TX_DIRECTION_SENT and/or TX_DIRECTION_RECEIVED, or 0 for both)
+// cursor is advanced to the last transaction written, use BR_TX_CURSOR_START for the first page
+// returns the number of transactions written, which is less than txCount once the end of the history is reached
+size_t BRWalletTxPage(BRWallet *wallet, BRTransaction *transactions[], size_t txCount, BRTxCursor *cursor,
+                      const char *addr, int directions, int reverse);
+
 // current wallet balance, not including transactions known to be invalid
+// balance and totals are read from a snapshot published after each update, so they never wait on wallet sync
 uint64_t BRWalletBalance(BRWallet *wallet);
 
 // total amount spent from the wallet (exluding change)
@@ -133,6 +207,14 @@ BRTransaction *BRWalletCreateOpsTransaction(BRWallet *wallet, uint64_t amount, c
 // result must be freed using BRTransactionFree()
 BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput outputs[], size_t outCount);
 
+// returns unsigned transactions that pay each of the given outputs once, in order, packed into as few transactions as
+// keeps each under TX_MAX_SIZE, with utxos selected for all of them in one pass rather than once per transaction
+// transactions must have room for outCount transactions, each of which must be freed using BRTransactionFree()
+// if fees is not NULL, fees[i] is set to the share of its transaction's fee paid by outputs[i], by serialized size
+// returns the number of transactions, or 0 if the wallet has insufficient funds to pay all of the outputs
+size_t BRWalletCreatePayoutTxs(BRWallet *wallet, const BRTxOutput outputs[], size_t outCount,
+                               BRTransaction *transactions[], uint64_t fees[]);
+
 // signs any inputs in tx that can be signed using private keys from the wallet
 // forkId is 0 for bitcoin, 0x40 for b-cash
 // seed is the master private key (wallet seed) corresponding to the master public key given when the wallet was created
@@ -143,17 +225,34 @@ int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, con
 int BRWalletContainsTransaction(BRWallet *wallet, const BRTransaction *tx);
 
 // adds a transaction to the wallet, or returns false if it isn't associated with the wallet
+// unconfirmed non-wallet transactions are kept in a bounded pool for input validity checks, and freed by the wallet
+// when they're evicted, which any later call that registers a non-wallet transaction or sets the pool limits can do,
+// so the caller mustn't keep using tx after registering one, a confirmed non-wallet transaction is left to the caller
 int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx);
 
+// limits the pool of unconfirmed non-wallet transactions to maxCount, and to those relayed in the last maxAge seconds
+// the least recently relayed transactions are evicted and freed first (defaults are TX_POOL_MAX_COUNT/TX_POOL_MAX_AGE)
+void BRWalletSetTxPoolLimits(BRWallet *wallet, size_t maxCount, uint32_t maxAge);
+
+// counts of unconfirmed non-wallet transactions added to, kept in, and evicted from the wallet's pool
+BRTxPoolStats BRWalletTxPoolStats(BRWallet *wallet);
+
 // removes a tx from the wallet and calls BRTransactionFree() on it, along with any tx that depend on its outputs
 void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash);
 
 // returns the transaction with the given hash if it's been registered in the wallet
+// a non-wallet transaction from the pool is only valid until the pool next evicts (see BRWalletRegisterTransaction()),
+// so use BRTransactionCopy() to keep one
 BRTransaction *BRWalletTransactionForHash(BRWallet *wallet, UInt256 txHash);
 
 // true if no previous wallet transaction spends any of the given transaction's inputs, and no inputs are invalid
 int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx);
 
+// writes to conflicts the wallet transactions, other than tx, that spend any of the same outputs as tx (double spends)
+// returns the number of transactions written, or the total number of conflicts if conflicts is NULL
+size_t BRWalletTransactionConflicts(BRWallet *wallet, const BRTransaction *tx, BRTransaction *conflicts[],
+                                    size_t conflictsCount);
+
 // true if transaction cannot be immediately spent (i.e. if it or an input tx can be replaced-by-fee)
 int BRWalletTransactionIsPending(BRWallet *wallet, const BRTransaction *tx);
 
@@ -164,6 +263,11 @@ int BRWalletTransactionIsVerified(BRWallet *wallet, const BRTransaction *tx);
 // use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
 void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
                                 uint32_t timestamp);
+
+// set the block heights and timestamps for transactions from any number of blocks, such as a run of merkleblocks
+// the wallet is re-sorted and its balance updated once for the whole batch, with one txBatchUpdated callback, or one
+// txUpdated callback for each run of updates with the same block height and timestamp if txBatchUpdated isn't set
+void BRWalletUpdateTxBatch(BRWallet *wallet, const BRTxUpdate updates[], size_t updateCount);
     
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight);
@@ -186,6 +290,11 @@ uint64_t BRWalletFeeForTxSize(BRWallet *wallet, size_t size);
 // fee that will be added for a transaction of the given amount
 uint64_t BRWalletFeeForTxAmount(BRWallet *wallet, uint64_t amount);
 
+// fee and number of inputs for a transaction sending amount to addr, computed from the wallet utxos without building a
+// transaction, the results are the same as for the transaction BRWalletCreateTransaction() would return
+// returns the fee, or 0 if the wallet has insufficient funds, in which case inCount is set to 0
+uint64_t BRWalletFeeQuote(BRWallet *wallet, uint64_t amount, const char *addr, size_t *inCount);
+
 // outputs below this amount are uneconomical due to fees (TX_MIN_OUTPUT_AMOUNT is the absolute minimum output amount)
 uint64_t BRWalletMinOutputAmount(BRWallet *wallet);
 
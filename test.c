@@ -45,9 +45,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <math.h>
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 
 #define SKIP_BIP38 1
@@ -161,7 +166,76 @@ int BRArrayTests()
     if (array_count(a) != 0) r = 0, fprintf(stderr, "***FAILED*** %s: array_clear() test\n", __func__);
 
     array_free(a);
-    
+
+    int **ca = NULL, *p;
+
+    chunk_array_new(ca, 3);
+    chunk_array_add(ca, 0);
+    p = &chunk_array_item(ca, 0);
+    for (int i = 1; i < 100; i++) chunk_array_add(ca, i); // [ 0, 1, 2, ... 99 ]
+    if (chunk_array_count(ca) != 100 || chunk_array_item(ca, 99) != 99)
+        r = 0, fprintf(stderr, "***FAILED*** %s: chunk_array_add() test\n", __func__);
+    if (p != &chunk_array_item(ca, 0)) r = 0, fprintf(stderr, "***FAILED*** %s: chunk_array_item() test\n", __func__);
+
+    for (int i = 0; i < 4; i++) chunk_array_rm_last(ca); // [ 0, 1, 2, ... 95 ], frees the last chunk
+    chunk_array_add(ca, 100);       // [ 0, 1, 2, ... 95, 100 ]
+    if (chunk_array_count(ca) != 97 || chunk_array_item(ca, 96) != 100 || chunk_array_item(ca, 95) != 95)
+        r = 0, fprintf(stderr, "***FAILED*** %s: chunk_array_rm_last() test\n", __func__);
+
+    chunk_array_clear(ca);          // [ ]
+    if (chunk_array_count(ca) != 0) r = 0, fprintf(stderr, "***FAILED*** %s: chunk_array_clear() test\n", __func__);
+
+    chunk_array_add(ca, 1);         // [ 1 ]
+    if (chunk_array_count(ca) != 1 || chunk_array_item(ca, 0) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: chunk_array_add() test 2\n", __func__);
+
+    chunk_array_free(ca);
+
+    int *d = NULL;
+
+    deque_new(d, 3);                // [ ]
+    if (deque_count(d) != 0 || deque_capacity(d) != 4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: deque_new() test\n", __func__);
+
+    deque_push_back(d, 2);          // [ 2 ]
+    deque_push_back(d, 3);          // [ 2, 3 ]
+    deque_push_front(d, 1);         // [ 1, 2, 3 ], wrapped around the end of the buffer
+    deque_push_front(d, 0);         // [ 0, 1, 2, 3 ]
+    if (deque_count(d) != 4 || deque_front(d) != 0 || deque_back(d) != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: deque_push_front() test\n", __func__);
+
+    deque_push_back(d, 4);          // [ 0, 1, 2, 3, 4 ], grows while wrapped
+    for (int i = 0; i < 5; i++) {
+        if (deque_item(d, i) != i) r = 0, fprintf(stderr, "***FAILED*** %s: deque_push_back() test\n", __func__);
+    }
+
+    deque_rm(d, 1);                 // [ 0, 2, 3, 4 ]
+    deque_rm(d, 2);                 // [ 0, 2, 4 ]
+    if (deque_count(d) != 3 || deque_item(d, 0) != 0 || deque_item(d, 1) != 2 || deque_item(d, 2) != 4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: deque_rm() test\n", __func__);
+
+    deque_pop_front(d);             // [ 2, 4 ]
+    deque_pop_back(d);              // [ 2 ]
+    if (deque_count(d) != 1 || deque_front(d) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: deque_pop_back() test\n", __func__);
+
+    for (int i = 0; i < 100; i++) { // walk head around the buffer
+        deque_push_back(d, i);
+        deque_pop_front(d);
+    }
+
+    for (int i = 0; i < 10; i++) deque_push_back(d, i); // [ 99, 0, 1, ... 9 ]
+    deque_rm_front(d, 1);           // [ 0, 1, ... 9 ]
+    deque_linearize(d);
+    for (int i = 0; i < 10; i++) {
+        if (d[i] != i) r = 0, fprintf(stderr, "***FAILED*** %s: deque_linearize() test\n", __func__);
+    }
+
+    deque_clear(d);                 // [ ]
+    if (deque_count(d) != 0) r = 0, fprintf(stderr, "***FAILED*** %s: deque_clear() test\n", __func__);
+
+    deque_free(d);
+
     printf("                                    ");
     return r;
 }
@@ -192,7 +266,15 @@ int BRSetTests()
     for (i = 999; i >= 0; i--) {
         if (*(int *)BRSetGet(s, &i) != i) r = 0, fprintf(stderr, "***FAILED*** %s: BRSetGet() test %d\n", __func__, i);
     }
-    
+
+    BRSetCursor cursor = BR_SET_CURSOR_START;
+    int *item, count = 0, sum = 0;
+
+    while ((item = BRSetCursorNext(s, &cursor)) != NULL) count++, sum += *item;
+    if (count != 1000 || sum != 999*1000/2) r = 0, fprintf(stderr, "***FAILED*** %s: BRSetCursorNext() test\n", __func__);
+    if (BRSetCursorNext(s, &cursor) != NULL)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRSetCursorNext() test 2\n", __func__);
+
     for (i = 0; i < 500; i++) {
         if (*(int *)BRSetRemove(s, &i) != i)
             r = 0, fprintf(stderr, "***FAILED*** %s: BRSetRemove() test %d\n", __func__, i);
@@ -206,7 +288,21 @@ int BRSetTests()
     }
 
     if (BRSetCount(s) != 0) r = 0, fprintf(stderr, "***FAILED*** %s: BRSetCount() test 2\n", __func__);
-    
+
+    void *items[1000];
+
+    for (i = 0; i < 1000; i++) items[i] = &x[i];
+    BRSetReserve(s, 2000);
+    BRSetAddBulk(s, items, 1000);
+    BRSetAddBulk(s, items, 500); // re-adding existing items replaces them
+    if (BRSetCount(s) != 1000) r = 0, fprintf(stderr, "***FAILED*** %s: BRSetAddBulk() test\n", __func__);
+
+    for (i = 999; i >= 0; i--) {
+        if (BRSetGet(s, &i) != &x[i]) r = 0, fprintf(stderr, "***FAILED*** %s: BRSetAddBulk() test %d\n", __func__, i);
+    }
+
+    BRSetFree(s);
+
     return r;
 }
 
@@ -426,6 +522,36 @@ int BRHashTests()
                     "\x14\x7c\x4e\x72\xb9\x80\x77\x85\xaf\xee\x48\xbb", *(UInt256 *)md))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256() test 6\n", __func__);
 
+    // test incremental sha256, in pieces that do and don't line up with 64 byte blocks
+    
+    s = "this is some text to test the sha256 implementation with more than 64bytes of data since it's internal "
+        "digest buffer is 64bytes in size";
+    
+    for (size_t i = 0; i <= strlen(s); i++) {
+        BRSHA256Context ctx, ctx2;
+        uint8_t md2[32];
+        
+        BRSHA256Init(&ctx);
+        BRSHA256Update(&ctx, s, i);
+        ctx2 = ctx;
+        BRSHA256Update(&ctx, s + i, strlen(s) - i);
+        BRSHA256Final(&ctx, md);
+        if (! UInt256Eq(*(UInt256 *)"\x40\xfd\x09\x33\xdf\x2e\x77\x47\xf1\x9f\x7d\x39\xcd\x30\xe1\xcb\x89\x81\x0a\x7e"
+                        "\x47\x06\x38\xa5\xf6\x23\x66\x9f\x3d\xe9\xed\xd4", *(UInt256 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256Update() test %zu\n", __func__, i + 1);
+        
+        BRSHA256Update(&ctx2, "a", 1); // a copy of ctx picks up where it was copied
+        BRSHA256Final(&ctx2, md);
+        
+        uint8_t msg[i + 1];
+        
+        memcpy(msg, s, i);
+        msg[i] = 'a';
+        BRSHA256(md2, msg, sizeof(msg));
+        if (! UInt256Eq(*(UInt256 *)md, *(UInt256 *)md2))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256Final() test %zu\n", __func__, i + 1);
+    }
+
     // test sha512
     
     s = "Free online SHA512 Calculator, type text here...";
@@ -1607,6 +1733,16 @@ int BRBIP32SequenceTests()
                     uint256("7b6a7dd645507d775215a9035be06700e1ed8c541da9351b4bd14bd50ab61428")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKey() test\n", __func__);
 
+    BRKey pubKeys[3];
+
+    if (BRBIP32PubKeyList(pubKeys, 3, mpk, SEQUENCE_EXTERNAL_CHAIN, 0) != 3 ||
+        memcmp(pubKeys[0].pubKey, pubKey, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKeyList() test 1\n", __func__);
+
+    BRBIP32PubKey(pubKey, sizeof(pubKey), mpk, SEQUENCE_EXTERNAL_CHAIN, 2);
+    if (memcmp(pubKeys[2].pubKey, pubKey, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKeyList() test 2\n", __func__);
+
     UInt512 dk;
     BRAddress addr;
 
@@ -1764,6 +1900,184 @@ int BRTransactionTests()
     
     if (len4 != len5 || memcmp(buf4, buf5, len4) != 0)
         r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionSerialize() test 2", __func__);
+    
+    BRTransactionView view;
+    BRTxInputView in;
+    BRTxOutputView out;
+    size_t off;
+    
+    if (! BRTransactionViewParse(&view, buf4, len4) || view.len != len4 || ! UInt256Eq(view.txHash, tx->txHash) ||
+        view.inCount != tx->inCount || view.outCount != tx->outCount || view.lockTime != tx->lockTime)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewParse() test 1", __func__);
+    
+    off = view.inOff;
+    
+    for (size_t i = 0; i < view.inCount; i++) {
+        off = BRTransactionViewInput(&view, off, &in);
+        
+        if (off == 0 || ! UInt256Eq(in.txHash, tx->inputs[i].txHash) || in.script ||
+            in.sigLen != tx->inputs[i].sigLen || memcmp(in.signature, tx->inputs[i].signature, in.sigLen) != 0 ||
+            in.signature < buf4 || in.signature + in.sigLen > buf4 + len4)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewInput() test 1", __func__);
+    }
+    
+    if (BRTransactionViewInput(&view, off, &in) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewInput() test 2", __func__);
+    off = view.outOff;
+    
+    for (size_t i = 0; i < view.outCount; i++) {
+        off = BRTransactionViewOutput(&view, off, &out);
+        
+        if (off == 0 || out.amount != tx->outputs[i].amount || out.scriptLen != tx->outputs[i].scriptLen ||
+            memcmp(out.script, tx->outputs[i].script, out.scriptLen) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewOutput() test 1", __func__);
+    }
+    
+    if (off != len4 - sizeof(uint32_t) || BRTransactionViewOutput(&view, off, &out) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewOutput() test 2", __func__);
+    if (BRTransactionViewSize(&view) != BRTransactionSize(tx))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewSize() test 1", __func__);
+    if (BRTransactionStandardFeeForSize(BRTransactionViewSize(&view)) != BRTransactionStandardFee(tx) ||
+        BRTransactionStandardFeeForSize(1000) != TX_FEE_PER_KB ||
+        BRTransactionStandardFeeForSize(1001) != TX_FEE_PER_KB*2)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionStandardFeeForSize() test", __func__);
+    BRTransactionFree(tx);
+    tx = BRTransactionViewMaterialize(&view);
+    len5 = BRTransactionSerialize(tx, buf5, sizeof(buf5));
+    
+    if (len5 != len4 || memcmp(buf4, buf5, len4) != 0 || ! UInt256Eq(view.txHash, tx->txHash))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewMaterialize() test 1", __func__);
+    BRTransactionFree(tx);
+    
+    if (! BRTransactionViewParse(&view, buf, len) || ! UInt256IsZero(view.txHash) ||
+        BRTransactionViewInput(&view, view.inOff, &in) == 0 || ! in.script || in.signature || in.amount != 1)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewParse() test 2", __func__);
+    
+    tx = BRTransactionParse(buf, len);
+    if (! tx || BRTransactionViewSize(&view) != BRTransactionSize(tx))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewSize() test 2", __func__);
+    if (tx) BRTransactionFree(tx);
+    
+    if (BRTransactionViewParse(&view, buf4, len4 - 1) || BRTransactionParse(buf4, len4 - 1))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewParse() test 3", __func__);
+    
+    memcpy(buf5, buf4, len4);
+    buf5[4 + 1 + 36] = 0xff; // first input signature length set to 0xffffffffffffffff
+    memset(&buf5[4 + 1 + 36 + 1], 0xff, sizeof(uint64_t));
+    if (BRTransactionViewParse(&view, buf5, len4))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewParse() test 4", __func__);
+    
+    uint8_t buf7[len4 + 2]; // outputs count rewritten as a non-canonical 3 byte varint
+    size_t outCount, outCountOff;
+    
+    BRTransactionViewParse(&view, buf4, len4);
+    outCount = view.outCount, outCountOff = view.inEnd;
+    memcpy(buf7, buf4, outCountOff);
+    buf7[outCountOff] = 0xfd;
+    UInt16SetLE(&buf7[outCountOff + 1], (uint16_t)outCount);
+    memcpy(&buf7[outCountOff + 3], &buf4[outCountOff + 1], len4 - (outCountOff + 1));
+    
+    if (! BRTransactionViewParse(&view, buf7, sizeof(buf7)) || view.inEnd != outCountOff ||
+        view.outOff != outCountOff + 3 || view.outCount != outCount)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewParse() test 5", __func__);
+    off = view.inOff;
+    for (size_t i = 0; off != 0 && i < view.inCount; i++) off = BRTransactionViewInput(&view, off, &in);
+    if (off != view.inEnd || BRTransactionViewInput(&view, off, &in) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewInput() test 3", __func__);
+    
+    tx = BRTransactionNew(); // BIP143 signatures, checked against digests computed here for each input
+    for (uint32_t i = 0; i < 3; i++) BRTransactionAddInput(tx, inHash, i, 1000 + i, script, scriptLen, NULL, 0, i);
+    BRTransactionAddOutput(tx, 1000000, script, scriptLen);
+    BRTransactionAddOutput(tx, 2000000, script, scriptLen);
+    
+    if (! BRTransactionSign(tx, 0x40, k, 2))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionSign() test 3", __func__);
+    
+    uint8_t prevouts[36*3], sequences[4*3], outputs[(8 + 1 + scriptLen)*2], pre[4 + 32*2 + 36 + 1 + scriptLen + 8 + 4 +
+            32 + 4 + 4];
+    const uint8_t *elems[2], *sigData;
+    size_t preLen, sigLen;
+    UInt256 md;
+    
+    for (size_t i = 0; i < 3; i++) {
+        UInt256Set(&prevouts[36*i], inHash);
+        UInt32SetLE(&prevouts[36*i + 32], (uint32_t)i);
+        UInt32SetLE(&sequences[4*i], (uint32_t)i);
+    }
+    
+    for (size_t i = 0; i < 2; i++) {
+        UInt64SetLE(&outputs[(8 + 1 + scriptLen)*i], tx->outputs[i].amount);
+        outputs[(8 + 1 + scriptLen)*i + 8] = (uint8_t)scriptLen;
+        memcpy(&outputs[(8 + 1 + scriptLen)*i + 9], script, scriptLen);
+    }
+    
+    for (size_t i = 0; i < 3; i++) {
+        preLen = 0;
+        UInt32SetLE(&pre[preLen], tx->version), preLen += 4;
+        BRSHA256_2(&pre[preLen], prevouts, sizeof(prevouts)), preLen += 32;
+        BRSHA256_2(&pre[preLen], sequences, sizeof(sequences)), preLen += 32;
+        memcpy(&pre[preLen], &prevouts[36*i], 36), preLen += 36;
+        pre[preLen++] = (uint8_t)scriptLen;
+        memcpy(&pre[preLen], script, scriptLen), preLen += scriptLen;
+        UInt64SetLE(&pre[preLen], 1000 + i), preLen += 8;
+        UInt32SetLE(&pre[preLen], (uint32_t)i), preLen += 4;
+        BRSHA256_2(&pre[preLen], outputs, sizeof(outputs)), preLen += 32;
+        UInt32SetLE(&pre[preLen], tx->lockTime), preLen += 4;
+        UInt32SetLE(&pre[preLen], 0x41), preLen += 4;
+        BRSHA256_2(&md, pre, preLen);
+        sigData = NULL;
+        
+        if (BRScriptElements(elems, 2, tx->inputs[i].signature, tx->inputs[i].sigLen) == 2) {
+            sigData = BRScriptData(elems[0], &sigLen);
+        }
+        
+        if (! sigData || sigLen < 2 || sigData[sigLen - 1] != 0x41 || ! BRKeyVerify(&k[1], md, sigData, sigLen - 1))
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionSign() test %zu", __func__, 4 + i);
+    }
+    
+    BRTransactionFree(tx);
+    tx = BRTransactionNew(); // legacy signatures, checked against digests of the tx serialized here for each input
+    for (uint32_t i = 0; i < 3; i++) BRTransactionAddInput(tx, inHash, i, 1000 + i, script, scriptLen, NULL, 0, i);
+    BRTransactionAddOutput(tx, 1000000, script, scriptLen);
+    BRTransactionAddOutput(tx, 2000000, script, scriptLen);
+    
+    if (! BRTransactionSign(tx, 0, k, 2))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionSign() test 7", __func__);
+    
+    uint8_t legacy[4 + 1 + 41*3 + scriptLen + 1 + sizeof(outputs) + 4 + 4];
+    
+    for (size_t i = 0; i < 3; i++) {
+        preLen = 0;
+        UInt32SetLE(&legacy[preLen], tx->version), preLen += 4;
+        legacy[preLen++] = 3;
+        
+        for (size_t j = 0; j < 3; j++) {
+            memcpy(&legacy[preLen], &prevouts[36*j], 36), preLen += 36;
+            legacy[preLen++] = (i == j) ? (uint8_t)scriptLen : 0;
+            if (i == j) memcpy(&legacy[preLen], script, scriptLen), preLen += scriptLen;
+            UInt32SetLE(&legacy[preLen], (uint32_t)j), preLen += 4;
+        }
+        
+        legacy[preLen++] = 2;
+        memcpy(&legacy[preLen], outputs, sizeof(outputs)), preLen += sizeof(outputs);
+        UInt32SetLE(&legacy[preLen], tx->lockTime), preLen += 4;
+        UInt32SetLE(&legacy[preLen], 0x01), preLen += 4;
+        BRSHA256_2(&md, legacy, preLen);
+        sigData = NULL;
+        
+        if (BRScriptElements(elems, 2, tx->inputs[i].signature, tx->inputs[i].sigLen) == 2) {
+            sigData = BRScriptData(elems[0], &sigLen);
+        }
+        
+        if (! sigData || sigLen < 2 || sigData[sigLen - 1] != 0x01 || ! BRKeyVerify(&k[1], md, sigData, sigLen - 1))
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionSign() test %zu", __func__, 8 + i);
+    }
+    
+    uint8_t buf6[BRTransactionSerialize(tx, NULL, 0)];
+    size_t len6 = BRTransactionSerialize(tx, buf6, sizeof(buf6));
+    
+    BRSHA256_2(&md, buf6, len6);
+    if (! UInt256Eq(md, tx->txHash)) r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionSign() test 11", __func__);
     BRTransactionFree(tx);
 
     BRTransaction *src = BRTransactionNew ();
@@ -1841,6 +2155,35 @@ static void walletTxDeleted(void *info, UInt256 txHash, int notifyUser, int reco
     printf("tx deleted: %s\n", u256hex(txHash));
 }
 
+static void walletTxBatchCount(void *info, const BRTxUpdate updates[], size_t updateCount)
+{
+    ((size_t *)info)[0]++;
+    ((size_t *)info)[1] += updateCount;
+}
+
+static void walletTxUpdatedCount(void *info, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
+                                 uint32_t timestamp)
+{
+    ((size_t *)info)[0]++;
+    ((size_t *)info)[1] += txCount;
+}
+
+static void walletBalanceCount(void *info, uint64_t balance)
+{
+    ((size_t *)info)[2]++;
+    ((size_t *)info)[3] = (size_t)balance;
+}
+
+static void walletTxAddedCount(void *info, BRTransaction *tx)
+{
+    ((size_t *)info)[4]++;
+}
+
+static void walletTxDeletedCount(void *info, UInt256 txHash, int notifyUser, int recommendRescan)
+{
+    ((size_t *)info)[5]++;
+}
+
 // TODO: test standard free transaction no change
 // TODO: test free transaction who's inputs are too new to hit min free priority
 // TODO: test transaction with change below min allowable output
@@ -1849,6 +2192,13 @@ static void walletTxDeleted(void *info, UInt256 txHash, int notifyUser, int reco
 // TODO: test tx ordering for multiple tx with same block height
 // TODO: port all applicable tests from bitcoinj and bitcoincore
 
+#define BENCH_SHAPE_RECEIVES 0 // every tx pays the wallet, and none are spent, so there's a utxo for each
+#define BENCH_SHAPE_CHAIN    1 // every tx spends the one before it, so the wallet has a long history and one utxo
+#define BENCH_SHAPE_SWEEPS   2 // every 10th tx spends the 9 before it, like a merchant sweeping its receive address
+#define BENCH_SHAPE_SPREAD   3 // like receives, but every 10 tx pay the next receive address, so addresses grow with tx
+
+static BRWallet *_BRWalletBenchNew(size_t txCount, int shape, BRMasterPubKey mpk, double *newMs);
+
 int BRWalletTests()
 {
     int r = 1;
@@ -1937,12 +2287,21 @@ int BRWalletTests()
     if (BRWalletFeeForTxAmount(w, SATOSHIS/2) < 1000)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeForTxAmount() test 1\n", __func__);
     
+    size_t inCount = SIZE_MAX;
+    
+    if (BRWalletFeeQuote(w, SATOSHIS*2, addr.s, &inCount) != 0 || inCount != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeQuote() test 1\n", __func__);
+
     tx = BRWalletCreateTransaction(w, SATOSHIS/2, addr.s);
     if (! tx) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreateTransaction() test 4\n", __func__);
 
+    if (tx && (BRWalletFeeQuote(w, SATOSHIS/2, addr.s, &inCount) != BRWalletFeeForTx(w, tx) ||
+               inCount != tx->inCount))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeQuote() test 2\n", __func__);
+
     if (tx) BRWalletSignTransaction(w, tx, 0, "", 1);
     if (tx && ! BRTransactionIsSigned(tx))
-        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSignTransaction() test\n", __func__);
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSignTransaction() test 1\n", __func__);
     
     if (tx) tx->timestamp = 1, BRWalletRegisterTransaction(w, tx);
     if (tx && BRWalletBalance(w) + BRWalletFeeForTx(w, tx) != SATOSHIS/2)
@@ -1950,6 +2309,15 @@ int BRWalletTests()
     
     if (BRWalletTransactions(w, NULL, 0) != 2)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactions() test 3\n", __func__);
+
+    // the quote must follow the utxo set as it changes, spending the first tx's output and adding the change
+    BRTransaction *tx2 = BRWalletCreateTransaction(w, SATOSHIS/4, addr.s);
+
+    if (! tx2 || BRWalletFeeQuote(w, SATOSHIS/4, addr.s, &inCount) != BRWalletFeeForTx(w, tx2) ||
+        inCount != tx2->inCount)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeQuote() test 3\n", __func__);
+
+    if (tx2) BRTransactionFree(tx2);
     
     if (tx && BRWalletTransactionForHash(w, tx->txHash) != tx)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionForHash() test\n", __func__);
@@ -1972,6 +2340,9 @@ int BRWalletTests()
     
     if (BRWalletFeeForTxAmount(w, SATOSHIS) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeForTxAmount() test 2\n", __func__);
+
+    if (BRWalletFeeQuote(w, SATOSHIS/4, addr.s, &inCount) != 0 || inCount != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeQuote() test 4\n", __func__);
     
     printf("                                    ");
     BRWalletFree(w);
@@ -1991,9 +2362,561 @@ int BRWalletTests()
     if (BRWalletAmountSentByTx(w, tx) - BRWalletFeeForTx(w, tx) != amt || BRWalletAmountReceivedFromTx(w, tx) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletMaxOutputAmount() test 1\n", __func__);
 
+    if (BRWalletFeeQuote(w, amt, addr.s, &inCount) != BRWalletFeeForTx(w, tx) || inCount != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeQuote() test 5\n", __func__);
+
     BRTransactionFree(tx);
     BRWalletFree(w);
-    
+
+    // registering, confirming and removing tx out of order must leave the same balance state as loading them at once
+    BRTransaction *txs[4], *copies[4];
+    BRUTXO utxos1[8], utxos2[8];
+    BRWallet *w2;
+    size_t n1, n2;
+
+    w = BRWalletNew(NULL, 0, mpk);
+
+    for (int i = 0; i < 3; i++) {
+        txs[i] = BRTransactionNew();
+        BRTransactionAddInput(txs[i], inHash, i, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(txs[i], SATOSHIS*(i + 1), outScript, outScriptLen);
+        BRTransactionSign(txs[i], 0, &k, 1);
+        txs[i]->blockHeight = 300 - i*100, txs[i]->timestamp = 1;
+        BRWalletRegisterTransaction(w, txs[i]); // each tx sorts before the ones already registered
+    }
+
+    if (BRWalletBalance(w) != SATOSHIS*6 || BRWalletTotalReceived(w) != SATOSHIS*6)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() test 6\n", __func__);
+
+    if (BRWalletBalanceAfterTx(w, txs[2]) != SATOSHIS*3 || BRWalletBalanceAfterTx(w, txs[1]) != SATOSHIS*5 ||
+        BRWalletBalanceAfterTx(w, txs[0]) != SATOSHIS*6)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletBalanceAfterTx() test\n", __func__);
+
+    // 192 bytes is the size of a tx with one input and one output, so this amount can be sent with no change
+    tx = BRWalletCreateTransaction(w, SATOSHIS*3 - BRWalletFeeForTxSize(w, 192), addr.s);
+    if (! tx || tx->inCount != 1 || tx->outCount != 1 || tx->inputs[0].amount != SATOSHIS*3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreateTransaction() test 5\n", __func__);
+    if (tx) BRTransactionFree(tx);
+
+    txs[3] = BRWalletCreateTransaction(w, SATOSHIS*4, addr.s);
+    if (txs[3]) BRWalletSignTransaction(w, txs[3], 0, "", 1);
+    if (txs[3]) txs[3]->timestamp = 1, BRWalletRegisterTransaction(w, txs[3]);
+    if (txs[3]) BRWalletUpdateTransactions(w, &txs[1]->txHash, 1, TX_UNCONFIRMED, 1); // move a spent tx to the end
+    if (! txs[3] || BRWalletBalance(w) + BRWalletFeeForTx(w, txs[3]) != SATOSHIS*2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTransactions() test 2\n", __func__);
+
+    for (int i = 0; txs[3] && i < 4; i++) copies[3 - i] = BRTransactionCopy(txs[i]); // spending tx first
+    w2 = (txs[3]) ? BRWalletNew(copies, 4, mpk) : NULL;
+    n1 = BRWalletUTXOs(w, utxos1, 8);
+    n2 = (w2) ? BRWalletUTXOs(w2, utxos2, 8) : 0;
+
+    if (! w2 || BRWalletBalance(w) != BRWalletBalance(w2) || BRWalletTotalSent(w) != BRWalletTotalSent(w2) ||
+        BRWalletTotalReceived(w) != BRWalletTotalReceived(w2) || n1 != n2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateBalance() test\n", __func__);
+
+    for (size_t i = 0; i < n1 && i < n2; i++) {
+        if (! BRUTXOEq(&utxos1[i], &utxos2[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUTXOs() test\n", __func__);
+    }
+
+    BRTransaction *order1[4], *order2[4];
+
+    // BRWalletNew() sorts in bulk, and must order tx the same way as registering them one at a time
+    if (w2 && (BRWalletTransactions(w, order1, 4) != 4 || BRWalletTransactions(w2, order2, 4) != 4))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() test 2\n", __func__);
+
+    for (size_t i = 0; w2 && i < 4; i++) {
+        if (! BRTransactionEq(order1[i], order2[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() test 3\n", __func__);
+    }
+
+    // paging through history must follow the same order as BRWalletTransactions(), with or without filters
+    BRTransaction *page[4];
+    BRTxCursor cursor = BR_TX_CURSOR_START;
+
+    for (size_t i = 0; i < 4; i++) {
+        if (BRWalletTxPage(w, page, 1, &cursor, NULL, 0, 1) != 1 || page[0] != order1[3 - i])
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPage() test 1\n", __func__);
+    }
+
+    if (BRWalletTxPage(w, page, 1, &cursor, NULL, 0, 1) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPage() test 2\n", __func__);
+
+    cursor = BR_TX_CURSOR_START;
+    if (! txs[3] || BRWalletTxPage(w, page, 4, &cursor, NULL, TX_DIRECTION_SENT, 0) != 1 || page[0] != txs[3])
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPage() test 3\n", __func__);
+
+    cursor = BR_TX_CURSOR_START;
+    if (BRWalletTxPage(w, page, 4, &cursor, NULL, TX_DIRECTION_RECEIVED, 0) != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPage() test 4\n", __func__);
+
+    cursor = BR_TX_CURSOR_START;
+    if (BRWalletTxPage(w, page, 4, &cursor, recvAddr.s, TX_DIRECTION_SENT, 0) != 1 ||
+        BRWalletTxPage(w, page, 4, &cursor, addr.s, 0, 0) != 0) // addr isn't a wallet address
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPage() test 5\n", __func__);
+
+    cursor = BR_TX_CURSOR_START;
+    if (w2 && (BRWalletTxPage(w2, page, 2, &cursor, recvAddr.s, 0, 0) != 2 || page[1] != order2[1]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPage() test 6\n", __func__);
+
+    // if the cursor tx moves to another block, the next page starts over from the cursor's block instead of skipping
+    if (w2) BRWalletUpdateTransactions(w2, &order2[1]->txHash, 1, order2[1]->blockHeight + 50, 1);
+    if (w2 && (BRWalletTxPage(w2, page, 4, &cursor, recvAddr.s, 0, 0) != 3 || page[0] != order2[1]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPage() test 7\n", __func__);
+
+    // tx are indexed by each wallet address they use, and looking up several addresses writes each tx once
+    BRAddress used[2] = { recvAddr, BR_ADDRESS_NONE };
+
+    for (size_t i = 0; txs[3] && i < txs[3]->outCount; i++) { // the change address
+        if (BRAddressEq(txs[3]->outputs[i].address, addr.s)) continue;
+        strncpy(used[1].s, txs[3]->outputs[i].address, sizeof(used[1].s) - 1);
+    }
+
+    if (BRWalletTxForAddress(w, recvAddr.s, page, 4) != 4 || page[3] != order1[3] ||
+        BRWalletTxForAddress(w, addr.s, NULL, 0) != 0) // addr isn't a wallet address
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxForAddress() test 1\n", __func__);
+
+    if (! txs[3] || BRWalletTxForAddress(w, used[1].s, page, 4) != 1 || page[0] != txs[3])
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxForAddress() test 2\n", __func__);
+
+    if (BRWalletTxForAddrs(w, used, 2, NULL, 0) != 4 || BRWalletTxForAddrs(w, used, 2, page, 2) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxForAddrs() test\n", __func__);
+
+    // removing the earliest tx also removes the tx spending it, and everything after it is re-applied
+    BRWalletRemoveTransaction(w, txs[2]->txHash);
+    if (BRWalletBalance(w) != SATOSHIS*3 || BRWalletTransactions(w, NULL, 0) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRemoveTransaction() test 2\n", __func__);
+
+    // memoized status must follow an unconfirmed non-wallet input tx that's registered after the tx spending it
+    BRTransaction *parent = BRTransactionNew(), *child = BRTransactionNew();
+
+    BRTransactionAddInput(parent, inHash, 9, 1, inScript, inScriptLen, NULL, 0, 0); // replace-by-fee sequence
+    BRTransactionAddOutput(parent, SATOSHIS, inScript, inScriptLen);
+    BRTransactionSign(parent, 0, &k, 1);
+    BRTransactionAddInput(child, parent->txHash, 0, SATOSHIS, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(child, SATOSHIS/2, outScript, outScriptLen);
+    BRTransactionSign(child, 0, &k, 1);
+    child->timestamp = 1;
+    BRWalletRegisterTransaction(w, child);
+    if (BRWalletTransactionIsPending(w, child) || ! BRWalletTransactionIsVerified(w, child))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsPending() test 3\n", __func__);
+
+    BRWalletRegisterTransaction(w, parent);
+    if (! BRWalletTransactionIsPending(w, child) || BRWalletTransactionIsVerified(w, child) ||
+        ! BRWalletTransactionIsValid(w, child))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsPending() test 4\n", __func__);
+
+    BRTransaction *conflict = BRTransactionNew(), *conflicts[2];
+
+    BRTransactionAddInput(conflict, parent->txHash, 0, SATOSHIS, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(conflict, SATOSHIS/3, outScript, outScriptLen);
+    BRTransactionSign(conflict, 0, &k, 1);
+    BRWalletRegisterTransaction(w, conflict);
+    if (BRWalletTransactionConflicts(w, child, conflicts, 2) != 1 || conflicts[0] != conflict ||
+        BRWalletTransactionConflicts(w, conflict, NULL, 0) != 1 || BRWalletTransactionIsValid(w, conflict))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionConflicts() test\n", __func__);
+
+    n1 = BRWalletTransactions(w, NULL, 0);
+    BRWalletRemoveTransaction(w, parent->txHash); // removes and frees both tx spending it, and parent itself
+    if (BRWalletTransactions(w, NULL, 0) != n1 - 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRemoveTransaction() test 3\n", __func__);
+
+    if (w2) BRWalletFree(w2);
+    BRWalletFree(w);
+
+    // confirming tx from many blocks in one batch must leave the same state as loading them at their final heights
+    BRTransaction *batchTx[6], *batchCopies[6], *batchOrder1[6], *batchOrder2[6];
+    BRTxUpdate updates[7];
+    size_t counts[2] = { 0, 0 };
+
+    w = BRWalletNew(NULL, 0, mpk);
+    BRWalletSetCallbacks(w, counts, NULL, NULL, walletTxUpdatedCount, NULL);
+
+    for (int i = 0; i < 6; i++) {
+        batchTx[i] = BRTransactionNew();
+        BRTransactionAddInput(batchTx[i], inHash, 20 + i, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(batchTx[i], SATOSHIS*(i + 1), outScript, outScriptLen);
+        BRTransactionSign(batchTx[i], 0, &k, 1);
+        batchTx[i]->timestamp = 1;
+        BRWalletRegisterTransaction(w, batchTx[i]);
+        updates[i] = (BRTxUpdate) { batchTx[i]->txHash, 500 - (i/2)*100, 2 }; // two tx per block, newest first
+    }
+
+    updates[6] = (BRTxUpdate) { inHash, 100, 2 }; // not in the wallet, so it's ignored
+    BRWalletUpdateTxBatch(w, updates, 7);
+    if (counts[0] != 3 || counts[1] != 6) // txUpdated is called once per block when txBatchUpdated isn't set
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTxBatch() test 1\n", __func__);
+
+    for (int i = 0; i < 6; i++) batchCopies[i] = BRTransactionCopy(batchTx[i]);
+    w2 = BRWalletNew(batchCopies, 6, mpk);
+    n1 = BRWalletUTXOs(w, utxos1, 8);
+    n2 = BRWalletUTXOs(w2, utxos2, 8);
+
+    if (BRWalletBalance(w) != SATOSHIS*21 || BRWalletBalance(w) != BRWalletBalance(w2) || n1 != n2 ||
+        BRWalletTransactions(w, batchOrder1, 6) != 6 || BRWalletTransactions(w2, batchOrder2, 6) != 6)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTxBatch() test 2\n", __func__);
+
+    for (size_t i = 0; i < n1 && i < n2; i++) {
+        if (! BRUTXOEq(&utxos1[i], &utxos2[i]) || ! BRTransactionEq(batchOrder1[i], batchOrder2[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTxBatch() test 3\n", __func__);
+    }
+
+    cursor = BR_TX_CURSOR_START;
+    if (BRWalletTxPage(w, page, 4, &cursor, recvAddr.s, 0, 1) != 4 || page[0] != batchOrder1[5])
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTxBatch() test 4\n", __func__);
+
+    counts[0] = counts[1] = 0;
+    BRWalletSetTxBatchCallback(w, walletTxBatchCount);
+    BRWalletSetTxUnconfirmedAfter(w, 350); // reorg, then the new chain confirms them all in one batch
+    BRWalletUpdateTxBatch(w, updates, 7);
+    if (counts[0] != 2 || counts[1] != 8 || BRWalletBalance(w) != SATOSHIS*21) // the tx at height 300 are unchanged
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTxBatch() test 5\n", __func__);
+
+    BRWalletFree(w2);
+    BRWalletFree(w);
+
+    // applying updates in one batch or one at a time must leave the same tx order and address pages
+    BRTransaction *splitTx[24], *splitCopies[24], *splitOrder1[24], *splitOrder2[24], *splitPage1[24], *splitPage2[24];
+    BRTxUpdate splitUpdates[24];
+
+    for (int i = 0; i < 24; i++) {
+        splitTx[i] = BRTransactionNew();
+        if (i % 4 != 3) BRTransactionAddInput(splitTx[i], inHash, 50 + i, 1, inScript, inScriptLen, NULL, 0,
+                                              TXIN_SEQUENCE);
+        else BRTransactionAddInput(splitTx[i], splitTx[i - 1]->txHash, 0, SATOSHIS, inScript, inScriptLen, NULL, 0,
+                                   TXIN_SEQUENCE); // spends the previous tx, which confirms in the same block
+        BRTransactionAddOutput(splitTx[i], SATOSHIS, outScript, outScriptLen);
+        BRTransactionSign(splitTx[i], 0, &k, 1);
+        splitTx[i]->timestamp = 1;
+        splitCopies[i] = BRTransactionCopy(splitTx[i]);
+        splitUpdates[23 - i] = (BRTxUpdate) { splitTx[i]->txHash, 100 + (i/4)*10, 2 }; // children before parents
+    }
+
+    w = BRWalletNew(splitTx, 24, mpk);
+    w2 = BRWalletNew(splitCopies, 24, mpk);
+    BRWalletUpdateTxBatch(w, splitUpdates, 24);
+    for (int i = 0; i < 24; i++) BRWalletUpdateTxBatch(w2, &splitUpdates[i], 1);
+
+    if (BRWalletTransactions(w, splitOrder1, 24) != 24 || BRWalletTransactions(w2, splitOrder2, 24) != 24 ||
+        BRWalletTxForAddress(w, recvAddr.s, splitPage1, 24) != 24 ||
+        BRWalletTxForAddress(w2, recvAddr.s, splitPage2, 24) != 24)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTxBatch() test 6\n", __func__);
+
+    for (size_t i = 0; i < 24; i++) {
+        if (! BRTransactionEq(splitOrder1[i], splitOrder2[i]) || ! BRTransactionEq(splitPage1[i], splitPage2[i]) ||
+            ! BRTransactionEq(splitOrder1[i], splitPage1[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTxBatch() test 7\n", __func__);
+    }
+
+    BRWalletFree(w2);
+    BRWalletFree(w);
+
+    // after a reorg and a removal, paging must follow the order of a wallet loaded with the remaining tx
+    BRTransaction *reorgTx[8], *reorgCopies[8], *reorgOrder1[8], *reorgOrder2[8];
+
+    w = BRWalletNew(NULL, 0, mpk);
+
+    for (int i = 0; i < 8; i++) {
+        reorgTx[i] = BRTransactionNew();
+        if (i % 3 != 2) BRTransactionAddInput(reorgTx[i], inHash, 80 + i, 1, inScript, inScriptLen, NULL, 0,
+                                              TXIN_SEQUENCE);
+        else BRTransactionAddInput(reorgTx[i], reorgTx[i - 1]->txHash, 0, SATOSHIS, inScript, inScriptLen, NULL, 0,
+                                   TXIN_SEQUENCE); // spends the previous tx in the same block
+        BRTransactionAddOutput(reorgTx[i], SATOSHIS, outScript, outScriptLen);
+        BRTransactionSign(reorgTx[i], 0, &k, 1);
+        reorgTx[i]->blockHeight = (i < 6) ? 100 + (i/3)*100 : TX_UNCONFIRMED, reorgTx[i]->timestamp = 1;
+        BRWalletRegisterTransaction(w, reorgTx[i]);
+    }
+
+    BRWalletSetTxUnconfirmedAfter(w, 150); // the tx at height 200 join the unconfirmed ones
+    BRWalletRemoveTransaction(w, reorgTx[4]->txHash); // also removes reorgTx[5], which spends it
+    n1 = BRWalletTransactions(w, reorgOrder1, 8);
+    for (size_t i = 0; i < n1; i++) reorgCopies[i] = BRTransactionCopy(reorgOrder1[i]);
+    w2 = BRWalletNew(reorgCopies, n1, mpk);
+
+    if (n1 != 6 || BRWalletTransactions(w2, reorgOrder2, 8) != n1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSetTxUnconfirmedAfter() test 1\n", __func__);
+
+    cursor = BR_TX_CURSOR_START;
+
+    for (size_t i = 0; i < n1; i++) {
+        if (BRWalletTxPage(w, page, 1, &cursor, recvAddr.s, TX_DIRECTION_RECEIVED, 1) != 1 ||
+            page[0] != reorgOrder1[n1 - 1 - i] || ! BRTransactionEq(reorgOrder1[i], reorgOrder2[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSetTxUnconfirmedAfter() test 2\n", __func__);
+    }
+
+    if (BRWalletTxPage(w, page, 1, &cursor, recvAddr.s, TX_DIRECTION_RECEIVED, 1) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSetTxUnconfirmedAfter() test 3\n", __func__);
+
+    BRWalletFree(w2);
+    BRWalletFree(w);
+
+    // tx in the same block that tie on chain index must have the same order however they were added
+    BRTransaction *tieTx[5], *tieCopies[5], *tieOrder1[5], *tieOrder2[5], *tiePage1[5], *tiePage2[5];
+
+    w = BRWalletNew(NULL, 0, mpk);
+
+    for (int i = 0; i < 5; i++) {
+        tieTx[i] = BRTransactionNew();
+        if (i < 4) BRTransactionAddInput(tieTx[i], inHash, 40 + i, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+        else BRTransactionAddInput(tieTx[i], tieTx[1]->txHash, 0, SATOSHIS, inScript, inScriptLen, NULL, 0,
+                                   TXIN_SEQUENCE); // depends on a tx in the same block
+        BRTransactionAddOutput(tieTx[i], SATOSHIS, outScript, outScriptLen);
+        BRTransactionSign(tieTx[i], 0, &k, 1);
+        tieTx[i]->blockHeight = 100, tieTx[i]->timestamp = 1;
+        BRWalletRegisterTransaction(w, tieTx[i]);
+    }
+
+    for (int i = 0; i < 5; i++) tieCopies[4 - i] = BRTransactionCopy(tieTx[i]);
+    w2 = BRWalletNew(tieCopies, 5, mpk);
+
+    if (BRWalletTransactions(w, tieOrder1, 5) != 5 || BRWalletTransactions(w2, tieOrder2, 5) != 5 ||
+        BRWalletTxForAddress(w, recvAddr.s, tiePage1, 5) != 5 || BRWalletTxForAddress(w2, recvAddr.s, tiePage2, 5) != 5)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() test 4\n", __func__);
+
+    for (size_t i = 0, j = 5; i < 5; i++) {
+        if (tieOrder1[i] == tieTx[1]) j = i;
+        if (! BRTransactionEq(tieOrder1[i], tieOrder2[i]) || ! BRTransactionEq(tiePage1[i], tiePage2[i]) ||
+            (tieOrder1[i] == tieTx[4] && j > i)) // the tx it depends on comes first
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() test 5\n", __func__);
+    }
+
+    BRWalletFree(w2);
+    BRWalletFree(w);
+
+    // callbacks made during a batch are coalesced, so each tx is reported once with its final state
+    BRTransaction *eventTx[3];
+    size_t events[6] = { 0, 0, 0, 0, 0, 0 };
+
+    w = BRWalletNew(NULL, 0, mpk);
+    BRWalletSetCallbacks(w, events, walletBalanceCount, walletTxAddedCount, walletTxUpdatedCount,
+                         walletTxDeletedCount);
+    BRWalletBeginBatch(w);
+    BRWalletBeginBatch(w);
+
+    for (int i = 0; i < 3; i++) {
+        eventTx[i] = BRTransactionNew();
+        BRTransactionAddInput(eventTx[i], inHash, 30 + i, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(eventTx[i], SATOSHIS*(i + 1), outScript, outScriptLen);
+        BRTransactionSign(eventTx[i], 0, &k, 1);
+        eventTx[i]->timestamp = 1;
+        BRWalletRegisterTransaction(w, eventTx[i]);
+    }
+
+    BRWalletUpdateTransactions(w, &eventTx[0]->txHash, 1, 100, 2);
+    BRWalletUpdateTransactions(w, &eventTx[1]->txHash, 1, 200, 3);
+    BRWalletRemoveTransaction(w, eventTx[2]->txHash); // added and deleted during the batch, so never reported
+    BRWalletEndBatch(w);
+    if (events[0] || events[2] || events[4] || events[5]) // nested batch is still open
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletEndBatch() test 1\n", __func__);
+
+    BRWalletEndBatch(w);
+    if (events[0] != 0 || events[2] != 1 || events[3] != SATOSHIS*3 || events[4] != 2 || events[5] != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletEndBatch() test 2\n", __func__);
+
+    memset(events, 0, sizeof(events));
+    BRWalletBeginBatch(w);
+    updates[0] = (BRTxUpdate) { eventTx[0]->txHash, 300, 4 };
+    updates[1] = (BRTxUpdate) { eventTx[1]->txHash, 300, 4 };
+    BRWalletUpdateTxBatch(w, updates, 2);
+    BRWalletUpdateTransactions(w, &eventTx[0]->txHash, 1, 400, 5);
+    BRWalletRemoveTransaction(w, eventTx[1]->txHash); // the delete supersedes its update
+    BRWalletEndBatch(w);
+    if (events[0] != 1 || events[1] != 1 || events[2] != 1 || events[3] != SATOSHIS || events[4] != 0 ||
+        events[5] != 1 || BRWalletTransactionForHash(w, eventTx[0]->txHash)->blockHeight != 400)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletEndBatch() test 3\n", __func__);
+
+    memset(events, 0, sizeof(events));
+    BRWalletUpdateTransactions(w, &eventTx[0]->txHash, 1, 500, 6); // no batch, so callbacks are made right away
+    if (events[0] != 1 || events[1] != 1 || events[2] != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletEndBatch() test 4\n", __func__);
+
+    BRWalletFree(w);
+
+    // a wallet with large gap limits finds tx paying addresses far past the default gap, and keeps that many unused
+    BRAddress gapAddrs[2];
+    BRKey gapKeys[2];
+    BRTransaction *gapTx = BRTransactionNew();
+    uint8_t gapSig[] = { 0 }, gapScript[25];
+
+    BRBIP32PubKeyList(gapKeys, 2, mpk, SEQUENCE_EXTERNAL_CHAIN, 600);
+    BRKeyAddress(&gapKeys[0], gapAddrs[0].s, sizeof(*gapAddrs));
+    BRKeyAddress(&gapKeys[1], gapAddrs[1].s, sizeof(*gapAddrs));
+    BRTransactionAddInput(gapTx, inHash, 2, 1, NULL, 0, gapSig, sizeof(gapSig), TXIN_SEQUENCE);
+    BRTransactionAddOutput(gapTx, SATOSHIS, gapScript,
+                           BRAddressScriptPubKey(gapScript, sizeof(gapScript), gapAddrs[0].s));
+    BRSHA256(&gapTx->txHash, gapSig, sizeof(gapSig));
+    gapTx->blockHeight = 1, gapTx->timestamp = 1;
+    w = BRWalletNewWithGapLimits(&gapTx, 1, mpk, 1000, 100);
+    recvAddr = BRWalletReceiveAddress(w);
+    if (BRWalletBalance(w) != SATOSHIS || ! BRAddressEq(&recvAddr, &gapAddrs[1]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewWithGapLimits() test 1\n", __func__);
+
+    if (BRWalletGapLimit(w, 0) != 1000 || BRWalletGapLimit(w, 1) != 100 ||
+        BRWalletAllAddrs(w, NULL, 0) != 601 + 1000 + 100)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewWithGapLimits() test 2\n", __func__);
+
+    BRWalletRemoveTransaction(w, gapTx->txHash); // the receive address moves back once the tx is gone
+    recvAddr = BRWalletReceiveAddress(w);
+    BRBIP32PubKeyList(gapKeys, 1, mpk, SEQUENCE_EXTERNAL_CHAIN, 0);
+    BRKeyAddress(&gapKeys[0], gapAddrs[0].s, sizeof(*gapAddrs));
+    if (BRWalletBalance(w) != 0 || ! BRAddressEq(&recvAddr, &gapAddrs[0]) || ! BRWalletContainsAddress(w, gapAddrs[1].s))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewWithGapLimits() test 3\n", __func__);
+
+    BRWalletFree(w);
+
+    // relayed non-wallet tx are kept in a bounded pool, so memory use stays fixed no matter how many are relayed
+    uint8_t sig[] = { 0 };
+    BRTxPoolStats stats;
+
+    w = BRWalletNew(NULL, 0, mpk);
+    BRWalletSetTxPoolLimits(w, 1000, TX_POOL_MAX_AGE);
+
+    for (size_t i = 0; i < 1000000; i++) {
+        UInt256 hash;
+
+        BRSHA256(&hash, &i, sizeof(i));
+        tx = BRTransactionNew();
+        BRTransactionAddInput(tx, hash, 0, 1, NULL, 0, sig, sizeof(sig), TXIN_SEQUENCE);
+        BRTransactionAddOutput(tx, SATOSHIS, inScript, inScriptLen);
+        BRSHA256(&tx->txHash, &hash, sizeof(hash));
+        if (BRWalletRegisterTransaction(w, tx)) r = 0, fprintf(stderr, "***FAILED*** %s: pool test 1\n", __func__);
+        if (i % 1000 == 0 && BRWalletTxPoolStats(w).count > 1000)
+            r = 0, fprintf(stderr, "***FAILED*** %s: pool test 2\n", __func__);
+    }
+
+    stats = BRWalletTxPoolStats(w);
+    if (stats.count != 1000 || stats.added != 1000000 || stats.evictedCount != 1000000 - 1000 || stats.evictedAge != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPoolStats() test 1\n", __func__);
+
+    BRWalletSetTxPoolLimits(w, 1000, 0); // everything has now expired
+    stats = BRWalletTxPoolStats(w);
+    if (stats.count != 0 || stats.evictedAge != 1000 || BRWalletBalance(w) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxPoolStats() test 2\n", __func__);
+
+    BRWalletFree(w);
+
+    // 3000 payouts from 2000 utxos won't fit in one tx, so they're split, and every payout and utxo is used only once
+    BRTxOutput *payouts = calloc(3000, sizeof(*payouts));
+    BRTransaction **payoutTx = calloc(3000, sizeof(*payoutTx));
+    uint64_t *payoutFees = calloc(3000, sizeof(*payoutFees)), payoutTotal = 0, paidTotal = 0;
+    uint64_t inTotal, outTotal, feeTotal;
+    BRSet *spent = BRSetNew(BRUTXOHash, BRUTXOEq, 3000);
+    size_t payoutCount, paid = 0;
+
+    w = _BRWalletBenchNew(2000, BENCH_SHAPE_RECEIVES, mpk, NULL);
+
+    for (size_t i = 0; i < 3000; i++) {
+        payouts[i] = (BRTxOutput) { "", SATOSHIS/100 + i, inScript, inScriptLen };
+        payoutTotal += payouts[i].amount;
+    }
+
+    payoutCount = BRWalletCreatePayoutTxs(w, payouts, 3000, payoutTx, payoutFees);
+    if (payoutCount < 2) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreatePayoutTxs() test 1\n", __func__);
+
+    for (size_t i = 0; i < payoutCount; i++) {
+        inTotal = outTotal = feeTotal = 0;
+
+        for (size_t j = 0; j < payoutTx[i]->inCount; j++) {
+            if (BRSetContains(spent, &payoutTx[i]->inputs[j]))
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreatePayoutTxs() test 2\n", __func__);
+            BRSetAdd(spent, &payoutTx[i]->inputs[j]);
+            inTotal += payoutTx[i]->inputs[j].amount;
+        }
+
+        for (size_t j = 0; j < payoutTx[i]->outCount; j++) {
+            outTotal += payoutTx[i]->outputs[j].amount;
+            if (payoutTx[i]->outputs[j].scriptLen != inScriptLen ||
+                memcmp(payoutTx[i]->outputs[j].script, inScript, inScriptLen) != 0) continue;
+            paidTotal += payoutTx[i]->outputs[j].amount;
+            feeTotal += payoutFees[paid++];
+        }
+
+        if (BRTransactionSize(payoutTx[i]) > TX_MAX_SIZE || inTotal - outTotal != feeTotal ||
+            feeTotal < BRWalletFeeForTxSize(w, BRTransactionSize(payoutTx[i])))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreatePayoutTxs() test 3\n", __func__);
+    }
+
+    if (paid != 3000 || paidTotal != payoutTotal)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreatePayoutTxs() test 4\n", __func__);
+
+    for (size_t i = 0; i < payoutCount; i++) BRTransactionFree(payoutTx[i]);
+    payouts[0].amount = BRWalletBalance(w); // more than the wallet has, so nothing is built
+    if (BRWalletCreatePayoutTxs(w, payouts, 3000, payoutTx, NULL) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreatePayoutTxs() test 5\n", __func__);
+
+    payoutCount = BRWalletCreatePayoutTxs(w, &payouts[1], 3, payoutTx, payoutFees); // a few payouts share one tx
+    if (payoutCount != 1 || payoutTx[0]->outCount != 4 ||
+        payoutFees[0] + payoutFees[1] + payoutFees[2] != BRWalletFeeForTx(w, payoutTx[0]) ||
+        payoutFees[0] != payoutFees[1])
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreatePayoutTxs() test 6\n", __func__);
+
+    for (size_t i = 0; i < payoutCount; i++) BRTransactionFree(payoutTx[i]);
+    BRSetFree(spent);
+    free(payoutFees);
+    free(payoutTx);
+    free(payouts);
+    BRWalletFree(w);
+
+    // signing a tx that spends from both chains derives each input's key from the chain and index of its address
+    BRAddress extAddrs[3], intAddrs[2], signAddrs[2];
+    BRKey signKeys[2];
+
+    w = BRWalletNew(NULL, 0, mpk);
+    BRWalletUnusedAddrs(w, extAddrs, 3, 0);
+    BRWalletUnusedAddrs(w, intAddrs, 2, 1);
+    signAddrs[0] = extAddrs[2], signAddrs[1] = intAddrs[1];
+    BRBIP32PrivKey(&signKeys[0], "", 1, SEQUENCE_EXTERNAL_CHAIN, 2);
+    BRBIP32PrivKey(&signKeys[1], "", 1, SEQUENCE_INTERNAL_CHAIN, 1);
+    tx = BRTransactionNew();
+
+    for (uint32_t i = 0; i < 2; i++) {
+        uint8_t signScript[BRAddressScriptPubKey(NULL, 0, signAddrs[i].s)];
+        size_t signScriptLen = BRAddressScriptPubKey(signScript, sizeof(signScript), signAddrs[i].s);
+
+        BRTransactionAddInput(tx, inHash, i, SATOSHIS, signScript, signScriptLen, NULL, 0, TXIN_SEQUENCE);
+    }
+
+    BRTransactionAddOutput(tx, SATOSHIS, inScript, inScriptLen);
+    if (! BRWalletSignTransaction(w, tx, 0, "", 1) || ! BRTransactionIsSigned(tx))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSignTransaction() test 2\n", __func__);
+
+    for (size_t i = 0; i < tx->inCount; i++) { // each input is signed by its address's key, over its legacy digest
+        BRTransaction *digestTx = BRTransactionNew();
+        const uint8_t *elems[2], *sigData = NULL, *pubKey = NULL;
+        uint8_t expected[65];
+        size_t sigLen = 0, pubKeyLen = 0, expectedLen = BRKeyPubKey(&signKeys[i], expected, sizeof(expected));
+        UInt256 md;
+
+        for (size_t j = 0; j < tx->inCount; j++) { // only the input being signed keeps its script, with no amounts
+            BRTransactionAddInput(digestTx, tx->inputs[j].txHash, tx->inputs[j].index, 0,
+                                  (i == j) ? tx->inputs[j].script : NULL, (i == j) ? tx->inputs[j].scriptLen : 0,
+                                  NULL, 0, tx->inputs[j].sequence);
+        }
+
+        BRTransactionAddOutput(digestTx, tx->outputs[0].amount, tx->outputs[0].script, tx->outputs[0].scriptLen);
+        digestTx->lockTime = tx->lockTime;
+
+        uint8_t data[BRTransactionSerialize(digestTx, NULL, 0) + sizeof(uint32_t)];
+        size_t dataLen = BRTransactionSerialize(digestTx, data, sizeof(data));
+
+        UInt32SetLE(&data[dataLen], 0x01), dataLen += sizeof(uint32_t); // SIGHASH_ALL
+        BRSHA256_2(&md, data, dataLen);
+        BRTransactionFree(digestTx);
+
+        if (BRScriptElements(elems, 2, tx->inputs[i].signature, tx->inputs[i].sigLen) == 2) {
+            sigData = BRScriptData(elems[0], &sigLen);
+            pubKey = BRScriptData(elems[1], &pubKeyLen);
+        }
+
+        if (! sigData || sigLen < 2 || ! pubKey || pubKeyLen != expectedLen ||
+            memcmp(pubKey, expected, expectedLen) != 0 || ! BRKeyVerify(&signKeys[i], md, sigData, sigLen - 1))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSignTransaction() test %zu\n", __func__, 3 + i);
+    }
+
+    BRTransactionFree(tx);
+    BRWalletFree(w);
+
     amt = BRBitcoinAmount(50000, 50000);
     if (amt != SATOSHIS) r = 0, fprintf(stderr, "***FAILED*** %s: BRBitcoinAmount() test 1\n", __func__);
 
@@ -2009,6 +2932,675 @@ int BRWalletTests()
     return r;
 }
 
+static double _benchMs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+}
+
+// a tx paying amount to each of addrs, and spending output 0 of each of spent, or an outpoint of no wallet tx if there
+// are none, with placeholder signatures so it can be loaded but not relayed, its hash is the same for the same seq
+static BRTransaction *_benchTxPaying(const BRAddress addrs[], size_t addrsCount, uint64_t amount, uint64_t seq,
+                                     BRTransaction *const spent[], size_t spentCount)
+{
+    BRTransaction *tx = BRTransactionNew();
+    uint8_t script[25], sig[] = { 0 };
+    UInt256 inHash;
+
+    BRSHA256(&inHash, &seq, sizeof(seq)); // tx hashes must be well distributed, sequential values degrade BRSet probing
+    if (spentCount == 0) BRTransactionAddInput(tx, inHash, 0, 1, NULL, 0, sig, sizeof(sig), TXIN_SEQUENCE);
+
+    for (size_t i = 0; i < spentCount; i++) {
+        BRTransactionAddInput(tx, spent[i]->txHash, 0, spent[i]->outputs[0].amount, NULL, 0, sig, sizeof(sig),
+                              TXIN_SEQUENCE);
+    }
+
+    for (size_t i = 0; i < addrsCount; i++) {
+        BRTransactionAddOutput(tx, amount, script, BRAddressScriptPubKey(script, sizeof(script), addrs[i].s));
+    }
+
+    BRSHA256(&tx->txHash, &inHash, sizeof(inHash)); // not the same as any input hash
+    tx->timestamp = 1;
+    return tx;
+}
+
+// builds a wallet of txCount tx with the given BENCH_SHAPE_, 10 per block, of pseudo-random amounts paid to the first
+// receive address, or to the first txCount/10 for BENCH_SHAPE_SPREAD, and sets newMs to how long loading them took
+static BRWallet *_BRWalletBenchNew(size_t txCount, int shape, BRMasterPubKey mpk, double *newMs)
+{
+    BRWallet *w = BRWalletNew(NULL, 0, mpk);
+    size_t addrsCount = (shape == BENCH_SHAPE_SPREAD) ? txCount/10 + 1 : 1;
+    BRAddress *addrs = calloc(addrsCount, sizeof(*addrs));
+    BRTransaction **txs = calloc(txCount, sizeof(*txs));
+    uint64_t seed = 1, amount;
+    double t;
+
+    BRWalletUnusedAddrs(w, addrs, (uint32_t)addrsCount, 0);
+    BRWalletFree(w);
+
+    for (size_t i = 0; i < txCount; i++) {
+        seed = seed*6364136223846793005ULL + 1442695040888963407ULL; // LCG, so runs are reproducible
+        amount = 10000 + (seed >> 33) % (SATOSHIS/10);
+
+        if (shape == BENCH_SHAPE_CHAIN && i > 0) { // passes its whole amount on
+            txs[i] = _benchTxPaying(addrs, 1, txs[i - 1]->outputs[0].amount, i, &txs[i - 1], 1);
+        }
+        else if (shape == BENCH_SHAPE_SWEEPS && i % 10 == 9) {
+            amount = 0;
+            for (size_t j = i - 9; j < i; j++) amount += txs[j]->outputs[0].amount;
+            txs[i] = _benchTxPaying(addrs, 1, amount - 10000, i, &txs[i - 9], 9);
+        }
+        else txs[i] = _benchTxPaying(&addrs[(shape == BENCH_SHAPE_SPREAD) ? i/10 : 0], 1, amount, i, NULL, 0);
+
+        txs[i]->blockHeight = (uint32_t)i/10 + 1;
+    }
+
+    t = _benchMs();
+    w = BRWalletNew(txs, txCount, mpk);
+    if (newMs) *newMs = _benchMs() - t;
+    free(txs);
+    free(addrs);
+    return w;
+}
+
+// measures coin selection latency and resulting fee when sending various amounts from a 100k utxo wallet
+int BRWalletCoinSelectionBench()
+{
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    uint64_t fee, amounts[] = { SATOSHIS/1000, SATOSHIS/20, SATOSHIS/3, SATOSHIS*2, SATOSHIS*25 };
+    clock_t start = clock();
+    BRWallet *w = _BRWalletBenchNew(100000, BENCH_SHAPE_RECEIVES, mpk, NULL);
+    BRTransaction *tx;
+    BRAddress addr;
+    BRKey k;
+    size_t inCount;
+
+    BRKeySetSecret(&k, &secret, 1);
+    BRKeyAddress(&k, addr.s, sizeof(addr));
+    printf("\n%zu utxos loaded in %.3fs\n", BRWalletUTXOs(w, NULL, 0), (double)(clock() - start)/CLOCKS_PER_SEC);
+    if (BRWalletUTXOs(w, NULL, 0) != 100000) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() test\n", __func__);
+
+    for (size_t i = 0; i < sizeof(amounts)/sizeof(*amounts); i++) {
+        start = clock();
+        tx = BRWalletCreateTransaction(w, amounts[i], addr.s);
+
+        if (! tx) {
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreateTransaction() test %zu\n", __func__, i + 1);
+            continue;
+        }
+
+        fee = BRWalletFeeForTx(w, tx);
+        printf("send %10"PRIu64": %8.3fms, %4zu input(s), %zu output(s), fee %6"PRIu64" (%"PRIu64" per kb)\n",
+               amounts[i], (double)(clock() - start)*1000/CLOCKS_PER_SEC, tx->inCount, tx->outCount, fee,
+               fee*1000/BRTransactionSize(tx));
+
+        start = clock();
+        if (BRWalletFeeQuote(w, amounts[i], addr.s, &inCount) != fee || inCount != tx->inCount)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeQuote() test %zu\n", __func__, i + 1);
+        printf("quote %9"PRIu64": %8.3fms\n", amounts[i], (double)(clock() - start)*1000/CLOCKS_PER_SEC);
+        BRTransactionFree(tx);
+    }
+
+    BRWalletFree(w);
+    return r;
+}
+
+typedef struct {
+    BRWallet *wallet;
+    BRAddress addr;
+    pthread_mutex_t lock;
+    int done;
+    size_t reads;
+    double maxBalanceMs, maxReadMs;
+} BRWalletContentionInfo;
+
+static void *_walletContentionReader(void *info)
+{
+    BRWalletContentionInfo *ctx = info;
+    double t, maxBalance = 0, maxRead = 0;
+    size_t reads = 0;
+    int done = 0;
+
+    while (! done) {
+        t = _benchMs();
+        BRWalletBalance(ctx->wallet);
+        t = _benchMs() - t;
+        if (t > maxBalance) maxBalance = t;
+
+        t = _benchMs();
+        BRWalletUTXOs(ctx->wallet, NULL, 0);
+        BRWalletTransactions(ctx->wallet, NULL, 0);
+        BRWalletContainsAddress(ctx->wallet, ctx->addr.s);
+        t = _benchMs() - t;
+        if (t > maxRead) maxRead = t;
+
+        if (++reads % 256 == 0) {
+            pthread_mutex_lock(&ctx->lock);
+            done = ctx->done;
+            pthread_mutex_unlock(&ctx->lock);
+        }
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->reads += reads;
+    if (maxBalance > ctx->maxBalanceMs) ctx->maxBalanceMs = maxBalance;
+    if (maxRead > ctx->maxReadMs) ctx->maxReadMs = maxRead;
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+// measures how UI/API reader threads fare while a network thread registers and removes wallet tx
+int BRWalletContentionBench()
+{
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRWalletContentionInfo ctx = { _BRWalletBenchNew(10000, BENCH_SHAPE_RECEIVES, mpk, NULL), BR_ADDRESS_NONE,
+                                   PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 };
+    uint64_t balance = BRWalletBalance(ctx.wallet);
+    uint8_t script[25], sig[] = { 0 };
+    size_t scriptLen, updates = 2000;
+    pthread_t readers[4];
+    BRTransaction *tx;
+    double start;
+
+    ctx.addr = BRWalletReceiveAddress(ctx.wallet);
+    scriptLen = BRAddressScriptPubKey(script, sizeof(script), ctx.addr.s);
+
+    for (size_t i = 0; i < sizeof(readers)/sizeof(*readers); i++) {
+        pthread_create(&readers[i], NULL, _walletContentionReader, &ctx);
+    }
+
+    start = _benchMs();
+
+    for (size_t i = 0; i < updates; i++) {
+        UInt256 hash;
+        size_t n = i + 1000000;
+
+        BRSHA256(&hash, &n, sizeof(n));
+        tx = BRTransactionNew();
+        BRTransactionAddInput(tx, hash, 0, 1, NULL, 0, sig, sizeof(sig), TXIN_SEQUENCE);
+        BRTransactionAddOutput(tx, SATOSHIS, script, scriptLen);
+        BRSHA256(&tx->txHash, &hash, sizeof(hash));
+        tx->timestamp = 1;
+        hash = tx->txHash;
+        if (! BRWalletRegisterTransaction(ctx.wallet, tx))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() test\n", __func__);
+        BRWalletRemoveTransaction(ctx.wallet, hash);
+    }
+
+    start = _benchMs() - start;
+    pthread_mutex_lock(&ctx.lock);
+    ctx.done = 1;
+    pthread_mutex_unlock(&ctx.lock);
+
+    for (size_t i = 0; i < sizeof(readers)/sizeof(*readers); i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    printf("\n%zu register/remove in %.3fms, %zu reads by %zu threads, max balance read %.3fms, max locked read %.3fms\n",
+           updates*2, start, ctx.reads*4, sizeof(readers)/sizeof(*readers), ctx.maxBalanceMs, ctx.maxReadMs);
+    if (BRWalletBalance(ctx.wallet) != balance)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletBalance() test\n", __func__);
+
+    BRWalletFree(ctx.wallet);
+    pthread_mutex_destroy(&ctx.lock);
+    return r;
+}
+
+// measures the cost of rendering a page of history from a 100k tx wallet, versus copying the whole history
+int BRWalletHistoryPageBench()
+{
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRWallet *w = _BRWalletBenchNew(100000, BENCH_SHAPE_RECEIVES, mpk, NULL);
+    BRTransaction **all = calloc(100000, sizeof(*all)), *page[25];
+    BRTxCursor cursor = BR_TX_CURSOR_START;
+    size_t n, total = 0;
+    double t;
+
+    t = _benchMs();
+    n = BRWalletTransactions(w, all, 100000);
+    printf("\nall %zu tx: %8.3fms\n", n, _benchMs() - t);
+
+    t = _benchMs();
+    n = BRWalletTxPage(w, page, 25, &cursor, NULL, 0, 1);
+    printf("newest 25: %8.3fms\n", _benchMs() - t);
+    if (n != 25 || page[0] != all[99999]) r = 0, fprintf(stderr, "***FAILED*** %s: newest page test\n", __func__);
+
+    cursor = (BRTxCursor) { all[50000]->txHash, all[50000]->blockHeight };
+    t = _benchMs();
+    n = BRWalletTxPage(w, page, 25, &cursor, NULL, 0, 1);
+    printf("middle 25: %8.3fms\n", _benchMs() - t);
+    if (n != 25 || page[0] != all[49999]) r = 0, fprintf(stderr, "***FAILED*** %s: middle page test\n", __func__);
+
+    cursor = (BRTxCursor) { all[50000]->txHash, all[50000]->blockHeight };
+    t = _benchMs();
+    n = BRWalletTxPage(w, page, 25, &cursor, all[0]->outputs[0].address, TX_DIRECTION_RECEIVED, 1);
+    printf("middle 25 by address: %8.3fms\n", _benchMs() - t);
+    if (n != 25 || page[0] != all[49999]) r = 0, fprintf(stderr, "***FAILED*** %s: address page test\n", __func__);
+
+    t = _benchMs();
+    if (BRWalletBalanceAfterTx(w, all[50000]) > BRWalletBalance(w))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletBalanceAfterTx() test\n", __func__);
+    printf("middle balance: %8.3fms\n", _benchMs() - t);
+
+    cursor = BR_TX_CURSOR_START;
+    t = _benchMs();
+    n = BRWalletTxPage(w, page, 25, &cursor, NULL, TX_DIRECTION_SENT, 1);
+    printf("newest 25 sent: %8.3fms\n", _benchMs() - t);
+    if (n != 0) r = 0, fprintf(stderr, "***FAILED*** %s: sent page test\n", __func__);
+
+    cursor = BR_TX_CURSOR_START;
+    t = _benchMs();
+
+    while ((n = BRWalletTxPage(w, page, 25, &cursor, NULL, 0, 0)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (page[i] != all[total + i]) r = 0, fprintf(stderr, "***FAILED*** %s: paging test\n", __func__);
+        }
+
+        total += n;
+    }
+
+    printf("all %zu tx in pages of 25: %8.3fms\n", total, _benchMs() - t);
+    if (total != 100000) r = 0, fprintf(stderr, "***FAILED*** %s: paging count test\n", __func__);
+    free(all);
+    BRWalletFree(w);
+    return r;
+}
+
+// measures confirming the tx of 1000 blocks one block at a time, as chain sync used to, versus in a single batch
+int BRWalletTxBatchBench()
+{
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRWallet *w = _BRWalletBenchNew(10000, BENCH_SHAPE_RECEIVES, mpk, NULL);
+    BRTransaction **all = calloc(10000, sizeof(*all)), **order = calloc(10000, sizeof(*order));
+    BRTxUpdate *updates = calloc(10000, sizeof(*updates));
+    uint64_t balance = BRWalletBalance(w);
+    size_t n = BRWalletTransactions(w, all, 10000);
+    double t;
+
+    for (size_t i = 0; i < n; i++) updates[i] = (BRTxUpdate) { all[i]->txHash, all[i]->blockHeight, 1 };
+
+    BRWalletSetTxUnconfirmedAfter(w, 0);
+    t = _benchMs();
+    for (size_t i = 0; i < n; i += 10) BRWalletUpdateTxBatch(w, &updates[i], (n - i < 10) ? n - i : 10);
+    printf("\n%zu tx confirmed one block at a time: %8.3fms\n", n, _benchMs() - t);
+    if (BRWalletBalance(w) != balance) r = 0, fprintf(stderr, "***FAILED*** %s: per block balance test\n", __func__);
+
+    BRWalletSetTxUnconfirmedAfter(w, 0);
+    t = _benchMs();
+    BRWalletUpdateTxBatch(w, updates, n);
+    printf("%zu tx confirmed in one batch: %8.3fms\n", n, _benchMs() - t);
+    if (BRWalletBalance(w) != balance) r = 0, fprintf(stderr, "***FAILED*** %s: batch balance test\n", __func__);
+
+    if (BRWalletTransactions(w, order, n) != n || memcmp(order, all, n*sizeof(*all)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: batch order test\n", __func__);
+
+    free(updates);
+    free(order);
+    free(all);
+    BRWalletFree(w);
+    return r;
+}
+
+// peak resident memory of the process in MB
+static double _benchMaxRSS(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss/(1024.0*1024.0); // bytes
+#else
+    return usage.ru_maxrss/1024.0; // kilobytes
+#endif
+}
+
+// loads a bloom filter with the wallet's addresses and utxos the same way BRPeerManager does it
+static BRBloomFilter *_BRWalletBenchFilter(BRWallet *w)
+{
+    size_t addrsCount = BRWalletAllAddrs(w, NULL, 0), utxosCount = BRWalletUTXOs(w, NULL, 0);
+    BRAddress *addrs = calloc(addrsCount + 1, sizeof(*addrs));
+    BRUTXO *utxos = calloc(utxosCount + 1, sizeof(*utxos));
+    BRBloomFilter *filter = BRBloomFilterNew(BLOOM_DEFAULT_FALSEPOSITIVE_RATE, addrsCount + utxosCount + 100, 0,
+                                             BLOOM_UPDATE_ALL);
+    UInt160 hash;
+
+    BRWalletAllAddrs(w, addrs, addrsCount);
+    BRWalletUTXOs(w, utxos, utxosCount);
+
+    for (size_t i = 0; i < addrsCount; i++) {
+        if (BRAddressHash160(&hash, addrs[i].s) && ! BRBloomFilterContainsData(filter, hash.u8, sizeof(hash))) {
+            BRBloomFilterInsertData(filter, hash.u8, sizeof(hash));
+        }
+    }
+
+    for (size_t i = 0; i < utxosCount; i++) {
+        uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
+
+        UInt256Set(o, utxos[i].hash);
+        UInt32SetLE(&o[sizeof(UInt256)], utxos[i].n);
+        if (! BRBloomFilterContainsData(filter, o, sizeof(o))) BRBloomFilterInsertData(filter, o, sizeof(o));
+    }
+
+    free(utxos);
+    free(addrs);
+    return filter;
+}
+
+// creates, loads and syncs a watch-only wallet of about 100k addresses, with a 50,000 receive and 10,000 change address
+// gap limit, and fails if that takes more than 30s or 100MB in all, which leaves a 1GB phone room for the app itself
+int BRWalletLargeBench()
+{
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRTransaction *loadTx[1000], *syncTx[1000];
+    BRTxUpdate updates[1000];
+    BRAddress *addrs = calloc(200000, sizeof(*addrs)), recvAddr;
+    BRBloomFilter *filter;
+    double t, start = _benchMs(), rss = _benchMaxRSS();
+    size_t addrsCount;
+    BRWallet *w;
+
+    t = _benchMs();
+    w = BRWalletNewWithGapLimits(NULL, 0, mpk, 50000, 10000);
+    addrsCount = BRWalletAllAddrs(w, addrs, 200000);
+    printf("\n%zu addresses created: %10.3fms\n", addrsCount, _benchMs() - t);
+
+    // the wallet's first 1000 tx pay every 40th of the first 40,000 receive addresses, which come after the change ones
+    for (size_t i = 0; i < 1000; i++) {
+        loadTx[i] = _benchTxPaying(&addrs[10000 + i*40], 1, SATOSHIS/100, i, NULL, 0);
+        loadTx[i]->blockHeight = (uint32_t)i + 1;
+    }
+
+    BRWalletFree(w);
+    t = _benchMs();
+    w = BRWalletNewWithGapLimits(loadTx, 1000, mpk, 50000, 10000);
+    addrsCount = BRWalletAllAddrs(w, NULL, 0);
+    printf("%zu addresses, 1000 tx loaded: %10.3fms\n", addrsCount, _benchMs() - t);
+    if (BRWalletBalance(w) != SATOSHIS*10 || addrsCount != 10000 + 39961 + 50000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewWithGapLimits() test\n", __func__);
+
+    // during the sync, 1000 more tx arrive one at a time, each using the next 10 receive addresses, then they confirm
+    t = _benchMs();
+
+    for (size_t i = 0; i < 1000; i++) {
+        BRWalletUnusedAddrs(w, addrs, 10, 0);
+        syncTx[i] = _benchTxPaying(addrs, 10, SATOSHIS/1000, 1000 + i, NULL, 0);
+        BRWalletRegisterTransaction(w, syncTx[i]);
+        updates[i] = (BRTxUpdate) { syncTx[i]->txHash, 1001 + (uint32_t)i/10, 1 };
+    }
+
+    BRWalletUpdateTxBatch(w, updates, 1000);
+    recvAddr = BRWalletReceiveAddress(w);
+    addrsCount = BRWalletAllAddrs(w, addrs, 200000);
+    printf("%zu addresses, 1000 tx synced: %10.3fms\n", addrsCount, _benchMs() - t);
+    if (BRWalletBalance(w) != SATOSHIS*20 || addrsCount != 10000 + 49961 + 50000 ||
+        ! BRAddressEq(&recvAddr, &addrs[10000 + 49961]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() test\n", __func__);
+
+    t = _benchMs();
+    filter = _BRWalletBenchFilter(w);
+    printf("%zu byte filter, %"PRIu32" hash func(s), %.3f false positive rate: %10.3fms\n", filter->length,
+           filter->hashFuncs, BRBloomFilterFalsePositiveRate(filter), _benchMs() - t);
+    if (filter->hashFuncs < 1 || BRBloomFilterFalsePositiveRate(filter) > 0.5)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterNew() test\n", __func__);
+
+    t = _benchMs() - start;
+    rss = _benchMaxRSS() - rss;
+    printf("total %.3fs, peak memory +%.1fMB\n", t/1000, rss);
+    if (t > 30000 || rss > 100) r = 0, fprintf(stderr, "***FAILED*** %s: budget test\n", __func__);
+
+    BRBloomFilterFree(filter);
+    free(addrs);
+    BRWalletFree(w);
+    return r;
+}
+
+// measures paying 100 payouts from a 100k utxo wallet one tx at a time, versus planned together in as few tx as fit
+int BRWalletPayoutBench()
+{
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRWallet *w = _BRWalletBenchNew(100000, BENCH_SHAPE_RECEIVES, mpk, NULL);
+    BRTxOutput payouts[100];
+    BRTransaction *tx, *txs[100];
+    uint64_t fees[100], fee = 0;
+    BRAddress addr = BRWalletReceiveAddress(w);
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)];
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s), count;
+    double t;
+
+    for (size_t i = 0; i < 100; i++) payouts[i] = (BRTxOutput) { "", SATOSHIS/100 + i*1000, script, scriptLen };
+
+    t = _benchMs();
+
+    for (size_t i = 0; i < 100; i++) {
+        tx = BRWalletCreateTxForOutputs(w, &payouts[i], 1);
+        if (! tx) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreateTxForOutputs() test %zu\n", __func__, i + 1);
+        if (tx) fee += BRWalletFeeForTx(w, tx);
+        if (tx) BRTransactionFree(tx);
+    }
+
+    printf("\n100 payouts, one tx each: %10.3fms, fees %"PRIu64"\n", _benchMs() - t, fee);
+    t = _benchMs();
+    count = BRWalletCreatePayoutTxs(w, payouts, 100, txs, fees);
+    fee = 0;
+    for (size_t i = 0; i < 100 && count > 0; i++) fee += fees[i];
+    printf("100 payouts, planned in %zu tx: %10.3fms, fees %"PRIu64"\n", count, _benchMs() - t, fee);
+    if (count == 0) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreatePayoutTxs() test\n", __func__);
+
+    for (size_t i = 0; i < count; i++) BRTransactionFree(txs[i]);
+    BRWalletFree(w);
+    return r;
+}
+
+static int _doubleCompare(const void *a, const void *b)
+{
+    return (*(const double *)a < *(const double *)b) ? -1 : (*(const double *)a > *(const double *)b);
+}
+
+// times wallet operations on synthetic wallets of 1k to 200k tx in each BENCH_SHAPE_, and reports how the cost grows
+// with the number of tx as the exponent k of a fitted n^k curve, per operation for all but BRWalletNew()
+// BRWalletNew(), coin selection in BRWalletCreateTransaction() and loading a bloom filter look at every tx, utxo or
+// address, so are expected to be linear, and the rest constant, and it fails if any cost grows faster than that by half
+// a power of n or more, timings under 1us are floored before fitting, since at that scale they're mostly clock noise
+int BRWalletScalingBench()
+{
+    static const size_t sizes[] = { 1000, 10000, 50000, 200000 };
+    static const char *shapes[] = { "receives", "chain", "sweeps", "spread" },
+                      *ops[] = { "new", "register", "update", "create", "sign", "balance", "filter" };
+    const size_t sizeCount = sizeof(sizes)/sizeof(*sizes), opCount = sizeof(ops)/sizeof(*ops);
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRAddress addr;
+    BRKey k;
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    double ms[sizeCount][opCount], runs[10], t = 0, exponent;
+    uint64_t balance = 0;
+
+    BRKeySetSecret(&k, &secret, 1);
+    BRKeyAddress(&k, addr.s, sizeof(addr));
+    printf("\n%-8s %7s %7s %10s %10s %10s %10s %10s %10s %10s\n", "shape", "tx", "addrs", "new ms", "register",
+           "update", "create", "sign", "balance", "filter");
+
+    for (int shape = 0; shape < sizeof(shapes)/sizeof(*shapes); shape++) {
+        for (size_t s = 0; s < sizeCount; s++) {
+            BRWallet *w = _BRWalletBenchNew(sizes[s], shape, mpk, &ms[s][0]);
+            size_t addrsCount = BRWalletAllAddrs(w, NULL, 0);
+            BRAddress recvAddr;
+            BRBloomFilter *filter;
+            UInt256 hashes[100];
+            BRTransaction *tx;
+
+            // 100 unconfirmed tx received while synced, each its own call paying the current receive address, so the
+            // address chain is extended as they use it, then each confirmed in its own block
+            // per op costs are the median of 10 runs of 10, so a set or array growing doesn't skew them
+            for (size_t i = 0; i < 100; i++) {
+                if (i % 10 == 0) t = _benchMs();
+                recvAddr = BRWalletReceiveAddress(w);
+                tx = _benchTxPaying(&recvAddr, 1, SATOSHIS/100, sizes[s] + i, NULL, 0);
+                hashes[i] = tx->txHash;
+                if (! BRWalletRegisterTransaction(w, tx)) BRTransactionFree(tx);
+                if (i % 10 == 9) runs[i/10] = (_benchMs() - t)/10;
+            }
+
+            qsort(runs, 10, sizeof(*runs), _doubleCompare);
+            ms[s][1] = runs[5];
+
+            for (size_t i = 0; i < 100; i++) {
+                if (i % 10 == 0) t = _benchMs();
+                BRWalletUpdateTransactions(w, &hashes[i], 1, (uint32_t)sizes[s]/10 + 2 + (uint32_t)i, 1);
+                if (i % 10 == 9) runs[i/10] = (_benchMs() - t)/10;
+            }
+
+            qsort(runs, 10, sizeof(*runs), _doubleCompare);
+            ms[s][2] = runs[5];
+            t = _benchMs();
+            tx = BRWalletCreateTransaction(w, SATOSHIS/20, addr.s);
+            ms[s][3] = _benchMs() - t;
+            t = _benchMs();
+            if (! tx || ! BRWalletSignTransaction(w, tx, 0, "", 1))
+                r = 0, fprintf(stderr, "***FAILED*** %s: %s %zu sign test\n", __func__, shapes[shape], sizes[s]);
+            ms[s][4] = _benchMs() - t;
+            if (tx) BRTransactionFree(tx);
+            t = _benchMs();
+            for (size_t i = 0; i < 100000; i++) balance += BRWalletBalance(w);
+            ms[s][5] = (_benchMs() - t)/100000;
+            t = _benchMs();
+            filter = _BRWalletBenchFilter(w);
+            ms[s][6] = _benchMs() - t;
+            BRBloomFilterFree(filter);
+            printf("%-8s %7zu %7zu %10.3f %10.3f %10.3f %10.3f %10.3f %10.6f %10.3f\n", shapes[shape], sizes[s],
+                   addrsCount, ms[s][0], ms[s][1], ms[s][2], ms[s][3], ms[s][4], ms[s][5], ms[s][6]);
+            BRWalletFree(w);
+        }
+
+        printf("%-8s %15s", shapes[shape], "n^k, k:");
+
+        for (size_t op = 0; op < opCount; op++) { // least squares slope of log(ms) over log(n)
+            double sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+            for (size_t s = 0; s < sizeCount; s++) {
+                double x = log(sizes[s]), y = log(fmax(ms[s][op], 0.001));
+
+                sx += x, sy += y, sxx += x*x, sxy += x*y;
+            }
+
+            exponent = (sizeCount*sxy - sx*sy)/(sizeCount*sxx - sx*sx);
+            printf(" %10.2f", exponent);
+            if (exponent > ((op == 0 || op == 3 || op == 6) ? 1.5 : 0.5))
+                r = 0, fprintf(stderr, "***FAILED*** %s: %s %s complexity test\n", __func__, shapes[shape], ops[op]);
+        }
+
+        printf("\n");
+    }
+
+    if (balance == 0) r = 0, fprintf(stderr, "***FAILED*** %s: balance test\n", __func__);
+    return r;
+}
+
+// times signing all inputs of 250 and 1000 input tx, with BIP143 (forkId 0x40) and legacy signatures, and fails if
+// the time per BIP143 signature grows with the number of inputs, legacy digests hash most of the tx for each input, so
+// their time per input is expected to grow
+int BRTransactionSignBench()
+{
+    static const size_t counts[] = { 250, 1000 };
+    int r = 1;
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    BRTransaction *tx;
+    BRAddress addr;
+    BRKey k;
+    double ms[2][2], t;
+
+    BRKeySetSecret(&k, &secret, 1);
+    BRKeyAddress(&k, addr.s, sizeof(addr));
+
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)];
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
+
+    printf("\n");
+
+    for (size_t c = 0; c < 2; c++) {
+        for (int forkId = 0x40, f = 0; f < 2; forkId = 0, f++) {
+            tx = BRTransactionNew();
+
+            for (size_t i = 0; i < counts[c]; i++) {
+                UInt256 inHash;
+
+                BRSHA256(&inHash, &i, sizeof(i));
+                BRTransactionAddInput(tx, inHash, 0, SATOSHIS, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+            }
+
+            BRTransactionAddOutput(tx, SATOSHIS*counts[c] - SATOSHIS/10, script, scriptLen);
+            t = _benchMs();
+            if (! BRTransactionSign(tx, forkId, &k, 1))
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRTransactionSign() test %zu\n", __func__, c*2 + f + 1);
+            ms[c][f] = _benchMs() - t;
+            printf("%4zu inputs signed, %s: %10.3fms, %7.3fms per input\n", counts[c], (forkId) ? "BIP143" : "legacy",
+                   ms[c][f], ms[c][f]/counts[c]);
+            BRTransactionFree(tx);
+        }
+    }
+
+    if (ms[1][0]/counts[1] > 1.5*ms[0][0]/counts[0])
+        r = 0, fprintf(stderr, "***FAILED*** %s: BIP143 signing complexity test\n", __func__);
+    return r;
+}
+
+// times reading the amounts paid by a 200 input, 200 output tx, from a BRTransactionView and from BRTransactionParse()
+int BRTransactionViewBench()
+{
+    int r = 1;
+    UInt256 inHash = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    BRTransaction *tx = BRTransactionNew();
+    BRTransactionView view;
+    BRTxOutputView output;
+    uint8_t script[25] = { OP_DUP, OP_HASH160, 20 }, sig[107] = { 0 };
+    uint64_t parsedAmount = 0, viewAmount = 0;
+    double t;
+
+    script[23] = OP_EQUALVERIFY, script[24] = OP_CHECKSIG;
+    for (size_t i = 0; i < 200; i++) BRTransactionAddInput(tx, inHash, (uint32_t)i, 0, NULL, 0, sig, sizeof(sig), 0);
+    for (size_t i = 0; i < 200; i++) BRTransactionAddOutput(tx, SATOSHIS/100 + i, script, sizeof(script));
+
+    size_t len = BRTransactionSerialize(tx, NULL, 0);
+    uint8_t *buf = malloc(len);
+
+    len = BRTransactionSerialize(tx, buf, len);
+    BRTransactionFree(tx);
+    t = _benchMs();
+
+    for (size_t i = 0; i < 1000; i++) {
+        tx = BRTransactionParse(buf, len);
+        for (size_t j = 0; tx && j < tx->outCount; j++) parsedAmount += tx->outputs[j].amount;
+        if (tx) BRTransactionFree(tx);
+    }
+
+    printf("\n1000 x %zu byte tx parsed: %10.3fms\n", len, _benchMs() - t);
+    t = _benchMs();
+
+    for (size_t i = 0; i < 1000; i++) {
+        if (! BRTransactionViewParse(&view, buf, len)) continue;
+
+        for (size_t j = 0, off = view.outOff; j < view.outCount; j++) {
+            off = BRTransactionViewOutput(&view, off, &output);
+            viewAmount += output.amount;
+        }
+    }
+
+    printf("1000 x %zu byte tx viewed: %10.3fms\n", len, _benchMs() - t);
+    if (parsedAmount == 0 || viewAmount != parsedAmount)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRTransactionViewParse() test\n", __func__);
+    free(buf);
+    return r;
+}
+
 int BRBloomFilterTests()
 {
     int r = 1;
@@ -2080,7 +3672,20 @@ int BRBloomFilterTests()
     if (len2 != sizeof(d2) - 1 || memcmp(buf2, d2, len2) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterSerialize() test 2\n", __func__);
     
-    BRBloomFilterFree(f);    
+    BRBloomFilterFree(f);
+
+    // more elements than fit at the requested rate, so the filter is capped but still uses a hash function
+    f = BRBloomFilterNew(BLOOM_DEFAULT_FALSEPOSITIVE_RATE, 100000, 0, BLOOM_UPDATE_ALL);
+    if (f->length != BLOOM_MAX_FILTER_LENGTH || f->hashFuncs != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterNew() test\n", __func__);
+
+    for (uint32_t i = 0; i < 100000; i++) BRBloomFilterInsertData(f, (uint8_t *)&i, sizeof(i));
+
+    // about 1 - e^(-100000/288000) of the bits are set
+    if (BRBloomFilterFalsePositiveRate(f) < 0.27 || BRBloomFilterFalsePositiveRate(f) > 0.31)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterFalsePositiveRate() test\n", __func__);
+
+    BRBloomFilterFree(f);
     return r;
 }
 
@@ -2620,6 +4225,245 @@ int BRPeerTests()
     return r;
 }
 
+// a peer on localhost that answers just enough of the protocol for a peer manager to connect and load its filter,
+// and then relays txs to it
+typedef struct {
+    int listener;
+    uint32_t lastBlock;
+    BRTransaction **txs;
+    size_t txCount, syncedIdx; // txs from syncedIdx on are relayed after syncing, when the peer manager sends getaddr
+    BRBloomFilter *filter; // the last filter loaded by the peer manager
+} BRMockPeer;
+
+static void _mockPeerSend(int socket, const char *type, const uint8_t *payload, size_t payloadLen)
+{
+    uint8_t msg[24 + payloadLen];
+    UInt256 hash;
+
+    memset(msg, 0, 24);
+    UInt32SetLE(msg, BR_CHAIN_PARAMS.magicNumber);
+    strncpy((char *)&msg[4], type, 12);
+    UInt32SetLE(&msg[16], (uint32_t)payloadLen);
+    BRSHA256_2(&hash, payload, payloadLen);
+    memcpy(&msg[20], hash.u8, sizeof(uint32_t)); // checksum
+    if (payloadLen > 0) memcpy(&msg[24], payload, payloadLen);
+    if (write(socket, msg, sizeof(msg)) != sizeof(msg)) printf("mock peer write failed\n");
+}
+
+static void _mockPeerSendInv(int socket, const UInt256 txHashes[], size_t txCount)
+{
+    uint8_t inv[1 + txCount*(sizeof(uint32_t) + sizeof(UInt256))];
+
+    inv[0] = (uint8_t)txCount;
+
+    for (size_t i = 0; i < txCount; i++) {
+        UInt32SetLE(&inv[1 + i*(sizeof(uint32_t) + sizeof(UInt256))], 1); // inv_tx
+        UInt256Set(&inv[1 + i*(sizeof(uint32_t) + sizeof(UInt256)) + sizeof(uint32_t)], txHashes[i]);
+    }
+
+    _mockPeerSend(socket, "inv", inv, sizeof(inv));
+}
+
+static int _mockPeerRead(int socket, uint8_t *buf, size_t len)
+{
+    ssize_t n = 1;
+
+    for (size_t off = 0; n > 0 && off < len; off += n) n = read(socket, &buf[off], len - off);
+    return (n > 0 || len == 0);
+}
+
+static void *_mockPeerThread(void *arg)
+{
+    BRMockPeer *mock = arg;
+    int socket = accept(mock->listener, NULL, NULL);
+    uint8_t header[24], version[86], *payload = NULL;
+    size_t off = 0, len;
+    char type[13];
+
+    UInt32SetLE(&version[off], 70015); // protocol version
+    off += sizeof(uint32_t);
+    UInt64SetLE(&version[off], SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM | BR_CHAIN_PARAMS.services);
+    off += sizeof(uint64_t);
+    UInt64SetLE(&version[off], (uint64_t)time(NULL));
+    off += sizeof(uint64_t);
+    memset(&version[off], 0, 61); // addresses, nonce and an empty useragent
+    off += 61;
+    UInt32SetLE(&version[off], mock->lastBlock);
+    off += sizeof(uint32_t);
+    version[off++] = 1; // relay
+
+    while (socket >= 0 && _mockPeerRead(socket, header, sizeof(header))) {
+        memcpy(type, &header[4], 12);
+        type[12] = '\0';
+        len = UInt32GetLE(&header[16]);
+        payload = realloc(payload, len + 1);
+        if (! payload || ! _mockPeerRead(socket, payload, len)) break;
+
+        if (strcmp(type, "version") == 0) {
+            _mockPeerSend(socket, "version", version, off);
+            _mockPeerSend(socket, "verack", NULL, 0);
+        }
+        else if (strcmp(type, "ping") == 0) _mockPeerSend(socket, "pong", payload, len);
+        else if (strcmp(type, "filterload") == 0) {
+            int first = (mock->filter == NULL);
+
+            if (mock->filter) BRBloomFilterFree(mock->filter);
+            mock->filter = BRBloomFilterParse(payload, len);
+
+            for (size_t i = 0; first && i < mock->syncedIdx; i++) {
+                uint8_t buf[BRTransactionSerialize(mock->txs[i], NULL, 0)];
+
+                _mockPeerSend(socket, "tx", buf, BRTransactionSerialize(mock->txs[i], buf, sizeof(buf)));
+            }
+        }
+        else if (strcmp(type, "mempool") == 0) { // an inv of a tx it already has completes the mempool request
+            _mockPeerSendInv(socket, &mock->txs[0]->txHash, 1);
+        }
+        else if (strcmp(type, "getaddr") == 0) {
+            UInt256 txHashes[mock->txCount];
+
+            for (size_t i = mock->syncedIdx; i < mock->txCount; i++) txHashes[i] = mock->txs[i]->txHash;
+            _mockPeerSendInv(socket, &txHashes[mock->syncedIdx], mock->txCount - mock->syncedIdx);
+        }
+        else if (strcmp(type, "getdata") == 0) { // sends the requested tx, then an inv of them that's now a known one
+            UInt256 txHashes[mock->txCount];
+            size_t n = 0, o = 0, count = (size_t)BRVarInt(payload, len, &o);
+
+            for (size_t i = 0; i < count && n < mock->txCount && o + sizeof(uint32_t) + sizeof(UInt256) <= len; i++) {
+                UInt256 hash = UInt256Get(&payload[o + sizeof(uint32_t)]);
+
+                o += sizeof(uint32_t) + sizeof(UInt256);
+
+                for (size_t j = 0; j < mock->txCount; j++) {
+                    if (! UInt256Eq(mock->txs[j]->txHash, hash)) continue;
+                    uint8_t buf[BRTransactionSerialize(mock->txs[j], NULL, 0)];
+
+                    _mockPeerSend(socket, "tx", buf, BRTransactionSerialize(mock->txs[j], buf, sizeof(buf)));
+                    txHashes[n++] = hash;
+                }
+            }
+
+            if (n > 0) _mockPeerSendInv(socket, txHashes, n);
+        }
+    }
+
+    free(payload);
+    if (socket >= 0) close(socket);
+    return NULL;
+}
+
+int BRPeerManagerTests()
+{
+    int r = 1;
+    UInt256 inHash = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    BRWallet *wallets[] = { BRWalletNew(NULL, 0, BRBIP32MasterPubKey("", 1)),
+                            BRWalletNew(NULL, 0, BRBIP32MasterPubKey("1", 1)) };
+    BRAddress recvAddrs[] = { BRWalletReceiveAddress(wallets[0]), BRWalletReceiveAddress(wallets[1]) };
+    BRTransaction *txs[5], *t0, *t1;
+    uint8_t sig[] = { 0 }, otherScript[25] = { OP_DUP, OP_HASH160, 20 }; // pays the hash160 of no wallet's key
+    BRMockPeer mock = { -1, 0, txs, 5, 3, NULL }; // txs[3] and txs[4] are only kept once syncing is done
+    BRPeerManager *manager;
+    struct sockaddr_in sa;
+    socklen_t saLen = sizeof(sa);
+    UInt128 localhost = UINT128_ZERO;
+    struct timespec ts = { 0, 10000000 };
+    pthread_t thread;
+    UInt160 hash;
+
+    memset(&otherScript[3], 0xff, 20);
+    otherScript[23] = OP_EQUALVERIFY, otherScript[24] = OP_CHECKSIG;
+
+    // txs[0] pays wallets[0], txs[1] pays wallets[1], txs[2] pays wallets[0] from it, and txs[3] and txs[4] pay neither
+    for (int i = 0; i < 5; i++) {
+        uint8_t outScript[BRAddressScriptPubKey(NULL, 0, recvAddrs[i % 2].s)];
+        size_t outScriptLen = BRAddressScriptPubKey(outScript, sizeof(outScript), recvAddrs[i % 2].s);
+
+        // signatures aren't verified, and peers skip tx over 100 bytes as having too low a fee, so keep them small
+        txs[i] = BRTransactionNew();
+        if (i != 2) BRTransactionAddInput(txs[i], inHash, i, SATOSHIS*3, NULL, 0, sig, sizeof(sig), TXIN_SEQUENCE);
+        else BRTransactionAddInput(txs[i], txs[1]->txHash, 0, SATOSHIS*2, NULL, 0, sig, sizeof(sig), TXIN_SEQUENCE);
+        if (i < 3) BRTransactionAddOutput(txs[i], SATOSHIS*((i == 1) ? 2 : 1), outScript, outScriptLen);
+        else BRTransactionAddOutput(txs[i], SATOSHIS, otherScript, sizeof(otherScript));
+
+        uint8_t buf[BRTransactionSerialize(txs[i], NULL, 0)];
+
+        BRSHA256_2(&txs[i]->txHash, buf, BRTransactionSerialize(txs[i], buf, sizeof(buf)));
+    }
+
+    // one peer manager, connected to one mock peer, syncs both wallets
+    manager = BRPeerManagerNew(&BR_CHAIN_PARAMS, wallets[0], (uint32_t)time(NULL), NULL, 0, NULL, 0,
+                               BLOOM_DEFAULT_FALSEPOSITIVE_RATE);
+    BRPeerManagerAddWallet(manager, wallets[1], (uint32_t)time(NULL));
+    BRPeerManagerAddWallet(manager, wallets[1], (uint32_t)time(NULL)); // adding it again does nothing
+    BRWalletSetTxPoolLimits(wallets[0], 1, TX_POOL_MAX_AGE); // txs[4] evicts txs[3] from wallets[0]'s pool only
+    mock.lastBlock = BRPeerManagerLastBlockHeight(manager);
+    mock.listener = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (mock.listener < 0 || bind(mock.listener, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(mock.listener, 1) != 0 || getsockname(mock.listener, (struct sockaddr *)&sa, &saLen) != 0 ||
+        pthread_create(&thread, NULL, _mockPeerThread, &mock) != 0) {
+        r = 0, fprintf(stderr, "***FAILED*** %s: mock peer test\n", __func__);
+    }
+    else {
+        localhost.u16[5] = 0xffff;
+        localhost.u32[3] = sa.sin_addr.s_addr;
+        BRPeerManagerSetFixedPeer(manager, localhost, ntohs(sa.sin_port));
+        BRPeerManagerConnect(manager);
+
+        // the mock peer sends an inv of txs[3] and txs[4] again once they're relayed, so txs[3] is then known to the
+        // peer manager only through wallets[1], and both are added to wallets[0]'s pool twice
+        for (int i = 0; i < 1000 && BRWalletTxPoolStats(wallets[0]).added < 4; i++) nanosleep(&ts, NULL);
+
+        if (BRPeerManagerPeerCount(manager) != 1)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerAddWallet() test 1\n", __func__);
+
+        BRPeerManagerDisconnect(manager);
+        pthread_join(thread, NULL);
+        t0 = BRWalletTransactionForHash(wallets[0], txs[2]->txHash);
+        t1 = BRWalletTransactionForHash(wallets[1], txs[2]->txHash);
+
+        // each tx is registered with the wallets it belongs to, and one belonging to both is copied rather than shared
+        if (! BRWalletTransactionForHash(wallets[0], txs[0]->txHash) ||
+            BRWalletTransactionForHash(wallets[0], txs[1]->txHash) || ! t0 ||
+            ! BRWalletTransactionForHash(wallets[1], txs[1]->txHash) ||
+            BRWalletTransactionForHash(wallets[1], txs[0]->txHash) || ! t1 || t0 == t1)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerAddWallet() test 2\n", __func__);
+
+        if (BRWalletBalance(wallets[0]) != SATOSHIS*2 || BRWalletBalance(wallets[1]) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerAddWallet() test 3\n", __func__);
+
+        // an unconfirmed non-wallet tx is kept in the pool of each wallet, for their invalid tx checks
+        t0 = BRWalletTransactionForHash(wallets[0], txs[4]->txHash);
+        t1 = BRWalletTransactionForHash(wallets[1], txs[4]->txHash);
+        if (! t0 || ! t1 || t0 == t1 || BRWalletTransactions(wallets[0], NULL, 0) != 2)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerAddWallet() test 4\n", __func__);
+
+        // a pool tx that's known through another wallet is copied to each wallet that takes it, rather than shared
+        t0 = BRWalletTransactionForHash(wallets[0], txs[3]->txHash);
+        t1 = BRWalletTransactionForHash(wallets[1], txs[3]->txHash);
+        if (BRWalletTxPoolStats(wallets[0]).added != 4 || ! t1 || t0 == t1)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerAddWallet() test 5\n", __func__);
+
+        for (int i = 0; i < 2; i++) { // the one filter loaded by the peer matches the addresses of both wallets
+            if (mock.filter && BRAddressHash160(&hash, recvAddrs[i].s) &&
+                BRBloomFilterContainsData(mock.filter, hash.u8, sizeof(hash))) continue;
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerAddWallet() test 6\n", __func__);
+        }
+    }
+
+    if (mock.listener >= 0) close(mock.listener);
+    if (mock.filter) BRBloomFilterFree(mock.filter);
+    BRPeerManagerRemoveWallet(manager, wallets[1]);
+    BRPeerManagerFree(manager);
+    BRWalletFree(wallets[1]);
+    BRWalletFree(wallets[0]);
+    for (int i = 0; i < 5; i++) BRTransactionFree(txs[i]);
+    return r;
+}
+
 int BRRunTests()
 {
     int fail = 0;
@@ -2666,6 +4510,8 @@ int BRRunTests()
     printf("%s\n", (BRBloomFilterTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRMerkleBlockTests...               ");
     printf("%s\n", (BRMerkleBlockTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerManagerTests...               ");
+    printf("%s\n", (BRPeerManagerTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolTests...           ");
     printf("%s\n", (BRPaymentProtocolTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolEncryptionTests... ");
@@ -2678,6 +4524,37 @@ int BRRunTests()
     return (fail == 0);
 }
 
+// benchmarks are slow, and are only run when the test binary is given the "bench" argument
+int BRRunBenchmarks()
+{
+    int fail = 0;
+
+    printf("BRWalletLargeBench...               ");
+    printf("%s\n", (BRWalletLargeBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRWalletCoinSelectionBench...       ");
+    printf("%s\n", (BRWalletCoinSelectionBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRWalletContentionBench...          ");
+    printf("%s\n", (BRWalletContentionBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRWalletHistoryPageBench...         ");
+    printf("%s\n", (BRWalletHistoryPageBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRWalletTxBatchBench...             ");
+    printf("%s\n", (BRWalletTxBatchBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRWalletPayoutBench...              ");
+    printf("%s\n", (BRWalletPayoutBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRWalletScalingBench...             ");
+    printf("%s\n", (BRWalletScalingBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRTransactionSignBench...           ");
+    printf("%s\n", (BRTransactionSignBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRTransactionViewBench...           ");
+    printf("%s\n", (BRTransactionViewBench()) ? "success" : (fail++, "***FAIL***"));
+    printf("\n");
+
+    if (fail > 0) printf("%d BENCHMARK(S) ***FAILED***\n", fail);
+    else printf("ALL BENCHMARKS PASSED\n");
+
+    return (fail == 0);
+}
+
 #ifndef BITCOIN_TEST_NO_MAIN
 void syncStarted(void *info)
 {
@@ -2696,7 +4573,7 @@ void txStatusUpdate(void *info)
 
 int main(int argc, const char *argv[])
 {
-    int r = BRRunTests();
+    int r = (argc > 1 && strcmp(argv[1], "bench") == 0) ? BRRunBenchmarks() : BRRunTests();
     
 //    int err = 0;
 //    UInt512 seed = UINT512_ZERO;